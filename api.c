@@ -25,6 +25,10 @@
 #include <unistd.h>
 #include <sys/types.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
 #include "compat.h"
 #include "deviceapi.h"
 #ifdef USE_LIBMICROHTTPD
@@ -60,7 +64,7 @@ static const char SEPARATOR = '|';
 #define SEPSTR "|"
 static const char GPUSEP = ',';
 
-static const char *APIVERSION = "2.3";
+static const char *APIVERSION = "2.4";
 static const char *DEAD = "Dead";
 static const char *SICK = "Sick";
 static const char *NOSTART = "NoStart";
@@ -136,6 +140,7 @@ static const char *OSINFO =
 #define _MINECOIN	"COIN"
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
+#define _CMDSTATS	"CMDSTATS"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -177,11 +182,13 @@ static const char ISJSON = '{';
 #define JSON_MINECOIN	JSON1 _MINECOIN JSON2
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
+#define JSON_CMDSTATS	JSON1 _CMDSTATS JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 
 static const char *JSON_COMMAND = "command";
 static const char *JSON_PARAMETER = "parameter";
+static const char *JSON_KEEPALIVE = "keepalive";
 
 #define MSG_INVGPU 1
 #define MSG_ALRENA 2
@@ -306,6 +313,10 @@ static const char *JSON_PARAMETER = "parameter";
 
 #define MSG_INVNEG 121
 #define MSG_SETQUOTA 122
+#define MSG_CMDSTATS 123
+#define MSG_TELEMETRY 124
+#define MSG_INVTELEM 125
+#define MSG_NOJOIN 126
 
 enum code_severity {
 	SEVERITY_ERR,
@@ -477,6 +488,10 @@ struct CODES {
  { SEVERITY_ERR,   MSG_INVNUM,	PARAM_BOTH,	"Invalid number (%d) for '%s' range is 0-9999" },
  { SEVERITY_ERR,   MSG_INVNEG,	PARAM_BOTH,	"Invalid negative number (%d) for '%s'" },
  { SEVERITY_SUCC,  MSG_SETQUOTA,PARAM_SET,	"Set pool '%s' to quota %d'" },
+ { SEVERITY_SUCC,  MSG_CMDSTATS,PARAM_NONE,	"API command stats" },
+ { SEVERITY_SUCC,  MSG_TELEMETRY,PARAM_COUNT,	"Telemetry stream every %d ms follows" },
+ { SEVERITY_ERR,   MSG_INVTELEM,PARAM_STR,	"Invalid telemetry interval '%s'" },
+ { SEVERITY_ERR,   MSG_NOJOIN,	PARAM_STR,	"Command '%s' cannot be batched" },
  { SEVERITY_ERR,   MSG_CONPAR,	PARAM_NONE,	"Missing config parameters 'name,N'" },
  { SEVERITY_ERR,   MSG_CONVAL,	PARAM_STR,	"Missing config value N for '%s,N'" },
 #ifdef HAVE_AN_FPGA
@@ -505,8 +520,26 @@ static pthread_mutex_t quit_restart_lock;
 static bool do_a_quit;
 static bool do_a_restart;
 
-static time_t when = 0;	// when the request occurred
-static bool per_proc;
+struct api_arena;
+struct api_stats;
+
+// Per-request state, kept by each API worker thread
+struct api_request_state {
+	time_t when;	// when the request occurred
+	bool per_proc;
+	// Where api_data for this request is allocated, if anywhere but the heap
+	struct api_arena *arena;
+	// Counter snapshot the current command formats its reply from, if any
+	struct api_stats *stats;
+};
+static pthread_key_t key_api_request;
+
+static struct api_request_state *api_req()
+{
+	static struct api_request_state nonworker_state;
+	struct api_request_state * const state = pthread_getspecific(key_api_request);
+	return state ? state : &nonworker_state;
+}
 
 struct IP4ACCESS {
 	in_addr_t ip;
@@ -522,10 +555,14 @@ struct IP4ACCESS {
 #define VALIDGROUP(g) (GROUP(g) >= GROUP('A') && GROUP(g) <= GROUP('Z'))
 #define COMMANDS(g) (apigroups[GROUPOFFSET(g)].commands)
 #define DEFINEDGROUP(g) (ISPRIVGROUP(g) || COMMANDS(g) != NULL)
+// Whether group g may use cmds[i]
+#define GROUPALLOWS(g, i) (ISPRIVGROUP(g) || (apigroups[GROUPOFFSET(g)].allowed && (apigroups[GROUPOFFSET(g)].allowed[(i) / 32] & ((uint32_t)1 << ((i) % 32)))))
 
 struct APIGROUPS {
 	// This becomes a string like: "|cmd1|cmd2|cmd3|" so it's quick to search
 	char *commands;
+	// The same, as a bit for each index in cmds[]
+	uint32_t *allowed;
 } apigroups['Z' - 'A' + 1]; // only A=0 to Z=25 (R: noprivs, W: allprivs)
 
 static struct IP4ACCESS *ipaccess = NULL;
@@ -545,13 +582,19 @@ struct io_data {
 	
 	// Whether to add various things
 	bool close;
+	
+	// Where the current reply starts, when several share the buffer
+	size_t reply_start;
+	
+	// Set by the telemetry command to switch the connection to streaming
+	int telemetry_ms;
 };
-static struct io_data *rpc_io_data;
 
 static void io_reinit(struct io_data *io_data)
 {
-	bytes_reset(&io_data->data);
+	bytes_resize(&io_data->data, io_data->reply_start);
 	io_data->close = false;
+	io_data->telemetry_ms = 0;
 }
 
 static
@@ -560,6 +603,7 @@ struct io_data *sock_io_new()
 	struct io_data *io_data = malloc(sizeof(struct io_data));
 	bytes_init(&io_data->data);
 	io_data->sock = INVSOCK;
+	io_data->reply_start = 0;
 	io_reinit(io_data);
 	return io_data;
 }
@@ -611,18 +655,17 @@ size_t io_flush(struct io_data *io_data, bool complete)
 	return sent;
 }
 
+// Replies are buffered in full, and sent by the API thread once the command is done
 static bool io_add(struct io_data *io_data, char *buf)
 {
 	size_t len = strlen(buf);
-	if (bytes_len(&io_data->data) + len > SOCKBUFSIZ)
-		io_flush(io_data, false);
 	bytes_append(&io_data->data, buf, len);
 	return true;
 }
 
 static bool io_put(struct io_data *io_data, char *buf)
 {
-	bytes_reset(&io_data->data);
+	bytes_resize(&io_data->data, io_data->reply_start);
 	return io_add(io_data, buf);
 }
 
@@ -631,11 +674,10 @@ static void io_close(struct io_data *io_data)
 	io_data->close = true;
 }
 
-static void io_free()
+static void io_free(struct io_data * const io_data)
 {
-	bytes_free(&rpc_io_data->data);
-	free(rpc_io_data);
-	rpc_io_data = NULL;
+	bytes_free(&io_data->data);
+	free(io_data);
 }
 
 // This is only called when expected to be needed (rarely)
@@ -700,6 +742,124 @@ static char *escape_string(char *str, bool isjson)
 	return buf;
 }
 
+/*
+ * A request's api_data nodes, names and copied values are carved out of a
+ * per-thread arena, and all released at once when the request is done,
+ * instead of malloc'd and freed one by one. If a request needs more than one
+ * block, they are replaced by a single block big enough for all of it, so
+ * the arena grows to fit the largest reply once and is then just reused.
+ */
+#define API_ARENA_BLOCK	0x10000
+
+struct api_arena_block {
+	struct api_arena_block *next;
+	size_t size;
+};
+#define API_ARENA_HDR	((sizeof(struct api_arena_block) + 15) & ~(size_t)15)
+
+struct api_arena_counts {
+	uint64_t allocs;
+	uint64_t bytes;
+	// Blocks malloc'd for the arena
+	uint32_t blocks;
+};
+
+struct api_arena {
+	struct api_arena_block *cur;
+	size_t used;
+	// Blocks filled up since the last reset
+	struct api_arena_block *full;
+	struct api_arena_counts counts;
+};
+
+static struct api_arena_block *api_arena_block_new(struct api_arena * const arena, const size_t size)
+{
+	struct api_arena_block * const block = malloc(size);
+
+	if (unlikely(!block))
+		quit(1, "Failed to malloc api_arena block");
+	block->next = NULL;
+	block->size = size;
+	++arena->counts.blocks;
+	arena->used = API_ARENA_HDR;
+	return block;
+}
+
+static void *api_arena_alloc(struct api_arena * const arena, size_t sz)
+{
+	struct api_arena_block *block = arena->cur;
+	void *p;
+
+	++arena->counts.allocs;
+	arena->counts.bytes += sz;
+	sz = (sz + 15) & ~(size_t)15;
+	if (!block || arena->used + sz > block->size) {
+		if (block) {
+			block->next = arena->full;
+			arena->full = block;
+		}
+		block = arena->cur = api_arena_block_new(arena, (API_ARENA_HDR + sz > API_ARENA_BLOCK) ? (API_ARENA_HDR + sz) : API_ARENA_BLOCK);
+	}
+	p = &((char *)block)[arena->used];
+	arena->used += sz;
+	return p;
+}
+
+// Releases everything allocated since the last reset
+static void api_arena_reset(struct api_arena * const arena)
+{
+	struct api_arena_block *block, *next;
+	size_t total;
+
+	arena->used = API_ARENA_HDR;
+	if (!arena->full)
+		return;
+
+	total = arena->cur->size;
+	for (block = arena->full; block; block = next) {
+		next = block->next;
+		total += block->size;
+		free(block);
+	}
+	arena->full = NULL;
+	free(arena->cur);
+	arena->cur = api_arena_block_new(arena, total);
+}
+
+static void *api_data_alloc(const size_t sz)
+{
+	struct api_arena * const arena = api_req()->arena;
+	void *p;
+
+	if (arena)
+		return api_arena_alloc(arena, sz);
+
+	p = malloc(sz);
+	if (unlikely(!p))
+		quit(1, "Failed to malloc api_data");
+	return p;
+}
+
+static char *api_data_strdup(const char * const s)
+{
+	const size_t len = strlen(s) + 1;
+
+	return memcpy(api_data_alloc(len), s, len);
+}
+
+// Frees a single item, which must already be unlinked from any list
+static void api_data_free_item(struct api_data * const item)
+{
+	if (item->type == API_JSON)
+		json_decref((json_t *)item->data);
+	if (item->in_arena)
+		return;
+	free(item->name);
+	if (item->data_was_malloc)
+		free(item->data);
+	free(item);
+}
+
 static struct api_data *api_add_extra(struct api_data *root, struct api_data *extra)
 {
 	struct api_data *tmp;
@@ -731,9 +891,10 @@ static struct api_data *api_add_data_full(struct api_data *root, char *name, enu
 {
 	struct api_data *api_data;
 
-	api_data = (struct api_data *)malloc(sizeof(struct api_data));
+	api_data = api_data_alloc(sizeof(struct api_data));
 
-	api_data->name = strdup(name);
+	api_data->in_arena = (api_req()->arena != NULL);
+	api_data->name = api_data_strdup(name);
 	api_data->type = type;
 
 	if (root == NULL) {
@@ -768,33 +929,33 @@ static struct api_data *api_add_data_full(struct api_data *root, char *name, enu
 			case API_ESCAPE:
 			case API_STRING:
 			case API_CONST:
-				api_data->data = (void *)malloc(strlen((char *)data) + 1);
+				api_data->data = api_data_alloc(strlen((char *)data) + 1);
 				strcpy((char*)(api_data->data), (char *)data);
 				break;
 			case API_UINT8:
 				/* Most OSs won't really alloc less than 4 */
-				api_data->data = malloc(4);
+				api_data->data = api_data_alloc(4);
 				*(uint8_t *)api_data->data = *(uint8_t *)data;
 				break;
 			case API_UINT16:
 				/* Most OSs won't really alloc less than 4 */
-				api_data->data = malloc(4);
+				api_data->data = api_data_alloc(4);
 				*(uint16_t *)api_data->data = *(uint16_t *)data;
 				break;
 			case API_INT:
-				api_data->data = (void *)malloc(sizeof(int));
+				api_data->data = api_data_alloc(sizeof(int));
 				*((int *)(api_data->data)) = *((int *)data);
 				break;
 			case API_UINT:
-				api_data->data = (void *)malloc(sizeof(unsigned int));
+				api_data->data = api_data_alloc(sizeof(unsigned int));
 				*((unsigned int *)(api_data->data)) = *((unsigned int *)data);
 				break;
 			case API_UINT32:
-				api_data->data = (void *)malloc(sizeof(uint32_t));
+				api_data->data = api_data_alloc(sizeof(uint32_t));
 				*((uint32_t *)(api_data->data)) = *((uint32_t *)data);
 				break;
 			case API_UINT64:
-				api_data->data = (void *)malloc(sizeof(uint64_t));
+				api_data->data = api_data_alloc(sizeof(uint64_t));
 				*((uint64_t *)(api_data->data)) = *((uint64_t *)data);
 				break;
 			case API_DOUBLE:
@@ -806,24 +967,24 @@ static struct api_data *api_add_data_full(struct api_data *root, char *name, enu
 			case API_HS:
 			case API_DIFF:
 			case API_PERCENT:
-				api_data->data = (void *)malloc(sizeof(double));
+				api_data->data = api_data_alloc(sizeof(double));
 				*((double *)(api_data->data)) = *((double *)data);
 				break;
 			case API_BOOL:
-				api_data->data = (void *)malloc(sizeof(bool));
+				api_data->data = api_data_alloc(sizeof(bool));
 				*((bool *)(api_data->data)) = *((bool *)data);
 				break;
 			case API_TIMEVAL:
-				api_data->data = (void *)malloc(sizeof(struct timeval));
+				api_data->data = api_data_alloc(sizeof(struct timeval));
 				memcpy(api_data->data, data, sizeof(struct timeval));
 				break;
 			case API_TIME:
-				api_data->data = (void *)malloc(sizeof(time_t));
+				api_data->data = api_data_alloc(sizeof(time_t));
 				*(time_t *)(api_data->data) = *((time_t *)data);
 				break;
 			case API_VOLTS:
 			case API_TEMP:
-				api_data->data = (void *)malloc(sizeof(float));
+				api_data->data = api_data_alloc(sizeof(float));
 				*((float *)(api_data->data)) = *((float *)data);
 				break;
 			case API_JSON:
@@ -1075,22 +1236,15 @@ static struct api_data *print_data(struct api_data *root, char *buf, bool isjson
 
 		buf = strchr(buf, '\0');
 
-		free(root->name);
-		if (root->type == API_JSON)
-			json_decref((json_t *)root->data);
-		if (root->data_was_malloc)
-			free(root->data);
-
-		if (root->next == root) {
-			free(root);
+		tmp = root;
+		if (root->next == root)
 			root = NULL;
-		} else {
-			tmp = root;
+		else {
 			root = tmp->next;
 			root->prev = tmp->prev;
 			root->prev->next = root;
-			free(tmp);
 		}
+		api_data_free_item(tmp);
 	}
 
 	strcpy(buf, isjson ? JSON5 : SEPSTR);
@@ -1114,7 +1268,7 @@ static int numpgas()
 		if (devices[i]->drv == &cpu_drv)
 			continue;
 #endif
-		if (devices[i]->device != devices[i] && !per_proc)
+		if (devices[i]->device != devices[i] && !api_req()->per_proc)
 			continue;
 		++count;
 	}
@@ -1137,7 +1291,7 @@ static int pgadevice(int pgaid)
 		if (devices[i]->drv == &cpu_drv)
 			continue;
 #endif
-		if (devices[i]->device != devices[i] && !per_proc)
+		if (devices[i]->device != devices[i] && !api_req()->per_proc)
 			continue;
 		++count;
 		if (count == (pgaid + 1))
@@ -1276,7 +1430,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 			}
 
 			root = api_add_string(root, _STATUS, severity, false);
-			root = api_add_time(root, "When", &when, false);
+			root = api_add_time(root, "When", &api_req()->when, false);
 			root = api_add_int(root, "Code", &messageid, false);
 			root = api_add_escape(root, "Msg", buf, false);
 			root = api_add_escape(root, "Description", opt_api_description, false);
@@ -1290,7 +1444,7 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 	}
 
 	root = api_add_string(root, _STATUS, "F", false);
-	root = api_add_time(root, "When", &when, false);
+	root = api_add_time(root, "When", &api_req()->when, false);
 	int id = -1;
 	root = api_add_int(root, "Code", &id, false);
 	sprintf(buf, "%d", messageid);
@@ -1435,7 +1589,7 @@ struct api_data *api_add_device_identifier(struct api_data *root, struct cgpu_in
 {
 	root = api_add_string(root, "Name", cgpu->drv->name, false);
 	root = api_add_int(root, "ID", &(cgpu->device_id), false);
-	if (per_proc)
+	if (api_req()->per_proc)
 		root = api_add_int(root, "ProcID", &(cgpu->proc_id), false);
 	return root;
 }
@@ -1450,7 +1604,7 @@ int find_index_by_cgpu(struct cgpu_info *cgpu)
 	{
 		if (devices[i] == cgpu)
 			break;
-		if (devices[i]->device != devices[i] && !per_proc)
+		if (devices[i]->device != devices[i] && !api_req()->per_proc)
 			continue;
 		if (cgpu->devtype == devices[i]->devtype)
 			++n;
@@ -1459,6 +1613,264 @@ int find_index_by_cgpu(struct cgpu_info *cgpu)
 	return n;
 }
 
+/*
+ * The counters shown by devs, procs, pools and summary (and the commands for
+ * one device) are copied into an api_stats snapshot by hashmeter once every
+ * log interval, and again after a command changes the miner. A snapshot is
+ * never modified once published: a request only takes a reference to the
+ * latest one, under api_stats_lock (which nothing else holds), and formats
+ * its replies from that, so polling doesn't touch the miner's locks however
+ * often it happens, and all the counters in one reply were read together.
+ * Devices and pools added since the last snapshot are read live until the
+ * next one, as is everything before the first.
+ */
+struct api_stats_proc {
+	struct cgpu_info *cgpu;
+	double runtime;
+	double total_mhashes;
+	double rolling;
+	double utility;
+	int accepted, rejected, stale;
+	int hw_errors, bad_nonces, diff1;
+	double diff_accepted, diff_rejected, diff_stale;
+	int last_share_pool;
+	time_t last_share_pool_time;
+	double last_share_diff;
+	time_t last_device_valid_work;
+};
+
+struct api_stats_pool {
+	struct pool *pool;
+	unsigned int getwork_requested;
+	int accepted, rejected, works;
+	unsigned int discarded_work, stale_shares;
+	unsigned int getfail_occasions, remotefail_occasions;
+	time_t last_share_time;
+	int diff1;
+	double diff_accepted, diff_rejected, diff_stale;
+	double last_share_diff;
+	uint64_t best_diff;
+};
+
+struct api_stats_global {
+	double total_secs;
+	double total_rolling;
+	double total_mhashes_done;
+	unsigned int found_blocks, new_blocks, local_work;
+	unsigned int total_go, total_ro;
+	int total_getworks, total_accepted, total_rejected;
+	int total_discarded, total_stale;
+	int total_diff1, hw_errors, total_bad_nonces;
+	double total_diff_accepted, total_diff_rejected, total_diff_stale;
+	uint64_t best_diff;
+};
+
+struct api_stats {
+	unsigned long version;
+	int refs;
+	time_t when;
+	struct api_stats_global global;
+	// Indexed like devices[] and pools[] when taken
+	int proc_count;
+	struct api_stats_proc *procs;
+	int pool_count;
+	struct api_stats_pool *pools;
+};
+
+static pthread_mutex_t api_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct api_stats *api_stats_cur;
+static unsigned long api_stats_version;
+// Held while taking a snapshot, so they are published in order
+static pthread_mutex_t api_stats_publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void api_stats_read_global(struct api_stats_global * const g)
+{
+	// stop hashmeter() changing some while copying
+	mutex_lock(&hash_lock);
+	hashmeter_flush_pending();
+	g->total_secs = total_secs;
+	g->total_rolling = total_rolling;
+	g->total_mhashes_done = total_mhashes_done;
+	g->found_blocks = found_blocks;
+	g->new_blocks = new_blocks;
+	g->local_work = local_work;
+	g->total_go = total_go;
+	g->total_ro = total_ro;
+	g->total_getworks = total_getworks;
+	g->total_accepted = total_accepted;
+	g->total_rejected = total_rejected;
+	g->total_discarded = total_discarded;
+	g->total_stale = total_stale;
+	g->total_diff_accepted = total_diff_accepted;
+	g->total_diff_rejected = total_diff_rejected;
+	g->total_diff_stale = total_diff_stale;
+	g->best_diff = best_diff;
+	mutex_unlock(&hash_lock);
+}
+
+static void api_stats_read_proc(struct api_stats_proc * const p, struct cgpu_info * const proc)
+{
+	p->cgpu = proc;
+	p->runtime = cgpu_runtime(proc);
+	p->utility = cgpu_utility(proc);
+	mutex_lock(&proc->hashmeter_lock);
+	p->total_mhashes = proc->total_mhashes;
+	p->rolling = proc->rolling;
+	mutex_unlock(&proc->hashmeter_lock);
+	p->accepted = proc->accepted;
+	p->rejected = proc->rejected;
+	p->stale = proc->stale;
+	p->hw_errors = proc->hw_errors;
+	p->bad_nonces = proc->bad_nonces;
+	p->diff1 = proc->diff1;
+	p->diff_accepted = proc->diff_accepted;
+	p->diff_rejected = proc->diff_rejected;
+	p->diff_stale = proc->diff_stale;
+	p->last_share_pool = proc->last_share_pool;
+	p->last_share_pool_time = proc->last_share_pool_time;
+	p->last_share_diff = proc->last_share_diff;
+	p->last_device_valid_work = proc->last_device_valid_work;
+}
+
+static void api_stats_read_pool(struct api_stats_pool * const p, struct pool * const pool)
+{
+	p->pool = pool;
+	p->getwork_requested = pool->getwork_requested;
+	p->accepted = pool->accepted;
+	p->rejected = pool->rejected;
+	p->works = pool->works;
+	p->discarded_work = pool->discarded_work;
+	p->stale_shares = pool->stale_shares;
+	p->getfail_occasions = pool->getfail_occasions;
+	p->remotefail_occasions = pool->remotefail_occasions;
+	p->last_share_time = pool->last_share_time;
+	p->diff1 = pool->diff1;
+	p->diff_accepted = pool->diff_accepted;
+	p->diff_rejected = pool->diff_rejected;
+	p->diff_stale = pool->diff_stale;
+	p->last_share_diff = pool->last_share_diff;
+	p->best_diff = pool->best_diff;
+}
+
+static void api_stats_put(struct api_stats * const stats)
+{
+	bool unused;
+
+	mutex_lock(&api_stats_lock);
+	unused = !--stats->refs;
+	mutex_unlock(&api_stats_lock);
+
+	if (unused) {
+		free(stats->procs);
+		free(stats->pools);
+		free(stats);
+	}
+}
+
+// Returns a reference to the latest snapshot, or NULL if none was taken yet
+static struct api_stats *api_stats_get()
+{
+	struct api_stats *stats;
+
+	mutex_lock(&api_stats_lock);
+	stats = api_stats_cur;
+	if (stats)
+		++stats->refs;
+	mutex_unlock(&api_stats_lock);
+
+	return stats;
+}
+
+void api_stats_publish(void)
+{
+	struct api_stats *stats, *old;
+	int i;
+
+	stats = malloc(sizeof(*stats));
+	if (unlikely(!stats))
+		quit(1, "Failed to malloc api_stats");
+
+	mutex_lock(&api_stats_publish_lock);
+
+	*stats = (struct api_stats){
+		// For the published pointer
+		.refs = 1,
+		.when = time(NULL),
+	};
+	api_stats_read_global(&stats->global);
+
+	rd_lock(&devices_lock);
+	stats->proc_count = total_devices;
+	stats->procs = malloc(total_devices * sizeof(*stats->procs));
+	if (unlikely(total_devices && !stats->procs))
+		quit(1, "Failed to malloc api_stats procs");
+	for (i = 0; i < total_devices; ++i)
+		api_stats_read_proc(&stats->procs[i], devices[i]);
+	rd_unlock(&devices_lock);
+
+	// Summed from the same reads as devs, so they agree
+	for (i = 0; i < stats->proc_count; ++i) {
+		stats->global.total_diff1 += stats->procs[i].diff1;
+		stats->global.hw_errors += stats->procs[i].hw_errors;
+		stats->global.total_bad_nonces += stats->procs[i].bad_nonces;
+	}
+
+	mutex_lock(&pools_lock);
+	stats->pool_count = total_pools;
+	stats->pools = malloc(total_pools * sizeof(*stats->pools));
+	if (unlikely(total_pools && !stats->pools))
+		quit(1, "Failed to malloc api_stats pools");
+	for (i = 0; i < total_pools; ++i)
+		api_stats_read_pool(&stats->pools[i], pools[i]);
+	mutex_unlock(&pools_lock);
+
+	mutex_lock(&api_stats_lock);
+	stats->version = ++api_stats_version;
+	old = api_stats_cur;
+	api_stats_cur = stats;
+	mutex_unlock(&api_stats_lock);
+
+	mutex_unlock(&api_stats_publish_lock);
+
+	// The published pointer held a reference
+	if (old)
+		api_stats_put(old);
+}
+
+// The request's snapshot of global counters, or a live read into buf without one
+static struct api_stats_global *api_stats_global_get(struct api_stats_global * const buf)
+{
+	struct api_stats * const stats = api_req()->stats;
+
+	if (stats)
+		return &stats->global;
+	get_share_totals(&buf->total_diff1, &buf->hw_errors, &buf->total_bad_nonces);
+	api_stats_read_global(buf);
+	return buf;
+}
+
+static struct api_stats_proc *api_stats_proc_get(struct cgpu_info * const proc, struct api_stats_proc * const buf)
+{
+	struct api_stats * const stats = api_req()->stats;
+	const int i = proc->cgminer_id;
+
+	if (stats && i < stats->proc_count && stats->procs[i].cgpu == proc)
+		return &stats->procs[i];
+	api_stats_read_proc(buf, proc);
+	return buf;
+}
+
+static struct api_stats_pool *api_stats_pool_get(struct pool * const pool, struct api_stats_pool * const buf)
+{
+	struct api_stats * const stats = api_req()->stats;
+	const int i = pool->pool_no;
+
+	if (stats && i < stats->pool_count && stats->pools[i].pool == pool)
+		return &stats->pools[i];
+	api_stats_read_pool(buf, pool);
+	return buf;
+}
+
 static void devdetail_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson, bool precom)
 {
 	struct api_data *root = NULL;
@@ -1471,7 +1883,7 @@ static void devdetail_an(struct io_data *io_data, struct cgpu_info *cgpu, bool i
 
 	root = api_add_int(root, "DEVDETAILS", &n, true);
 	root = api_add_device_identifier(root, cgpu);
-	if (!per_proc)
+	if (!api_req()->per_proc)
 		root = api_add_int(root, "Processors", &cgpu->procs, false);
 	root = api_add_string(root, "Driver", cgpu->drv->dname, false);
 	if (cgpu->kname)
@@ -1507,7 +1919,8 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 
 	n = find_index_by_cgpu(cgpu);
 
-	double runtime = cgpu_runtime(cgpu);
+	struct api_stats_proc *ps, psbuf;
+	double runtime = 0;
 	bool enabled = false;
 	double total_mhashes = 0, rolling = 0, utility = 0;
 	enum alive status = cgpu->status;
@@ -1518,37 +1931,39 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 	int last_share_pool = -1;
 	time_t last_share_pool_time = -1, last_device_valid_work = -1;
 	double last_share_diff = -1;
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = api_req()->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
-		cgpu_utility(proc);
+		ps = api_stats_proc_get(proc, &psbuf);
+		if (proc == cgpu)
+			runtime = ps->runtime;
 		if (proc->deven != DEV_DISABLED)
 			enabled = true;
-		total_mhashes += proc->total_mhashes;
-		rolling += proc->rolling;
-		utility += proc->utility;
-		accepted += proc->accepted;
-		rejected += proc->rejected;
-		stale += proc->stale;
-		hw_errors += proc->hw_errors;
-		diff1 += proc->diff1;
-		diff_accepted += proc->diff_accepted;
-		diff_rejected += proc->diff_rejected;
-		diff_stale += proc->diff_stale;
-		bad_nonces += proc->bad_nonces;
+		total_mhashes += ps->total_mhashes;
+		rolling += ps->rolling;
+		utility += ps->utility;
+		accepted += ps->accepted;
+		rejected += ps->rejected;
+		stale += ps->stale;
+		hw_errors += ps->hw_errors;
+		diff1 += ps->diff1;
+		diff_accepted += ps->diff_accepted;
+		diff_rejected += ps->diff_rejected;
+		diff_stale += ps->diff_stale;
+		bad_nonces += ps->bad_nonces;
 		if (status != proc->status)
 			status = LIFE_MIXED;
 		if (proc->temp > temp)
 			temp = proc->temp;
-		if (proc->last_share_pool_time > last_share_pool_time)
+		if (ps->last_share_pool_time > last_share_pool_time)
 		{
-			last_share_pool_time = proc->last_share_pool_time;
-			last_share_pool = proc->last_share_pool;
-			last_share_diff = proc->last_share_diff;
+			last_share_pool_time = ps->last_share_pool_time;
+			last_share_pool = ps->last_share_pool;
+			last_share_diff = ps->last_share_diff;
 		}
-		if (proc->last_device_valid_work > last_device_valid_work)
-			last_device_valid_work = proc->last_device_valid_work;
-		if (per_proc)
+		if (ps->last_device_valid_work > last_device_valid_work)
+			last_device_valid_work = ps->last_device_valid_work;
+		if (api_req()->per_proc)
 			break;
 	}
 
@@ -1593,7 +2008,7 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 			(double)(diff_rejected) / (double)(diff1) : 0;
 	root = api_add_percent(root, "Device Rejected%", &rejp, false);
 
-	if ((per_proc || cgpu->procs <= 1) && cgpu->drv->get_api_extra_device_status)
+	if ((api_req()->per_proc || cgpu->procs <= 1) && cgpu->drv->get_api_extra_device_status)
 		root = api_add_extra(root, cgpu->drv->get_api_extra_device_status(cgpu));
 
 	root = print_data(root, buf, isjson, precom);
@@ -1647,7 +2062,7 @@ devinfo_internal(void (*func)(struct io_data *, struct cgpu_info*, bool, bool),
 
 	for (i = 0; i < total_devices; ++i) {
 		cgpu = get_devices(i);
-		if (per_proc || cgpu->device == cgpu)
+		if (api_req()->per_proc || cgpu->device == cgpu)
 			func(io_data, cgpu, isjson, isjson && i > 0);
 	}
 
@@ -1790,10 +2205,10 @@ static void pgaenable(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char
 	cgpu = get_devices(dev);
 
 	applog(LOG_DEBUG, "API: request to pgaenable %s id %d device %d %s",
-			per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
+			api_req()->per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
 
 	already = true;
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = api_req()->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
 		if (proc->deven == DEV_DISABLED)
@@ -1851,10 +2266,10 @@ static void pgadisable(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 	cgpu = get_devices(dev);
 
 	applog(LOG_DEBUG, "API: request to pgadisable %s id %d device %d %s",
-			per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
+			api_req()->per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
 
 	already = true;
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = api_req()->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
 		if (proc->deven != DEV_DISABLED)
@@ -1966,10 +2381,13 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 
 	for (i = 0; i < total_pools; i++) {
 		struct pool *pool = pools[i];
+		struct api_stats_pool *ps, psbuf;
 
 		if (pool->removed)
 			continue;
 
+		ps = api_stats_pool_get(pool, &psbuf);
+
 		switch (pool->enabled) {
 			case POOL_DISABLED:
 				status = (char *)DISABLED;
@@ -1999,40 +2417,40 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_int(root, "Priority", &(pool->prio), false);
 		root = api_add_int(root, "Quota", &pool->quota, false);
 		root = api_add_string(root, "Long Poll", lp, false);
-		root = api_add_uint(root, "Getworks", &(pool->getwork_requested), false);
-		root = api_add_int(root, "Accepted", &(pool->accepted), false);
-		root = api_add_int(root, "Rejected", &(pool->rejected), false);
-		root = api_add_int(root, "Works", &pool->works, false);
-		root = api_add_uint(root, "Discarded", &(pool->discarded_work), false);
-		root = api_add_uint(root, "Stale", &(pool->stale_shares), false);
-		root = api_add_uint(root, "Get Failures", &(pool->getfail_occasions), false);
-		root = api_add_uint(root, "Remote Failures", &(pool->remotefail_occasions), false);
+		root = api_add_uint(root, "Getworks", &(ps->getwork_requested), false);
+		root = api_add_int(root, "Accepted", &(ps->accepted), false);
+		root = api_add_int(root, "Rejected", &(ps->rejected), false);
+		root = api_add_int(root, "Works", &ps->works, false);
+		root = api_add_uint(root, "Discarded", &(ps->discarded_work), false);
+		root = api_add_uint(root, "Stale", &(ps->stale_shares), false);
+		root = api_add_uint(root, "Get Failures", &(ps->getfail_occasions), false);
+		root = api_add_uint(root, "Remote Failures", &(ps->remotefail_occasions), false);
 		root = api_add_escape(root, "User", pool->rpc_user, false);
-		root = api_add_time(root, "Last Share Time", &(pool->last_share_time), false);
-		root = api_add_int(root, "Diff1 Shares", &(pool->diff1), false);
+		root = api_add_time(root, "Last Share Time", &(ps->last_share_time), false);
+		root = api_add_int(root, "Diff1 Shares", &(ps->diff1), false);
 		if (pool->rpc_proxy) {
 			root = api_add_escape(root, "Proxy", pool->rpc_proxy, false);
 		} else {
 			root = api_add_const(root, "Proxy", BLANK, false);
 		}
-		root = api_add_diff(root, "Difficulty Accepted", &(pool->diff_accepted), false);
-		root = api_add_diff(root, "Difficulty Rejected", &(pool->diff_rejected), false);
-		root = api_add_diff(root, "Difficulty Stale", &(pool->diff_stale), false);
-		root = api_add_diff(root, "Last Share Difficulty", &(pool->last_share_diff), false);
+		root = api_add_diff(root, "Difficulty Accepted", &(ps->diff_accepted), false);
+		root = api_add_diff(root, "Difficulty Rejected", &(ps->diff_rejected), false);
+		root = api_add_diff(root, "Difficulty Stale", &(ps->diff_stale), false);
+		root = api_add_diff(root, "Last Share Difficulty", &(ps->last_share_diff), false);
 		root = api_add_bool(root, "Has Stratum", &(pool->has_stratum), false);
 		root = api_add_bool(root, "Stratum Active", &(pool->stratum_active), false);
 		if (pool->stratum_active)
 			root = api_add_escape(root, "Stratum URL", pool->stratum_url, false);
 		else
 			root = api_add_const(root, "Stratum URL", BLANK, false);
-		root = api_add_uint64(root, "Best Share", &(pool->best_diff), true);
+		root = api_add_uint64(root, "Best Share", &(ps->best_diff), true);
 		if (pool->admin_msg)
 			root = api_add_escape(root, "Message", pool->admin_msg, true);
-		double rejp = (pool->diff_accepted + pool->diff_rejected + pool->diff_stale) ?
-				(double)(pool->diff_rejected) / (double)(pool->diff_accepted + pool->diff_rejected + pool->diff_stale) : 0;
+		double rejp = (ps->diff_accepted + ps->diff_rejected + ps->diff_stale) ?
+				(double)(ps->diff_rejected) / (double)(ps->diff_accepted + ps->diff_rejected + ps->diff_stale) : 0;
 		root = api_add_percent(root, "Pool Rejected%", &rejp, false);
-		double stalep = (pool->diff_accepted + pool->diff_rejected + pool->diff_stale) ?
-				(double)(pool->diff_stale) / (double)(pool->diff_accepted + pool->diff_rejected + pool->diff_stale) : 0;
+		double stalep = (ps->diff_accepted + ps->diff_rejected + ps->diff_stale) ?
+				(double)(ps->diff_stale) / (double)(ps->diff_accepted + ps->diff_rejected + ps->diff_stale) : 0;
 		root = api_add_percent(root, "Pool Stale%", &stalep, false);
 
 		root = print_data(root, buf, isjson, isjson && (i > 0));
@@ -2043,6 +2461,11 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		io_close(io_data);
 }
 
+#ifdef USE_LIBEVENT
+extern bool stratumsrv_get_client_stats(unsigned *out_used, unsigned *out_peak, unsigned *out_capacity);
+extern bool stratumsrv_get_notify_stats(unsigned long *out_last_us, unsigned long *out_max_us, double *out_avg_us);
+#endif
+
 static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
@@ -2059,14 +2482,15 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	message(io_data, MSG_SUMM, 0, NULL, isjson);
 	io_open = io_add(io_data, isjson ? COMSTR JSON_SUMMARY : _SUMMARY COMSTR);
 
-	// stop hashmeter() changing some while copying
-	mutex_lock(&hash_lock);
+	struct api_stats_global gbuf;
+	struct api_stats_global * const g = api_stats_global_get(&gbuf);
+	const double total_secs = g->total_secs;
 
-	utility = total_accepted / ( total_secs ? total_secs : 1 ) * 60;
-	mhs = total_mhashes_done / total_secs;
-	work_utility = total_diff1 / ( total_secs ? total_secs : 1 ) * 60;
+	utility = g->total_accepted / ( total_secs ? total_secs : 1 ) * 60;
+	mhs = g->total_mhashes_done / total_secs;
+	work_utility = g->total_diff1 / ( total_secs ? total_secs : 1 ) * 60;
 
-	root = api_add_elapsed(root, "Elapsed", &(total_secs), true);
+	root = api_add_elapsed(root, "Elapsed", &(g->total_secs), true);
 #ifdef WANT_CPUMINE
 	if (opt_n_threads)
 	root = api_add_string(root, "Algorithm", algo, false);
@@ -2074,40 +2498,81 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	root = api_add_mhs(root, "MHS av", &(mhs), false);
 	char mhsname[27];
 	sprintf(mhsname, "MHS %ds", opt_log_interval);
-	root = api_add_mhs(root, mhsname, &(total_rolling), false);
-	root = api_add_uint(root, "Found Blocks", &(found_blocks), true);
-	root = api_add_int(root, "Getworks", &(total_getworks), true);
-	root = api_add_int(root, "Accepted", &(total_accepted), true);
-	root = api_add_int(root, "Rejected", &(total_rejected), true);
-	root = api_add_int(root, "Hardware Errors", &(hw_errors), true);
+	root = api_add_mhs(root, mhsname, &(g->total_rolling), true);
+	root = api_add_uint(root, "Found Blocks", &(g->found_blocks), true);
+	root = api_add_int(root, "Getworks", &(g->total_getworks), true);
+	root = api_add_int(root, "Accepted", &(g->total_accepted), true);
+	root = api_add_int(root, "Rejected", &(g->total_rejected), true);
+	root = api_add_int(root, "Hardware Errors", &(g->hw_errors), true);
 	root = api_add_utility(root, "Utility", &(utility), false);
-	root = api_add_int(root, "Discarded", &(total_discarded), true);
-	root = api_add_int(root, "Stale", &(total_stale), true);
-	root = api_add_uint(root, "Get Failures", &(total_go), true);
-	root = api_add_uint(root, "Local Work", &(local_work), true);
-	root = api_add_uint(root, "Remote Failures", &(total_ro), true);
-	root = api_add_uint(root, "Network Blocks", &(new_blocks), true);
-	root = api_add_mhtotal(root, "Total MH", &(total_mhashes_done), true);
-	root = api_add_int(root, "Diff1 Work", &total_diff1, true);
+	root = api_add_int(root, "Discarded", &(g->total_discarded), true);
+	root = api_add_int(root, "Stale", &(g->total_stale), true);
+	root = api_add_uint(root, "Get Failures", &(g->total_go), true);
+	root = api_add_uint(root, "Local Work", &(g->local_work), true);
+	root = api_add_uint(root, "Remote Failures", &(g->total_ro), true);
+	root = api_add_uint(root, "Network Blocks", &(g->new_blocks), true);
+	root = api_add_mhtotal(root, "Total MH", &(g->total_mhashes_done), true);
+	root = api_add_int(root, "Diff1 Work", &(g->total_diff1), true);
 	root = api_add_utility(root, "Work Utility", &(work_utility), false);
-	root = api_add_diff(root, "Difficulty Accepted", &(total_diff_accepted), true);
-	root = api_add_diff(root, "Difficulty Rejected", &(total_diff_rejected), true);
-	root = api_add_diff(root, "Difficulty Stale", &(total_diff_stale), true);
-	root = api_add_uint64(root, "Best Share", &(best_diff), true);
-	double hwp = (total_bad_nonces + total_diff1) ?
-			(double)(total_bad_nonces) / (double)(total_bad_nonces + total_diff1) : 0;
+	root = api_add_diff(root, "Difficulty Accepted", &(g->total_diff_accepted), true);
+	root = api_add_diff(root, "Difficulty Rejected", &(g->total_diff_rejected), true);
+	root = api_add_diff(root, "Difficulty Stale", &(g->total_diff_stale), true);
+	root = api_add_uint64(root, "Best Share", &(g->best_diff), true);
+	double hwp = (g->total_bad_nonces + g->total_diff1) ?
+			(double)(g->total_bad_nonces) / (double)(g->total_bad_nonces + g->total_diff1) : 0;
 	root = api_add_percent(root, "Device Hardware%", &hwp, false);
-	double rejp = total_diff1 ?
-			(double)(total_diff_rejected) / (double)(total_diff1) : 0;
+	double rejp = g->total_diff1 ?
+			(double)(g->total_diff_rejected) / (double)(g->total_diff1) : 0;
 	root = api_add_percent(root, "Device Rejected%", &rejp, false);
-	double prejp = (total_diff_accepted + total_diff_rejected + total_diff_stale) ?
-			(double)(total_diff_rejected) / (double)(total_diff_accepted + total_diff_rejected + total_diff_stale) : 0;
+	const double wtotal = g->total_diff_accepted + g->total_diff_rejected + g->total_diff_stale;
+	double prejp = wtotal ? (double)(g->total_diff_rejected) / wtotal : 0;
 	root = api_add_percent(root, "Pool Rejected%", &prejp, false);
-	double stalep = (total_diff_accepted + total_diff_rejected + total_diff_stale) ?
-			(double)(total_diff_stale) / (double)(total_diff_accepted + total_diff_rejected + total_diff_stale) : 0;
+	double stalep = wtotal ? (double)(g->total_diff_stale) / wtotal : 0;
 	root = api_add_percent(root, "Pool Stale%", &stalep, false);
 
-	mutex_unlock(&hash_lock);
+	unsigned verify_depth;
+	uint64_t verify_done, verify_overflows;
+	if (get_nonce_verify_stats(&verify_depth, &verify_done, &verify_overflows))
+	{
+		double verify_rate = verify_done / (total_secs ? total_secs : 1);
+		root = api_add_uint(root, "Verify Queue", &verify_depth, true);
+		root = api_add_uint64(root, "Verified Nonces", &verify_done, true);
+		root = api_add_double(root, "Verified/s", &verify_rate, true);
+		root = api_add_uint64(root, "Verify Queue Full", &verify_overflows, true);
+	}
+
+#ifdef USE_LIBEVENT
+	unsigned ssm_clients, ssm_peak, ssm_capacity;
+	if (stratumsrv_get_client_stats(&ssm_clients, &ssm_peak, &ssm_capacity))
+	{
+		double ssm_util = (double)ssm_clients / ssm_capacity;
+		root = api_add_uint(root, "Stratum Clients", &ssm_clients, true);
+		root = api_add_uint(root, "Stratum Clients Peak", &ssm_peak, true);
+		root = api_add_uint(root, "Stratum Client Slots", &ssm_capacity, true);
+		root = api_add_percent(root, "Stratum Slot Usage%", &ssm_util, true);
+	}
+	unsigned long ssm_notify_last_us, ssm_notify_max_us;
+	double ssm_notify_avg_us;
+	if (stratumsrv_get_notify_stats(&ssm_notify_last_us, &ssm_notify_max_us, &ssm_notify_avg_us))
+	{
+		double ms;
+		ms = ssm_notify_last_us / 1e3;
+		root = api_add_double(root, "Stratum Notify Latency", &ms, true);
+		ms = ssm_notify_avg_us / 1e3;
+		root = api_add_double(root, "Stratum Notify Latency Avg", &ms, true);
+		ms = ssm_notify_max_us / 1e3;
+		root = api_add_double(root, "Stratum Notify Latency Max", &ms, true);
+	}
+#endif
+
+	unsigned log_depth;
+	uint64_t log_written, log_dropped;
+	if (get_log_queue_stats(&log_depth, &log_written, &log_dropped))
+	{
+		root = api_add_uint(root, "Log Queue", &log_depth, true);
+		root = api_add_uint64(root, "Log Written", &log_written, true);
+		root = api_add_uint64(root, "Log Dropped", &log_dropped, true);
+	}
 
 	root = print_data(root, buf, isjson, false);
 	io_add(io_data, buf);
@@ -2872,7 +3337,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	int dev_sick_idle_60_count = 0, dev_dead_idle_600_count = 0;
 	int dev_nostart_count = 0, dev_over_heat_count = 0, dev_thermal_cutoff_count = 0, dev_comms_error_count = 0, dev_throttle_count = 0;
 
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = api_req()->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
 		if (proc->device_last_not_well > last_not_well)
@@ -2890,7 +3355,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 			dev_comms_error_count    += proc->dev_comms_error_count;
 			dev_throttle_count       += proc->dev_throttle_count;
 		}
-		if (per_proc)
+		if (api_req()->per_proc)
 			break;
 	}
 	
@@ -2935,7 +3400,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	// Simplifies future external support for identifying new counters
 	root = api_add_int(root, "NOTIFY", &device, false);
 	root = api_add_device_identifier(root, cgpu);
-	if (per_proc)
+	if (api_req()->per_proc)
 		root = api_add_time(root, "Last Well", &(cgpu->device_last_well), false);
 	root = api_add_time(root, "Last Not Well", &last_not_well, false);
 	root = api_add_string(root, "Reason Not Well", reason, false);
@@ -2973,7 +3438,7 @@ void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused
 
 	for (i = 0; i < total_devices; i++) {
 		cgpu = get_devices(i);
-		if (cgpu->device == cgpu || per_proc)
+		if (cgpu->device == cgpu || api_req()->per_proc)
 			notifystatus(io_data, n++, cgpu, isjson, group);
 	}
 
@@ -3408,31 +3873,35 @@ static void dozero(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 }
 
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group);
+static void cmdstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group);
+static void telemetry(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group);
 
 struct CMDS {
 	char *name;
 	void (*func)(struct io_data *, SOCKETTYPE, char *, bool, char);
 	bool iswritemode;
+	// Formats counters from the latest api_stats snapshot
+	bool snapshot;
 } cmds[] = {
 	{ "version",		apiversion,	false },
 	{ "config",		minerconfig,	false },
 	{ "devscan",		devscan,	true },
-	{ "devs",		devstatus,	false },
-	{ "procs",		devstatus,	false },
-	{ "pools",		poolstatus,	false },
-	{ "summary",		summary,	false },
+	{ "devs",		devstatus,	false, true },
+	{ "procs",		devstatus,	false, true },
+	{ "pools",		poolstatus,	false, true },
+	{ "summary",		summary,	false, true },
 #ifdef HAVE_OPENCL
 	{ "gpuenable",		gpuenable,	true },
 	{ "gpudisable",		gpudisable,	true },
 	{ "gpurestart",		gpurestart,	true },
-	{ "gpu",		gpudev,		false },
+	{ "gpu",		gpudev,		false, true },
 #endif
 #ifdef HAVE_AN_FPGA
-	{ "pga",		pgadev,		false },
+	{ "pga",		pgadev,		false, true },
 	{ "pgaenable",		pgaenable,	true },
 	{ "pgadisable",		pgadisable,	true },
 	{ "pgaidentify",	pgaidentify,	true },
-	{ "proc",		pgadev,		false },
+	{ "proc",		pgadev,		false, true },
 	{ "procenable",		pgaenable,	true },
 	{ "procdisable",		pgadisable,	true },
 	{ "procidentify",	pgaidentify,	true },
@@ -3441,7 +3910,7 @@ struct CMDS {
 	{ "cpuenable",		cpuenable,	true },
 	{ "cpudisable",		cpudisable,	true },
 	{ "cpurestart",		cpurestart,	true },
-	{ "cpu",		cpudev,		false },
+	{ "cpu",		cpudev,		false, true },
 #endif
 	{ "gpucount",		gpucount,	false },
 	{ "pgacount",		pgacount,	false },
@@ -3480,15 +3949,175 @@ struct CMDS {
 	{ "procset",		pgaset,		true },
 #endif
 	{ "zero",		dozero,		true },
+	{ "cmdstats",		cmdstats,	false },
+	{ "telemetry",		telemetry,	false },
 	{ NULL,			NULL,		false }
 };
 
+static int api_cmd_count()
+{
+	int i;
+
+	for (i = 0; cmds[i].name != NULL; i++)
+		;
+	return i;
+}
+
+/*
+ * Command names are looked up with a perfect hash of cmds[]: a seed is
+ * chosen once at startup so that every name lands in its own slot, and a
+ * lookup is then a hash and a single strcmp.
+ */
+#define API_CMD_HASH_SIZE	0x400
+
+static int16_t api_cmd_hash[API_CMD_HASH_SIZE];
+static uint32_t api_cmd_hash_seed;
+
+static uint32_t api_cmd_hashfn(const char *name, const uint32_t seed)
+{
+	uint32_t h = 2166136261UL ^ seed;
+
+	while (*name)
+		h = (h ^ (uint8_t)*(name++)) * 16777619;
+	return h ^ (h >> 15);
+}
+
+static void api_cmd_hash_init()
+{
+	const int cmdcount = api_cmd_count();
+	uint32_t seed;
+	int i, slot;
+
+	for (seed = 0; seed < 0x10000; ++seed) {
+		memset(api_cmd_hash, 0xff, sizeof(api_cmd_hash));
+		for (i = 0; i < cmdcount; ++i) {
+			slot = api_cmd_hashfn(cmds[i].name, seed) % API_CMD_HASH_SIZE;
+			if (api_cmd_hash[slot] != -1)
+				break;
+			api_cmd_hash[slot] = i;
+		}
+		if (i == cmdcount) {
+			api_cmd_hash_seed = seed;
+			return;
+		}
+	}
+	quit(1, "API failed to find a perfect hash for %d commands", cmdcount);
+}
+
+// Returns the index of the command in cmds[], or -1
+static int api_cmd_find(const char * const name)
+{
+	const int i = api_cmd_hash[api_cmd_hashfn(name, api_cmd_hash_seed) % API_CMD_HASH_SIZE];
+
+	if (i < 0 || strcmp(cmds[i].name, name))
+		return -1;
+	return i;
+}
+
+// Whether cmds[i] can be one of several joined with '+' in a request
+static bool api_cmd_joinable(const int i)
+{
+	return !cmds[i].iswritemode && cmds[i].func != telemetry;
+}
+
+// Execution time of each command in cmds[], for cmdstats
+struct api_cmd_stats {
+	uint32_t calls;
+	struct timeval total;
+	struct timeval max;
+	// api_data allocations, from the request arena
+	struct api_arena_counts alloc;
+};
+static struct api_cmd_stats *cmd_stats;
+static pthread_mutex_t cmd_stats_lock;
+
+// alloc_start is the arena's counts from before the command
+static void cmd_stats_add(const int i, const struct timeval * const tv_start, const struct timeval * const tv_end, const struct api_arena_counts * const alloc_start)
+{
+	struct api_cmd_stats * const st = &cmd_stats[i];
+	const struct api_arena_counts * const alloc_end = &api_req()->arena->counts;
+	struct timeval tv;
+	
+	timersub(tv_end, tv_start, &tv);
+	mutex_lock(&cmd_stats_lock);
+	++st->calls;
+	timeradd(&st->total, &tv, &st->total);
+	if (timercmp(&tv, &st->max, >))
+		st->max = tv;
+	st->alloc.allocs += alloc_end->allocs - alloc_start->allocs;
+	st->alloc.bytes += alloc_end->bytes - alloc_start->bytes;
+	st->alloc.blocks += alloc_end->blocks - alloc_start->blocks;
+	mutex_unlock(&cmd_stats_lock);
+}
+
+static void cmdstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct api_data *root;
+	char buf[TMPBUFSIZ];
+	bool io_open = false;
+	struct api_cmd_stats st;
+	double avg;
+	int i, n = 0;
+
+	message(io_data, MSG_CMDSTATS, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_CMDSTATS);
+
+	for (i = 0; cmds[i].name != NULL; i++) {
+		mutex_lock(&cmd_stats_lock);
+		st = cmd_stats[i];
+		mutex_unlock(&cmd_stats_lock);
+		if (!st.calls)
+			continue;
+
+		avg = ((double)st.total.tv_sec + ((double)st.total.tv_usec / 1000000)) / st.calls;
+
+		root = NULL;
+		root = api_add_int(root, "CMDSTATS", &n, false);
+		root = api_add_string(root, "Command", cmds[i].name, false);
+		root = api_add_uint32(root, "Calls", &st.calls, false);
+		root = api_add_timeval(root, "Total", &st.total, false);
+		root = api_add_timeval(root, "Max", &st.max, false);
+		root = api_add_double(root, "Average", &avg, false);
+		root = api_add_uint64(root, "Allocs", &st.alloc.allocs, false);
+		root = api_add_uint64(root, "Alloc Bytes", &st.alloc.bytes, false);
+		root = api_add_uint32(root, "Arena Blocks", &st.alloc.blocks, false);
+
+		root = print_data(root, buf, isjson, isjson && (n > 0));
+		io_add(io_data, buf);
+		++n;
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+#define API_TELEMETRY_DEFAULT_MS	5000
+#define API_TELEMETRY_MIN_MS	100
+
+// The stream itself is produced by the API thread; see api_telemetry_frame
+static void telemetry(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	int ms = API_TELEMETRY_DEFAULT_MS;
+
+	if (param && *param) {
+		ms = atoi(param);
+		if (ms < API_TELEMETRY_MIN_MS) {
+			message(io_data, MSG_INVTELEM, 0, param, isjson);
+			return;
+		}
+	}
+
+	io_data->telemetry_ms = ms;
+	message(io_data, MSG_TELEMETRY, ms, NULL, isjson);
+}
+
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group)
 {
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
 	bool io_open;
-	char cmdbuf[100];
 	bool found, access;
 	int i;
 
@@ -3497,19 +4126,9 @@ static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 		return;
 	}
 
-	found = false;
-	access = false;
-	for (i = 0; cmds[i].name != NULL; i++) {
-		if (strcmp(cmds[i].name, param) == 0) {
-			found = true;
-
-			sprintf(cmdbuf, "|%s|", param);
-			if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-				access = true;
-
-			break;
-		}
-	}
+	i = api_cmd_find(param);
+	found = (i >= 0);
+	access = found && GROUPALLOWS(group, i);
 
 	message(io_data, MSG_CHECK, 0, NULL, isjson);
 	io_open = io_add(io_data, isjson ? COMSTR JSON_CHECK : _CHECK COMSTR);
@@ -3523,7 +4142,7 @@ static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 		io_close(io_data);
 }
 
-static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
+static void io_finish(struct io_data *io_data, bool isjson)
 {
 	if (io_data->close)
 		io_add(io_data, JSON_CLOSE);
@@ -3533,71 +4152,1161 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 	
 	// Null-terminate reply, including sending the \0 on the socket
 	bytes_append(&io_data->data, "", 1);
+}
+
+static void send_result(struct io_data *io_data, __maybe_unused SOCKETTYPE c, bool isjson)
+{
+	io_finish(io_data, isjson);
 	
 	applog(LOG_DEBUG, "API: send reply: (%ld) '%.10s%s'",
 	       (long)bytes_len(&io_data->data),
 	       bytes_buf(&io_data->data),
 	       bytes_len(&io_data->data) > 10 ? "..." : BLANK);
 	
-	io_flush(io_data, true);
-	
-	if (bytes_len(&io_data->data))
-		applog(LOG_WARNING, "RPC: Timed out with %ld bytes left to send",
-		       (long)bytes_len(&io_data->data));
+	// The API thread sends it from here, see api_conn_write
 }
 
-static void tidyup(__maybe_unused void *arg)
-{
-	mutex_lock(&quit_restart_lock);
+/*
+ * The API thread multiplexes all client connections with select(), and hands
+ * complete requests to a small pool of worker threads to execute. Whatever
+ * arrives first is the request (up to any \0 it was sent with), and the
+ * connection is closed after the reply, as always, unless a JSON request
+ * asked for "keepalive": then further requests, each terminated by a \0
+ * (like the replies), are read from it until one turns keepalive off again.
+ * Commands that change the miner never run concurrently, see api_cmd_run.
+ */
+#define API_WORKERS	4
+#define API_MAX_CONNS	0x40
+// Seconds a connection may sit idle (or not reading its reply) before it is closed
+#define API_IDLE_TIMEOUT	30
+
+enum api_conn_state {
+	ACS_READ,
+	ACS_BUSY,
+	ACS_WRITE,
+	// Subscribed to telemetry: waiting for the next frame to be due
+	ACS_STREAM,
+};
 
-	SOCKETTYPE *apisock = (SOCKETTYPE *)arg;
+struct api_telemetry;
 
-	bye = true;
+struct api_conn {
+	SOCKETTYPE sock;
+	char group;
+	char connectaddr[16];
+	enum api_conn_state state;
+	bool keepalive;
+	time_t last_active;
 
-	if (*apisock != INVSOCK) {
-		shutdown(*apisock, SHUT_RDWR);
-		CLOSESOCKET(*apisock);
-		*apisock = INVSOCK;
-		free(apisock);
-	}
+	// Data received but not yet taken as a request
+	char rbuf[TMPBUFSIZ];
+	size_t rbuflen;
 
-	if (ipaccess != NULL) {
-		free(ipaccess);
-		ipaccess = NULL;
-	}
+	// The request being executed by a worker
+	char req[TMPBUFSIZ];
+	size_t reqlen;
+
+	struct io_data *io_data;
+	struct api_telemetry *telemetry;
+};
 
-	io_free();
+static bool check_connect(struct sockaddr_in *cli, char **connectaddr, char *group);
 
-	mutex_unlock(&quit_restart_lock);
-}
+static struct api_conn *api_conns[API_MAX_CONNS];
+static int api_conn_count;
+
+// Requests for the workers, and connections they are done with; each connection is in at most one
+static pthread_mutex_t api_queue_lock;
+static pthread_cond_t api_queue_cond;
+static struct api_conn *api_jobs[API_MAX_CONNS], *api_done[API_MAX_CONNS];
+static int api_jobs_head, api_jobs_count, api_done_head, api_done_count;
+static notifier_t api_notifier;
 
 /*
- * Interpret --api-groups G:cmd1:cmd2:cmd3,P:cmd4,*,...
+ * Reply buffers of closed connections are kept for the next ones, so a
+ * client opening a connection per request doesn't cost a new buffer (grown
+ * again to fit the reply) every time. Only the API thread uses these.
  */
-static void setup_groups()
-{
-	char *api_groups = opt_api_groups ? opt_api_groups : (char *)BLANK;
-	char *buf, *ptr, *next, *colon;
-	char group;
-	char commands[TMPBUFSIZ];
-	char cmdbuf[100];
-	char *cmd;
-	bool addstar, did;
-	int i;
+#define API_IO_SPARE	API_WORKERS
+// Buffers grown past this by some huge reply are freed instead
+#define API_IO_SPARE_MAX	0x100000
 
-	buf = malloc(strlen(api_groups) + 1);
-	if (unlikely(!buf))
-		quit(1, "Failed to malloc ipgroups buf");
+static struct io_data *api_io_spare[API_IO_SPARE];
+static int api_io_spare_count;
 
-	strcpy(buf, api_groups);
+static struct io_data *api_io_get(const SOCKETTYPE sock)
+{
+	struct io_data *io_data;
 
-	next = buf;
-	// for each group defined
-	while (next && *next) {
-		ptr = next;
-		next = strchr(ptr, ',');
-		if (next)
-			*(next++) = '\0';
+	if (api_io_spare_count) {
+		io_data = api_io_spare[--api_io_spare_count];
+		bytes_reset(&io_data->data);
+		io_data->reply_start = 0;
+		io_reinit(io_data);
+	}
+	else
+		io_data = sock_io_new();
+	io_data->sock = sock;
+	return io_data;
+}
+
+static void api_io_put(struct io_data * const io_data)
+{
+	if (api_io_spare_count < API_IO_SPARE && io_data->data.allocsz <= API_IO_SPARE_MAX) {
+		io_data->sock = INVSOCK;
+		api_io_spare[api_io_spare_count++] = io_data;
+	}
+	else
+		io_free(io_data);
+}
+
+static void api_set_nonblocking(SOCKETTYPE sock)
+{
+#ifndef WIN32
+	int flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, O_NONBLOCK | flags);
+#else
+	u_long flags = 1;
+	ioctlsocket(sock, FIONBIO, &flags);
+#endif
+}
+
+/*
+ * A JSON request for "cmd1+cmd2+..." gets one reply of the form
+ * {"cmd1":[reply1],"cmd2":[reply2],...} where each is the usual reply to that
+ * command (all with the same parameter), built one after the other in the
+ * same buffer. Those reading counters all use the same api_stats snapshot.
+ */
+// Commands that change the miner were written to run one at a time, so they still do
+static pthread_mutex_t api_write_lock;
+
+static void api_cmd_run(const int i, struct io_data * const io_data, const SOCKETTYPE c, char * const param, const bool isjson, const char group)
+{
+	struct api_request_state * const req = api_req();
+	const time_t when = req->when;
+	struct api_stats *stats = NULL;
+
+	if (cmds[i].snapshot) {
+		// A batch already holds one
+		if (!req->stats)
+			req->stats = stats = api_stats_get();
+		// When is when the counters were read
+		if (req->stats)
+			req->when = req->stats->when;
+	}
+
+	if (cmds[i].iswritemode)
+		mutex_lock(&api_write_lock);
+	(cmds[i].func)(io_data, c, param, isjson, group);
+	if (cmds[i].iswritemode) {
+		// So later replies show its effect
+		api_stats_publish();
+		mutex_unlock(&api_write_lock);
+	}
+
+	req->when = when;
+	if (stats) {
+		req->stats = NULL;
+		api_stats_put(stats);
+	}
+}
+
+static void api_execute_batch(struct api_conn * const conn, const char * const cmdlist, char * const param)
+{
+	struct io_data * const io_data = conn->io_data;
+	struct api_request_state * const req = api_req();
+	struct api_arena_counts alloc_start;
+	struct timeval tv_start, tv_end;
+	char list[TMPBUFSIZ];
+	char *cmd, *next, *escaped;
+	int i;
+
+	io_data->reply_start = 0;
+	io_reinit(io_data);
+	io_add(io_data, JSON0);
+
+	// Every reply in the batch uses the same counters
+	req->stats = api_stats_get();
+
+	snprintf(list, sizeof(list), "%s", cmdlist);
+	for (cmd = list; cmd; cmd = next) {
+		next = strchr(cmd, '+');
+		if (next)
+			*(next++) = '\0';
+
+		if (cmd != list)
+			io_add(io_data, COMSTR);
+		escaped = escape_string(cmd, true);
+		io_add(io_data, JSON1);
+		io_add(io_data, escaped);
+		io_add(io_data, JSON2);
+		if (escaped != cmd)
+			free(escaped);
+		io_data->reply_start = bytes_len(&io_data->data);
+
+		i = api_cmd_find(cmd);
+		if (i < 0)
+			message(io_data, MSG_INVCMD, 0, NULL, true);
+		else
+		if (!GROUPALLOWS(conn->group, i)) {
+			message(io_data, MSG_ACCDENY, 0, cmds[i].name, true);
+			applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", conn->connectaddr, cmds[i].name);
+		}
+		else
+		if (!api_cmd_joinable(i))
+			message(io_data, MSG_NOJOIN, 0, cmds[i].name, true);
+		else {
+			req->per_proc = !strncmp(cmds[i].name, "proc", 4);
+			alloc_start = req->arena->counts;
+			cgtime(&tv_start);
+			api_cmd_run(i, io_data, conn->sock, param, true, conn->group);
+			cgtime(&tv_end);
+			cmd_stats_add(i, &tv_start, &tv_end, &alloc_start);
+		}
+		io_finish(io_data, true);
+		// Drop the \0 terminating the reply
+		bytes_resize(&io_data->data, bytes_len(&io_data->data) - 1);
+		io_add(io_data, JSON3);
+		io_data->reply_start = 0;
+	}
+
+	if (req->stats) {
+		api_stats_put(req->stats);
+		req->stats = NULL;
+	}
+
+	io_add(io_data, JSON5);
+	bytes_append(&io_data->data, "", 1);
+}
+
+static void api_execute(struct api_conn * const conn)
+{
+	struct io_data * const io_data = conn->io_data;
+	const SOCKETTYPE c = conn->sock;
+	const char group = conn->group;
+	char * const buf = conn->req;
+	const int n = conn->reqlen;
+	char param_buf[TMPBUFSIZ];
+	char *cmd = NULL;
+	char *param;
+	json_error_t json_err;
+	json_t *json_config = NULL;
+	json_t *json_val;
+	struct api_arena_counts alloc_start;
+	struct timeval tv_start, tv_end;
+	bool isjson;
+	bool did;
+	int i;
+
+	if (opt_debug)
+		applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
+
+	// the time of the request in now
+	api_req()->when = time(NULL);
+	io_reinit(io_data);
+
+	did = false;
+
+	if (*buf != ISJSON) {
+		isjson = false;
+
+		param = strchr(buf, SEPARATOR);
+		if (param != NULL)
+			*(param++) = '\0';
+
+		cmd = buf;
+	}
+	else {
+		isjson = true;
+
+		param = NULL;
+
+#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
+		json_config = json_loadb(buf, n, 0, &json_err);
+#elif JANSSON_MAJOR_VERSION > 1
+		json_config = json_loads(buf, 0, &json_err);
+#else
+		json_config = json_loads(buf, &json_err);
+#endif
+
+		if (!json_is_object(json_config)) {
+			message(io_data, MSG_INVJSON, 0, NULL, isjson);
+			send_result(io_data, c, isjson);
+			did = true;
+		}
+		else {
+			json_val = json_object_get(json_config, JSON_COMMAND);
+			if (json_val == NULL) {
+				message(io_data, MSG_MISCMD, 0, NULL, isjson);
+				send_result(io_data, c, isjson);
+				did = true;
+			}
+			else {
+				if (!json_is_string(json_val)) {
+					message(io_data, MSG_INVCMD, 0, NULL, isjson);
+					send_result(io_data, c, isjson);
+					did = true;
+				}
+				else {
+					cmd = (char *)json_string_value(json_val);
+					// The API thread only looks at this once the reply is done
+					json_val = json_object_get(json_config, JSON_KEEPALIVE);
+					if (json_val)
+						conn->keepalive = json_is_true(json_val);
+					json_val = json_object_get(json_config, JSON_PARAMETER);
+					if (json_is_string(json_val))
+						param = (char *)json_string_value(json_val);
+					else if (json_is_integer(json_val)) {
+						sprintf(param_buf, "%d", (int)json_integer_value(json_val));
+						param = param_buf;
+					} else if (json_is_real(json_val)) {
+						sprintf(param_buf, "%f", (double)json_real_value(json_val));
+						param = param_buf;
+					}
+				}
+			}
+		}
+	}
+
+	if (!did && isjson && strchr(cmd, '+')) {
+		api_execute_batch(conn, cmd, param);
+		did = true;
+	}
+
+	if (!did && (i = api_cmd_find(cmd)) >= 0) {
+		if (GROUPALLOWS(group, i)) {
+			api_req()->per_proc = !strncmp(cmds[i].name, "proc", 4);
+			alloc_start = api_req()->arena->counts;
+			cgtime(&tv_start);
+			api_cmd_run(i, io_data, c, param, isjson, group);
+			send_result(io_data, c, isjson);
+			cgtime(&tv_end);
+			cmd_stats_add(i, &tv_start, &tv_end, &alloc_start);
+		}
+		else {
+			message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+			applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", conn->connectaddr, cmds[i].name);
+			send_result(io_data, c, isjson);
+		}
+
+		did = true;
+	}
+
+	if (isjson)
+		json_decref(json_config);
+
+	if (!did) {
+		message(io_data, MSG_INVCMD, 0, NULL, isjson);
+		send_result(io_data, c, isjson);
+	}
+}
+
+/*
+ * Telemetry stream: after the telemetry command's reply, the connection gets
+ * a binary frame every interval with the per-processor counters that changed
+ * since the previous frame. Fields are the same api_data items the API
+ * already produces (including each driver's get_api_stats), so they are
+ * defined inline the first time they are sent, and only referred to by
+ * number after that. See README.RPC for the format.
+ */
+enum api_telemetry_kind {
+	ATK_INT,
+	ATK_REAL,
+	ATK_STR,
+};
+
+struct api_telemetry_field {
+	char *name;
+	int id;
+	enum api_data_type type;
+	bool defined;
+	UT_hash_handle hh;
+};
+
+struct api_telemetry_value {
+	bool set;
+	int64_t i;
+	double d;
+	char *s;
+};
+
+struct api_telemetry_proc {
+	struct api_telemetry_value *values;
+	int count;
+};
+
+struct api_telemetry {
+	int interval_ms;
+	struct timeval tv_next;
+	uint64_t seq;
+
+	struct api_telemetry_field *fields;
+	int field_count;
+
+	// Last values sent, by processor and field id
+	struct api_telemetry_proc *procs;
+	int proc_count;
+};
+
+static struct api_telemetry *api_telemetry_new(const int interval_ms)
+{
+	struct api_telemetry * const tlm = malloc(sizeof(*tlm));
+
+	if (unlikely(!tlm))
+		quit(1, "Failed to malloc api_telemetry");
+	*tlm = (struct api_telemetry){
+		.interval_ms = interval_ms,
+	};
+	return tlm;
+}
+
+static void api_telemetry_free(struct api_telemetry * const tlm)
+{
+	struct api_telemetry_field *field, *tmp;
+	int i, j;
+
+	HASH_ITER(hh, tlm->fields, field, tmp) {
+		HASH_DEL(tlm->fields, field);
+		free(field->name);
+		free(field);
+	}
+	for (i = 0; i < tlm->proc_count; ++i) {
+		for (j = 0; j < tlm->procs[i].count; ++j)
+			free(tlm->procs[i].values[j].s);
+		free(tlm->procs[i].values);
+	}
+	free(tlm->procs);
+	free(tlm);
+}
+
+static void api_telemetry_varint(bytes_t * const b, uint64_t v)
+{
+	uint8_t buf[10];
+	int n = 0;
+
+	while (v >= 0x80) {
+		buf[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = v;
+	bytes_append(b, buf, n);
+}
+
+static void api_telemetry_str(bytes_t * const b, const char * const s)
+{
+	const size_t len = strlen(s);
+
+	api_telemetry_varint(b, len);
+	bytes_append(b, s, len);
+}
+
+static enum api_telemetry_kind api_telemetry_kind(const enum api_data_type type)
+{
+	switch (type) {
+		case API_UINT8:
+		case API_UINT16:
+		case API_INT:
+		case API_UINT:
+		case API_UINT32:
+		case API_UINT64:
+		case API_BOOL:
+		case API_TIME:
+		case API_TIMEVAL:
+			return ATK_INT;
+		case API_DOUBLE:
+		case API_ELAPSED:
+		case API_MHS:
+		case API_MHTOTAL:
+		case API_UTILITY:
+		case API_FREQ:
+		case API_HS:
+		case API_DIFF:
+		case API_PERCENT:
+		case API_TEMP:
+		case API_VOLTS:
+			return ATK_REAL;
+		default:
+			return ATK_STR;
+	}
+}
+
+// Fills in the value of item, as it is sent; strings are malloc'd
+static void api_telemetry_get(const struct api_data * const item, struct api_telemetry_value * const val)
+{
+	const struct timeval *tvp;
+
+	switch (item->type) {
+		case API_UINT8:
+			val->i = *(uint8_t *)item->data;
+			break;
+		case API_UINT16:
+			val->i = *(uint16_t *)item->data;
+			break;
+		case API_INT:
+			val->i = *(int *)item->data;
+			break;
+		case API_UINT:
+			val->i = *(unsigned int *)item->data;
+			break;
+		case API_UINT32:
+			val->i = *(uint32_t *)item->data;
+			break;
+		case API_UINT64:
+			val->i = *(uint64_t *)item->data;
+			break;
+		case API_BOOL:
+			val->i = *(bool *)item->data;
+			break;
+		case API_TIME:
+			val->i = *(time_t *)item->data;
+			break;
+		case API_TIMEVAL:
+			tvp = item->data;
+			val->i = ((int64_t)tvp->tv_sec * 1000000) + tvp->tv_usec;
+			break;
+		case API_TEMP:
+		case API_VOLTS:
+			val->d = *(float *)item->data;
+			break;
+		case API_JSON:
+			val->s = json_dumps((json_t *)item->data, JSON_COMPACT);
+			break;
+		default:
+			if (api_telemetry_kind(item->type) == ATK_REAL)
+				val->d = *(double *)item->data;
+			else
+				val->s = strdup((char *)item->data);
+			break;
+	}
+}
+
+static struct api_telemetry_value *api_telemetry_last(struct api_telemetry * const tlm, const int proc, const int id)
+{
+	struct api_telemetry_proc *tp;
+
+	if (proc >= tlm->proc_count) {
+		tlm->procs = realloc(tlm->procs, (proc + 1) * sizeof(*tlm->procs));
+		if (unlikely(!tlm->procs))
+			quit(1, "Failed to realloc telemetry procs");
+		memset(&tlm->procs[tlm->proc_count], 0, (proc + 1 - tlm->proc_count) * sizeof(*tlm->procs));
+		tlm->proc_count = proc + 1;
+	}
+	tp = &tlm->procs[proc];
+	if (id >= tp->count) {
+		tp->values = realloc(tp->values, (id + 1) * sizeof(*tp->values));
+		if (unlikely(!tp->values))
+			quit(1, "Failed to realloc telemetry values");
+		memset(&tp->values[tp->count], 0, (id + 1 - tp->count) * sizeof(*tp->values));
+		tp->count = id + 1;
+	}
+	return &tp->values[id];
+}
+
+// Appends item to rec if it changed since the last frame, and returns whether it did
+static bool api_telemetry_field(struct api_telemetry * const tlm, bytes_t * const rec, const int proc, const struct api_data * const item)
+{
+	struct api_telemetry_field *field;
+	struct api_telemetry_value *last, val = { .set = true, };
+	enum api_telemetry_kind kind;
+	uint64_t u;
+	int64_t delta;
+	int i;
+
+	HASH_FIND_STR(tlm->fields, item->name, field);
+	if (!field) {
+		field = malloc(sizeof(*field));
+		if (unlikely(!field))
+			quit(1, "Failed to malloc telemetry field");
+		*field = (struct api_telemetry_field){
+			.name = strdup(item->name),
+			.id = tlm->field_count++,
+			.type = item->type,
+		};
+		HASH_ADD_KEYPTR(hh, tlm->fields, field->name, strlen(field->name), field);
+	}
+	else
+	if (field->type != item->type) {
+		// Redefining a field resets it for every processor
+		field->type = item->type;
+		field->defined = false;
+		for (i = 0; i < tlm->proc_count; ++i)
+			if (field->id < tlm->procs[i].count) {
+				last = &tlm->procs[i].values[field->id];
+				free(last->s);
+				*last = (struct api_telemetry_value){ .set = false, };
+			}
+	}
+
+	kind = api_telemetry_kind(field->type);
+	last = api_telemetry_last(tlm, proc, field->id);
+	api_telemetry_get(item, &val);
+	if (last->set) {
+		if (kind == ATK_INT ? (val.i == last->i) : kind == ATK_REAL ? (val.d == last->d) : !strcmp(val.s ?: "", last->s ?: "")) {
+			free(val.s);
+			return false;
+		}
+	}
+
+	api_telemetry_varint(rec, ((uint64_t)field->id << 1) | !field->defined);
+	if (!field->defined) {
+		uint8_t type = field->type;
+		bytes_append(rec, &type, 1);
+		api_telemetry_str(rec, field->name);
+		field->defined = true;
+	}
+	switch (kind) {
+		case ATK_INT:
+			delta = val.i - (last->set ? last->i : 0);
+			api_telemetry_varint(rec, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+			break;
+		case ATK_REAL:
+		{
+			uint8_t buf[8];
+			memcpy(&u, &val.d, sizeof(u));
+			for (i = 0; i < 8; ++i)
+				buf[i] = u >> (i * 8);
+			bytes_append(rec, buf, 8);
+			break;
+		}
+		case ATK_STR:
+			api_telemetry_str(rec, val.s ?: "");
+			break;
+	}
+
+	free(last->s);
+	*last = val;
+	return true;
+}
+
+// Frees an api_data list the way print_data does
+static void api_data_free(struct api_data *root)
+{
+	struct api_data *tmp;
+
+	if (!root)
+		return;
+	root->prev->next = NULL;
+	while (root) {
+		tmp = root->next;
+		api_data_free_item(root);
+		root = tmp;
+	}
+}
+
+static struct api_data *api_telemetry_proc_data(struct cgpu_info * const proc)
+{
+	struct api_data *root = NULL;
+
+	root = api_add_string(root, "Name", proc->proc_repr_ns, true);
+	root = api_add_mhtotal(root, "Total MH", &proc->total_mhashes, true);
+	root = api_add_mhs(root, "MHS rolling", &proc->rolling, true);
+	root = api_add_int(root, "Accepted", &proc->accepted, true);
+	root = api_add_int(root, "Rejected", &proc->rejected, true);
+	root = api_add_int(root, "Stale", &proc->stale, true);
+	root = api_add_int(root, "Hardware Errors", &proc->hw_errors, true);
+	root = api_add_int(root, "Diff1 Work", &proc->diff1, true);
+	root = api_add_diff(root, "Difficulty Accepted", &proc->diff_accepted, true);
+	root = api_add_diff(root, "Difficulty Rejected", &proc->diff_rejected, true);
+	if (proc->temp > 0)
+		root = api_add_temp(root, "Temperature", &proc->temp, true);
+	if (proc->drv->get_api_stats)
+		root = api_add_extra(root, proc->drv->get_api_stats(proc));
+
+	return root;
+}
+
+// Produces the next frame for a subscribed connection into its io_data
+static void api_telemetry_frame(struct api_conn * const conn)
+{
+	struct api_telemetry * const tlm = conn->telemetry;
+	bytes_t records = BYTES_INIT, rec = BYTES_INIT, hdr = BYTES_INIT;
+	struct api_data *root, *item;
+	struct cgpu_info *proc;
+	uint8_t lenbuf[4];
+	uint32_t len;
+	int i, nrecords = 0, nfields;
+
+	for (i = 0; i < total_devices; ++i) {
+		proc = get_devices(i);
+		if (!(proc && proc->drv))
+			continue;
+
+		root = api_telemetry_proc_data(proc);
+		bytes_reset(&rec);
+		nfields = 0;
+		item = root;
+		do {
+			if (api_telemetry_field(tlm, &rec, i, item))
+				++nfields;
+			item = item->next;
+		} while (item != root);
+		api_data_free(root);
+
+		if (!nfields)
+			continue;
+		api_telemetry_varint(&records, i);
+		api_telemetry_varint(&records, nfields);
+		bytes_cat(&records, &rec);
+		++nrecords;
+	}
+
+	api_telemetry_varint(&hdr, tlm->seq++);
+	api_telemetry_varint(&hdr, time(NULL));
+	api_telemetry_varint(&hdr, nrecords);
+
+	len = bytes_len(&hdr) + bytes_len(&records);
+	for (i = 0; i < 4; ++i)
+		lenbuf[i] = len >> (i * 8);
+
+	io_reinit(conn->io_data);
+	bytes_append(&conn->io_data->data, lenbuf, 4);
+	bytes_cat(&conn->io_data->data, &hdr);
+	bytes_cat(&conn->io_data->data, &records);
+
+	bytes_free(&records);
+	bytes_free(&rec);
+	bytes_free(&hdr);
+}
+
+static void *api_worker_thread(__maybe_unused void *userdata)
+{
+	struct api_arena arena = {
+		.cur = NULL,
+	};
+	struct api_request_state req_state = {
+		.when = 0,
+		.arena = &arena,
+	};
+	struct api_conn *conn;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("rpc_worker");
+
+	if (pthread_setspecific(key_api_request, &req_state))
+		quithere(1, "pthread_setspecific failed");
+
+	while (true) {
+		mutex_lock(&api_queue_lock);
+		while (!api_jobs_count)
+			pthread_cond_wait(&api_queue_cond, &api_queue_lock);
+		conn = api_jobs[api_jobs_head];
+		api_jobs_head = (api_jobs_head + 1) % API_MAX_CONNS;
+		--api_jobs_count;
+		mutex_unlock(&api_queue_lock);
+
+		if (conn->telemetry)
+			api_telemetry_frame(conn);
+		else {
+			api_execute(conn);
+			if (conn->io_data->telemetry_ms)
+				conn->telemetry = api_telemetry_new(conn->io_data->telemetry_ms);
+		}
+		api_arena_reset(&arena);
+
+		mutex_lock(&api_queue_lock);
+		api_done[(api_done_head + api_done_count++) % API_MAX_CONNS] = conn;
+		mutex_unlock(&api_queue_lock);
+		notifier_wake(api_notifier);
+	}
+
+	return NULL;
+}
+
+static void api_workers_start()
+{
+	pthread_t pth;
+	int i;
+
+	cmd_stats = calloc(api_cmd_count(), sizeof(*cmd_stats));
+	if (unlikely(!cmd_stats))
+		quit(1, "Failed to calloc cmd_stats");
+	mutex_init(&cmd_stats_lock);
+
+	mutex_init(&api_write_lock);
+	mutex_init(&api_queue_lock);
+	if (unlikely(pthread_cond_init(&api_queue_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init api_queue_cond");
+	notifier_init(api_notifier);
+	if (pthread_key_create(&key_api_request, NULL))
+		quithere(1, "pthread_key_create failed");
+
+	for (i = 0; i < API_WORKERS; ++i)
+		if (unlikely(pthread_create(&pth, NULL, api_worker_thread, NULL)))
+			quit(1, "API worker thread create failed");
+}
+
+static void api_conn_close(const int idx)
+{
+	struct api_conn * const conn = api_conns[idx];
+
+	CLOSESOCKET(conn->sock);
+	api_io_put(conn->io_data);
+	if (conn->telemetry)
+		api_telemetry_free(conn->telemetry);
+	free(conn);
+	api_conns[idx] = NULL;
+	--api_conn_count;
+}
+
+// Only connections not in use by a worker can be closed
+static void api_conns_close_idle()
+{
+	for (int i = 0; i < API_MAX_CONNS; ++i)
+		if (api_conns[i] && api_conns[i]->state != ACS_BUSY)
+			api_conn_close(i);
+}
+
+// Hands conn over to a worker
+static void api_conn_queue(struct api_conn * const conn)
+{
+	conn->state = ACS_BUSY;
+
+	mutex_lock(&api_queue_lock);
+	api_jobs[(api_jobs_head + api_jobs_count++) % API_MAX_CONNS] = conn;
+	pthread_cond_signal(&api_queue_cond);
+	mutex_unlock(&api_queue_lock);
+}
+
+// Queues the next request received on conn, if it is complete
+static void api_conn_dispatch(struct api_conn * const conn)
+{
+	char * const end = memchr(conn->rbuf, '\0', conn->rbuflen);
+	size_t len;
+
+	if (end) {
+		len = end - conn->rbuf;
+		memcpy(conn->req, conn->rbuf, len);
+		conn->rbuflen -= len + 1;
+		memmove(conn->rbuf, &end[1], conn->rbuflen);
+	}
+	else
+	if (conn->keepalive || !conn->rbuflen)
+		// Wait for the rest of the request
+		return;
+	else {
+		// Traditional client: the first read is the whole request
+		len = conn->rbuflen;
+		memcpy(conn->req, conn->rbuf, len);
+		conn->rbuflen = 0;
+	}
+	conn->req[len] = '\0';
+	conn->reqlen = len;
+	api_conn_queue(conn);
+}
+
+// Has a worker produce the next telemetry frame for conn
+static void api_telemetry_queue(struct api_conn * const conn, struct timeval * const tvp_now)
+{
+	timer_set_delay(&conn->telemetry->tv_next, tvp_now, conn->telemetry->interval_ms * 1000);
+	api_conn_queue(conn);
+}
+
+// Returns false if the connection should be closed
+static bool api_conn_read(struct api_conn * const conn)
+{
+	ssize_t n;
+
+	n = recv(conn->sock, &conn->rbuf[conn->rbuflen], sizeof(conn->rbuf) - 1 - conn->rbuflen, 0);
+	if (SOCKETFAIL(n)) {
+		if (sock_blocks())
+			return true;
+		applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
+		return false;
+	}
+	if (!n)
+		return false;
+
+	conn->rbuflen += n;
+	if (conn->state == ACS_READ)
+		api_conn_dispatch(conn);
+
+	if (conn->state == ACS_STREAM) {
+		// Nothing more is expected from a subscriber
+		conn->rbuflen = 0;
+		return true;
+	}
+
+	if (conn->state == ACS_READ && conn->rbuflen >= sizeof(conn->rbuf) - 1) {
+		applog(LOG_DEBUG, "API: request from %s too long", conn->connectaddr);
+		return false;
+	}
+	return true;
+}
+
+// Returns false if the connection should be closed
+static bool api_conn_write(struct api_conn * const conn)
+{
+	io_flush(conn->io_data, false);
+	if (bytes_len(&conn->io_data->data))
+		return true;
+
+	if (conn->telemetry) {
+		// A frame that comes due while the last is still being written is skipped
+		if (timer_passed(&conn->telemetry->tv_next, NULL))
+			timer_set_delay_from_now(&conn->telemetry->tv_next, conn->telemetry->interval_ms * 1000);
+		conn->state = ACS_STREAM;
+		return true;
+	}
+
+	if (!conn->keepalive)
+		return false;
+
+	conn->state = ACS_READ;
+	api_conn_dispatch(conn);
+	return true;
+}
+
+static int api_conn_find(const struct api_conn * const conn)
+{
+	for (int i = 0; i < API_MAX_CONNS; ++i)
+		if (api_conns[i] == conn)
+			return i;
+	return -1;
+}
+
+static void api_conns_take_done()
+{
+	struct api_conn *done[API_MAX_CONNS];
+	int count, i;
+
+	mutex_lock(&api_queue_lock);
+	count = api_done_count;
+	for (i = 0; i < count; ++i)
+		done[i] = api_done[(api_done_head + i) % API_MAX_CONNS];
+	api_done_head = (api_done_head + count) % API_MAX_CONNS;
+	api_done_count = 0;
+	mutex_unlock(&api_queue_lock);
+
+	for (i = 0; i < count; ++i) {
+		done[i]->state = ACS_WRITE;
+		done[i]->last_active = time(NULL);
+		if (!api_conn_write(done[i]))
+			api_conn_close(api_conn_find(done[i]));
+	}
+}
+
+static void api_accept(const SOCKETTYPE apisock)
+{
+	struct sockaddr_in cli;
+	socklen_t clisiz;
+	struct api_conn *conn;
+	char *connectaddr;
+	char group;
+	bool addrok;
+	SOCKETTYPE c;
+	int i;
+
+	clisiz = sizeof(cli);
+	if (SOCKETFAIL(c = accept(apisock, (struct sockaddr *)(&cli), &clisiz))) {
+		if (!sock_blocks())
+			applog(LOG_WARNING, "API: accept failed: %s", SOCKERRMSG);
+		return;
+	}
+
+	addrok = check_connect(&cli, &connectaddr, &group);
+	applog(LOG_DEBUG, "API: connection from %s - %s",
+				connectaddr, addrok ? "Accepted" : "Ignored");
+
+#ifndef WIN32
+	if (addrok && c >= FD_SETSIZE) {
+		applog(LOG_WARNING, "API: connection from %s dropped, socket number too high for select", connectaddr);
+		addrok = false;
+	}
+#endif
+
+	if (!addrok) {
+		CLOSESOCKET(c);
+		return;
+	}
+
+	for (i = 0; api_conns[i]; ++i)
+		;
+	conn = malloc(sizeof(*conn));
+	if (unlikely(!conn))
+		quit(1, "Failed to malloc api_conn");
+	*conn = (struct api_conn){
+		.sock = c,
+		.group = group,
+		.state = ACS_READ,
+		.last_active = time(NULL),
+		.io_data = api_io_get(c),
+	};
+	snprintf(conn->connectaddr, sizeof(conn->connectaddr), "%s", connectaddr);
+	api_set_nonblocking(c);
+	api_conns[i] = conn;
+	++api_conn_count;
+}
+
+static void api_serve(const SOCKETTYPE apisock)
+{
+	struct api_conn *conn;
+	struct timeval tv_now, tv_timeout;
+	fd_set rfds, wfds;
+	int maxfd;
+	time_t now;
+	int i, waits;
+
+	api_set_nonblocking(apisock);
+
+	while (!bye) {
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(api_notifier[0], &rfds);
+		maxfd = api_notifier[0];
+		if (api_conn_count < API_MAX_CONNS) {
+			FD_SET(apisock, &rfds);
+			set_maxfd(&maxfd, apisock);
+		}
+
+		now = time(NULL);
+		cgtime(&tv_now);
+		timer_set_delay(&tv_timeout, &tv_now, 1000000);
+		for (i = 0; i < API_MAX_CONNS; ++i) {
+			conn = api_conns[i];
+			if (!conn || conn->state == ACS_BUSY)
+				continue;
+			if (conn->state == ACS_STREAM) {
+				if (!timer_isset(&conn->telemetry->tv_next) || timer_passed(&conn->telemetry->tv_next, &tv_now))
+					api_telemetry_queue(conn, &tv_now);
+				else
+					reduce_timeout_to(&tv_timeout, &conn->telemetry->tv_next);
+				// Still watch for the subscriber going away
+				FD_SET(conn->sock, &rfds);
+				set_maxfd(&maxfd, conn->sock);
+				continue;
+			}
+			if (now - conn->last_active > API_IDLE_TIMEOUT) {
+				applog(LOG_DEBUG, "API: connection from %s timed out", conn->connectaddr);
+				api_conn_close(i);
+				continue;
+			}
+			FD_SET(conn->sock, (conn->state == ACS_READ) ? &rfds : &wfds);
+			set_maxfd(&maxfd, conn->sock);
+		}
+
+		if (select(maxfd + 1, &rfds, &wfds, NULL, select_timeout(&tv_timeout, &tv_now)) < 0) {
+			if (SOCKERR != EINTR)
+				applog(LOG_WARNING, "API: select failed: %s", SOCKERRMSG);
+			continue;
+		}
+
+		// Handle connections before accepting new ones, since the socket numbers may get reused
+		for (i = 0; i < API_MAX_CONNS; ++i) {
+			conn = api_conns[i];
+			if (!conn)
+				continue;
+			if ((conn->state == ACS_READ || conn->state == ACS_STREAM) && FD_ISSET(conn->sock, &rfds)) {
+				conn->last_active = time(NULL);
+				if (!api_conn_read(conn))
+					api_conn_close(i);
+			}
+			else
+			if (conn->state == ACS_WRITE && FD_ISSET(conn->sock, &wfds)) {
+				conn->last_active = time(NULL);
+				if (!api_conn_write(conn))
+					api_conn_close(i);
+			}
+		}
+
+		if (FD_ISSET(api_notifier[0], &rfds)) {
+			notifier_read(api_notifier);
+			api_conns_take_done();
+		}
+
+		if (FD_ISSET(apisock, &rfds))
+			api_accept(apisock);
+	}
+
+	// Give the reply to quit/restart (and any other pending ones) a chance to get out
+	for (waits = 0; waits < 10; ++waits) {
+		api_conns_take_done();
+		for (i = 0; i < API_MAX_CONNS; ++i) {
+			conn = api_conns[i];
+			if (conn && conn->state == ACS_WRITE)
+				io_flush(conn->io_data, true);
+		}
+		for (i = 0; i < API_MAX_CONNS; ++i)
+			if (api_conns[i] && api_conns[i]->state == ACS_BUSY)
+				break;
+		if (i == API_MAX_CONNS)
+			break;
+		cgsleep_ms(100);
+	}
+}
+
+static void tidyup(__maybe_unused void *arg)
+{
+	mutex_lock(&quit_restart_lock);
+
+	SOCKETTYPE *apisock = (SOCKETTYPE *)arg;
+
+	bye = true;
+
+	if (*apisock != INVSOCK) {
+		shutdown(*apisock, SHUT_RDWR);
+		CLOSESOCKET(*apisock);
+		*apisock = INVSOCK;
+		free(apisock);
+	}
+
+	if (ipaccess != NULL) {
+		free(ipaccess);
+		ipaccess = NULL;
+	}
+
+	api_conns_close_idle();
+
+	mutex_unlock(&quit_restart_lock);
+}
+
+// Turns a group's "|cmd1|cmd2|" list into a bit for each index in cmds[]
+static uint32_t *group_allowed_bits(const char * const commands)
+{
+	const int cmdcount = api_cmd_count();
+	uint32_t * const bits = calloc((cmdcount + 31) / 32, sizeof(*bits));
+	char cmdbuf[100];
+	int i;
+
+	if (unlikely(!bits))
+		quit(1, "Failed to calloc group command bits");
+
+	for (i = 0; i < cmdcount; i++) {
+		sprintf(cmdbuf, "|%s|", cmds[i].name);
+		if (strstr(commands, cmdbuf))
+			bits[i / 32] |= (uint32_t)1 << (i % 32);
+	}
+
+	return bits;
+}
+
+/*
+ * Interpret --api-groups G:cmd1:cmd2:cmd3,P:cmd4,*,...
+ */
+static void setup_groups()
+{
+	char *api_groups = opt_api_groups ? opt_api_groups : (char *)BLANK;
+	char *buf, *ptr, *next, *colon;
+	char group;
+	char commands[TMPBUFSIZ];
+	char cmdbuf[100];
+	char *cmd;
+	bool addstar, did;
+	int i;
+
+	buf = malloc(strlen(api_groups) + 1);
+	if (unlikely(!buf))
+		quit(1, "Failed to malloc ipgroups buf");
+
+	strcpy(buf, api_groups);
+
+	next = buf;
+	// for each group defined
+	while (next && *next) {
+		ptr = next;
+		next = strchr(ptr, ',');
+		if (next)
+			*(next++) = '\0';
 
 		// Validate the group
 		if (*(ptr+1) != ':') {
@@ -3703,6 +5412,12 @@ static void setup_groups()
 
 	// W (PRIVGROUP) is handled as a special case since it simply means all commands
 
+	// Requests are checked against these, rather than searching the strings
+	api_cmd_hash_init();
+	for (i = 0; i < 'Z' - 'A' + 1; i++)
+		if (apigroups[i].commands)
+			apigroups[i].allowed = group_allowed_bits(apigroups[i].commands);
+
 	free(buf);
 	return;
 }
@@ -4034,30 +5749,12 @@ void mcast_init()
 
 void api(int api_thr_id)
 {
-	struct io_data *io_data;
 	struct thr_info bye_thr;
-	char buf[TMPBUFSIZ];
-	char param_buf[TMPBUFSIZ];
-	SOCKETTYPE c;
-	int n, bound;
-	char *connectaddr;
+	int bound;
 	const char *binderror;
 	struct timeval bindstart;
 	short int port = opt_api_port;
 	struct sockaddr_in serv;
-	struct sockaddr_in cli;
-	socklen_t clisiz;
-	char cmdbuf[100];
-	char *cmd;
-	char *param;
-	bool addrok;
-	char group;
-	json_error_t json_err;
-	json_t *json_config;
-	json_t *json_val;
-	bool isjson;
-	bool did;
-	int i;
 
 	SOCKETTYPE *apisock;
 
@@ -4069,9 +5766,6 @@ void api(int api_thr_id)
 	apisock = malloc(sizeof(*apisock));
 	*apisock = INVSOCK;
 
-	rpc_io_data =
-	io_data = sock_io_new();
-
 	mutex_init(&quit_restart_lock);
 
 	pthread_cleanup_push(tidyup, (void *)apisock);
@@ -4161,132 +5855,10 @@ void api(int api_thr_id)
 	if (opt_api_mcast)
 		mcast_init();
 
-	while (!bye) {
-		clisiz = sizeof(cli);
-		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
-			applog(LOG_ERR, "API failed (%s)%s", SOCKERRMSG, UNAVAILABLE);
-			goto die;
-		}
-
-		addrok = check_connect(&cli, &connectaddr, &group);
-		applog(LOG_DEBUG, "API: connection from %s - %s",
-					connectaddr, addrok ? "Accepted" : "Ignored");
-
-		if (addrok) {
-			n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
-			if (SOCKETFAIL(n))
-				buf[0] = '\0';
-			else
-				buf[n] = '\0';
+	api_workers_start();
 
-			if (opt_debug) {
-				if (SOCKETFAIL(n))
-					applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
-				else
-					applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
-			}
-
-			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
-				io_reinit(io_data);
-				io_data->sock = c;
-
-				did = false;
+	api_serve(*apisock);
 
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
-
-#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
-					json_config = json_loadb(buf, n, 0, &json_err);
-#elif JANSSON_MAJOR_VERSION > 1
-					json_config = json_loads(buf, 0, &json_err);
-#else
-					json_config = json_loads(buf, &json_err);
-#endif
-
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					}
-					else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						}
-						else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							}
-							else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
-
-				if (!did)
-					for (i = 0; cmds[i].name != NULL; i++) {
-						if (strcmp(cmd, cmds[i].name) == 0) {
-							sprintf(cmdbuf, "|%s|", cmd);
-							if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-							{
-								per_proc = !strncmp(cmds[i].name, "proc", 4);
-								(cmds[i].func)(io_data, c, param, isjson, group);
-							}
-							else {
-								message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-								applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-							}
-
-							send_result(io_data, c, isjson);
-							did = true;
-							break;
-						}
-					}
-
-				if (isjson)
-					json_decref(json_config);
-
-				if (!did) {
-					message(io_data, MSG_INVCMD, 0, NULL, isjson);
-					send_result(io_data, c, isjson);
-				}
-			}
-		}
-		CLOSESOCKET(c);
-	}
-die:
-	/* Blank line fix for older compilers since pthread_cleanup_pop is a
-	 * macro that gets confused by a label existing immediately before it
-	 */
-	;
 	pthread_cleanup_pop(true);
 
 	if (opt_debug)
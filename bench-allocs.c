@@ -0,0 +1,52 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Heap allocation counting for --bench-suite. This is only linked into
+ * bfgminer-bench (which is never installed), so the bfgminer binary keeps the
+ * system allocator untouched.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef __GLIBC__
+#error "bfgminer-bench needs glibc to count heap allocations"
+#endif
+
+// glibc allows replacing malloc, and exports its own under these names
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+volatile bool bench_count_allocs;
+unsigned long bench_allocs;
+
+void *malloc(size_t sz)
+{
+	if (__builtin_expect(bench_count_allocs, 0))
+		__sync_add_and_fetch(&bench_allocs, 1);
+	return __libc_malloc(sz);
+}
+
+void *calloc(size_t nmemb, size_t sz)
+{
+	if (__builtin_expect(bench_count_allocs, 0))
+		__sync_add_and_fetch(&bench_allocs, 1);
+	return __libc_calloc(nmemb, sz);
+}
+
+void *realloc(void *p, size_t sz)
+{
+	if (__builtin_expect(bench_count_allocs, 0))
+		__sync_add_and_fetch(&bench_allocs, 1);
+	return __libc_realloc(p, sz);
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Converts binary nonce and share logs (binlog.h) to the CSV formats of --noncelog and --sharelog */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binlog.h"
+
+struct id_names {
+	char **names;
+	uint32_t sz;
+};
+
+// Pool URLs and processor names, by id
+static struct id_names pool_urls, proc_names;
+
+static
+void hexstr(char * const out, const uint8_t * const in, const size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+	
+	for (i = 0; i < len; ++i)
+	{
+		out[i * 2] = hex[in[i] >> 4];
+		out[i * 2 + 1] = hex[in[i] & 0xf];
+	}
+	out[len * 2] = '\0';
+}
+
+static
+bool set_name(struct id_names * const t, const uint32_t id, const char * const name)
+{
+	if (id >= t->sz)
+	{
+		const uint32_t newsz = id + 8;
+		char ** const p = realloc(t->names, newsz * sizeof(*t->names));
+		if (!p)
+			return false;
+		memset(&p[t->sz], 0, (newsz - t->sz) * sizeof(*p));
+		t->names = p;
+		t->sz = newsz;
+	}
+	free(t->names[id]);
+	t->names[id] = strdup(name);
+	return t->names[id];
+}
+
+// Returns the name for id, or fallback followed by the id if it was never named
+static
+const char *get_name(const struct id_names * const t, const uint32_t id, const char * const fallback, char * const buf, const size_t bufsz)
+{
+	if (id < t->sz && t->names[id])
+		return t->names[id];
+	snprintf(buf, bufsz, "%s%lu", fallback, (unsigned long)id);
+	return buf;
+}
+
+static
+void print_nonce(const struct bfg_binlog_nonce * const rec)
+{
+	char unknown_proc[24], hash[65], data[161], midstate[65];
+	const char * const proc = get_name(&proc_names, rec->proc_id, "proc", unknown_proc, sizeof(unknown_proc));
+	
+	hexstr(hash, rec->hash, sizeof(rec->hash));
+	hexstr(data, rec->data, sizeof(rec->data));
+	hexstr(midstate, rec->midstate, sizeof(rec->midstate));
+	
+	// timestamp,proc,hash,data,midstate
+	printf("%lu,%s,%s,%s,%s\n",
+	       (unsigned long)rec->timestamp, proc,
+	       hash, data, midstate);
+}
+
+static
+void print_share(const struct bfg_binlog_share * const rec)
+{
+	char disposition[sizeof(rec->disposition) + 1];
+	char target[65], hash[65], data[257], unknown_url[24], unknown_proc[24];
+	const char * const url = get_name(&pool_urls, rec->pool_id, "pool", unknown_url, sizeof(unknown_url));
+	const char * const proc = get_name(&proc_names, rec->proc_id, "proc", unknown_proc, sizeof(unknown_proc));
+	
+	memcpy(disposition, rec->disposition, sizeof(rec->disposition));
+	disposition[sizeof(rec->disposition)] = '\0';
+	hexstr(target, rec->target, sizeof(rec->target));
+	hexstr(hash, rec->hash, sizeof(rec->hash));
+	hexstr(data, rec->data, sizeof(rec->data));
+	
+	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
+	printf("%lu,%s,%s,%s,%s,%u,%s,%s\n",
+	       (unsigned long)rec->timestamp, disposition, target, url, proc,
+	       (unsigned)rec->thr_id, hash, data);
+}
+
+static
+bool convert(FILE * const f, const char * const name)
+{
+	union {
+		struct bfg_binlog_rechdr hdr;
+		struct bfg_binlog_filehdr filehdr;
+		struct bfg_binlog_name name;
+		struct bfg_binlog_nonce nonce;
+		struct bfg_binlog_share share;
+		uint8_t buf[UINT16_MAX + 1];
+	} *rec;
+	unsigned long recno = 0;
+	size_t rd;
+	bool started = false, ok = false;
+	
+	rec = malloc(sizeof(*rec));
+	if (!rec)
+	{
+		fprintf(stderr, "%s: out of memory\n", name);
+		return false;
+	}
+	
+	while ((rd = fread(&rec->hdr, 1, sizeof(rec->hdr), f)) == sizeof(rec->hdr))
+	{
+		if (rec->buf[0] == BFG_BINLOG_MAGIC[0])
+		{
+			// A (possibly repeated) file header
+			if (fread(&rec->buf[sizeof(rec->hdr)], sizeof(rec->filehdr) - sizeof(rec->hdr), 1, f) != 1)
+				goto truncated;
+			if (memcmp(rec->filehdr.magic, BFG_BINLOG_MAGIC, sizeof(BFG_BINLOG_MAGIC)))
+			{
+				fprintf(stderr, "%s: record %lu: not a binary log\n", name, recno + 1);
+				goto out;
+			}
+			if (rec->filehdr.byteorder != BFG_BINLOG_BYTEORDER)
+			{
+				fprintf(stderr, "%s: written on a machine with different byte order\n", name);
+				goto out;
+			}
+			if (rec->filehdr.version != BFG_BINLOG_VERSION)
+			{
+				fprintf(stderr, "%s: unsupported version %lu\n", name, (unsigned long)rec->filehdr.version);
+				goto out;
+			}
+			started = true;
+			++recno;
+			continue;
+		}
+		if (!started)
+		{
+			fprintf(stderr, "%s: not a binary log\n", name);
+			goto out;
+		}
+		if (rec->hdr.len < sizeof(rec->hdr))
+		{
+			fprintf(stderr, "%s: record %lu: bad length %u\n", name, recno + 1, (unsigned)rec->hdr.len);
+			goto out;
+		}
+		if (fread(&rec->buf[sizeof(rec->hdr)], rec->hdr.len - sizeof(rec->hdr), 1, f) != 1 && rec->hdr.len > sizeof(rec->hdr))
+			goto truncated;
+		
+		switch (rec->hdr.type)
+		{
+			case BFG_BINLOG_POOL:
+			case BFG_BINLOG_PROC:
+				if (rec->hdr.len <= offsetof(struct bfg_binlog_name, name))
+					break;
+				rec->buf[rec->hdr.len - 1] = '\0';
+				if (!set_name((rec->hdr.type == BFG_BINLOG_POOL) ? &pool_urls : &proc_names, rec->name.id, rec->name.name))
+				{
+					fprintf(stderr, "%s: out of memory\n", name);
+					goto out;
+				}
+				break;
+			case BFG_BINLOG_NONCE:
+				if (rec->hdr.len >= sizeof(rec->nonce))
+					print_nonce(&rec->nonce);
+				break;
+			case BFG_BINLOG_SHARE:
+				if (rec->hdr.len >= sizeof(rec->share))
+					print_share(&rec->share);
+				break;
+			default:
+				// Unknown record types are skipped, so new ones can be added
+				break;
+		}
+		++recno;
+	}
+	if (rd)
+		goto truncated;
+	ok = !ferror(f);
+	if (!ok)
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+	goto out;
+
+truncated:
+	// The miner may still be writing; everything before this is usable
+	fprintf(stderr, "%s: truncated after record %lu\n", name, recno);
+	ok = true;
+out:
+	free(rec);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	int i, rv = 0;
+	
+	if (argc < 2 || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))
+	{
+		fprintf(stderr, "Usage: %s <binary log>... (- for standard input)\n"
+		                "Writes the log to standard output in the CSV format of --noncelog or --sharelog\n", argv[0]);
+		return (argc < 2) ? 1 : 0;
+	}
+	
+	for (i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "-"))
+			f = stdin;
+		else
+		{
+			f = fopen(argv[i], "rb");
+			if (!f)
+			{
+				fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+				rv = 1;
+				continue;
+			}
+		}
+		if (!convert(f, argv[i]))
+			rv = 1;
+		if (f != stdin)
+			fclose(f);
+	}
+	
+	return rv;
+}
@@ -0,0 +1,957 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* A scripted stratum pool for benchmarking bfgminer: jobs are generated from a
+ * seed, so runs are repeatable, and every submitted share is fully checked */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <jansson.h>
+
+#include "sha2.h"
+#include "util.h"
+
+#define POOLSIM_MAX_MERKLES  20
+#define POOLSIM_COINB1_LEN   42
+#define POOLSIM_COINB2_LEN   60
+// Recent jobs that shares are still checked against
+#define POOLSIM_JOBS  0x10
+#define POOLSIM_MAX_CONNS  0x1000
+#define POOLSIM_MAX_LINE  0x2000
+#define POOLSIM_MAX_WBUF  0x1000000
+// How far past the job's ntime a share may roll
+#define POOLSIM_NTIME_ROLL  7200
+
+static const char *opt_bind = "127.0.0.1";
+static int opt_port = 3334;
+static int opt_merkles = 4;
+static int opt_notify_ms = 30000;
+static int opt_clean_every = 20;
+static double opt_diff = 1;
+static int opt_latency_ms, opt_jitter_ms;
+static int opt_disconnect_secs;
+static int opt_n2size = 4;
+static int opt_duration;
+static int opt_report_secs = 10;
+static uint64_t opt_seed = 1;
+
+struct poolsim_job {
+	uint32_t id;
+	uint32_t block;
+	uint8_t version[4];
+	uint8_t prevhash[32];
+	uint8_t nbits[4];
+	uint32_t ntime;
+	uint8_t coinb1[POOLSIM_COINB1_LEN];
+	uint8_t coinb2[POOLSIM_COINB2_LEN];
+	uint8_t merkle[POOLSIM_MAX_MERKLES][32];
+	char *notify;
+	size_t notify_len;
+};
+
+struct poolsim_conn {
+	int fd;
+	uint64_t gen;
+	uint32_t nonce1;
+	bool subscribed;
+	bool authorized;
+	char rbuf[POOLSIM_MAX_LINE];
+	size_t rlen;
+	char *wbuf;
+	size_t wlen, wsz;
+	bool overflow;
+};
+
+// A reply held back to simulate pool latency
+struct poolsim_reply {
+	int64_t due_us;
+	unsigned conn;
+	uint64_t gen;
+	char *msg;
+	size_t len;
+};
+
+static struct poolsim_job jobs[POOLSIM_JOBS];
+static uint32_t cur_job_id, cur_block;
+static unsigned notify_count;
+
+static struct poolsim_conn *conns[POOLSIM_MAX_CONNS];
+static unsigned conns_count;
+static uint64_t conn_gen;
+static uint32_t next_nonce1;
+
+static struct poolsim_reply *replies;
+static size_t replies_count, replies_sz;
+
+// Low 64 bits of each accepted share's hash since the last block, for spotting duplicates
+static uint64_t *seen;
+static size_t seen_count, seen_sz;
+
+static struct {
+	uint64_t connections, disconnects;
+	uint64_t accepted, stale, duplicate, lowdiff, invalid;
+	double diff_accepted;
+} stats, last_stats;
+
+static uint64_t rng_state;
+static volatile sig_atomic_t want_quit;
+
+static
+uint64_t poolsim_rand()
+{
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static
+void poolsim_rand_bytes(uint8_t * const out, const size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; ++i)
+		out[i] = poolsim_rand() >> 56;
+}
+
+static
+int64_t poolsim_now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static
+void hexstr(char * const out, const uint8_t * const in, const size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+	
+	for (i = 0; i < len; ++i)
+	{
+		out[i * 2] = hex[in[i] >> 4];
+		out[i * 2 + 1] = hex[in[i] & 0xf];
+	}
+	out[len * 2] = '\0';
+}
+
+static
+int hexval(const char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// Only succeeds if the string is exactly len bytes of hex
+static
+bool unhexstr(uint8_t * const out, const char * const in, const size_t len)
+{
+	size_t i;
+	int hi, lo;
+	
+	if (!in || strlen(in) != len * 2)
+		return false;
+	for (i = 0; i < len; ++i)
+	{
+		hi = hexval(in[i * 2]);
+		lo = hexval(in[i * 2 + 1]);
+		if (hi < 0 || lo < 0)
+			return false;
+		out[i] = (hi << 4) | lo;
+	}
+	return true;
+}
+
+static
+void sha256d(const uint8_t * const in, const size_t len, uint8_t * const out)
+{
+	uint8_t first[32];
+	sha256(in, len, first);
+	sha256(first, 32, out);
+}
+
+// Stratum sends header fields as 32-bit words in the opposite byte order
+static
+void swap32(uint8_t * const out, const uint8_t * const in, const size_t len)
+{
+	size_t i;
+	for (i = 0; i < len; i += 4)
+	{
+		out[i] = in[i + 3];
+		out[i + 1] = in[i + 2];
+		out[i + 2] = in[i + 1];
+		out[i + 3] = in[i];
+	}
+}
+
+static
+void poolsim_new_job(const bool clean)
+{
+	struct poolsim_job * const job = &jobs[++cur_job_id % POOLSIM_JOBS];
+	char prevhash[65], coinb1[POOLSIM_COINB1_LEN * 2 + 1], coinb2[POOLSIM_COINB2_LEN * 2 + 1];
+	char version[9], nbits[9], branch[POOLSIM_MAX_MERKLES * 67 + 1], *p;
+	static uint8_t block_prevhash[32];
+	int i;
+	
+	if (clean)
+	{
+		++cur_block;
+		poolsim_rand_bytes(block_prevhash, sizeof(block_prevhash));
+		seen_count = 0;
+		memset(seen, 0, seen_sz * sizeof(*seen));
+	}
+	
+	free(job->notify);
+	*job = (struct poolsim_job){
+		.id = cur_job_id,
+		.block = cur_block,
+		.version = {0, 0, 0, 2},
+		.nbits = {0x1d, 0, 0xff, 0xff},
+		.ntime = time(NULL),
+	};
+	memcpy(job->prevhash, block_prevhash, 32);
+	poolsim_rand_bytes(job->coinb1, sizeof(job->coinb1));
+	poolsim_rand_bytes(job->coinb2, sizeof(job->coinb2));
+	poolsim_rand_bytes(&job->merkle[0][0], opt_merkles * 32);
+	
+	hexstr(prevhash, job->prevhash, 32);
+	hexstr(coinb1, job->coinb1, sizeof(job->coinb1));
+	hexstr(coinb2, job->coinb2, sizeof(job->coinb2));
+	hexstr(version, job->version, 4);
+	hexstr(nbits, job->nbits, 4);
+	p = branch;
+	for (i = 0; i < opt_merkles; ++i)
+	{
+		if (i)
+			*(p++) = ',';
+		*(p++) = '"';
+		hexstr(p, job->merkle[i], 32);
+		p += 64;
+		*(p++) = '"';
+	}
+	*p = '\0';
+	
+	job->notify = malloc(0x100 + strlen(prevhash) + strlen(coinb1) + strlen(coinb2) + strlen(branch));
+	job->notify_len = sprintf(job->notify, "{\"params\":[\"%"PRIx32"\",\"%s\",\"%s\",\"%s\",[%s],\"%s\",\"%s\",\"%08"PRIx32"\",%s],\"id\":null,\"method\":\"mining.notify\"}\n",
+	                          job->id, prevhash, coinb1, coinb2, branch, version, nbits, job->ntime, clean ? "true" : "false");
+}
+
+static
+void poolsim_conn_send(struct poolsim_conn * const conn, const char * const msg, const size_t len)
+{
+	ssize_t sent = 0;
+	
+	if (!conn->wlen)
+	{
+		sent = send(conn->fd, msg, len, MSG_NOSIGNAL);
+		if (sent < 0)
+			sent = 0;
+		if ((size_t)sent == len)
+			return;
+	}
+	if (conn->wlen + len - sent > conn->wsz)
+	{
+		if (conn->wlen + len - sent > POOLSIM_MAX_WBUF)
+		{
+			// Not reading what we send; give up on it
+			conn->overflow = true;
+			return;
+		}
+		conn->wsz = (conn->wlen + len - sent) * 2;
+		conn->wbuf = realloc(conn->wbuf, conn->wsz);
+		if (!conn->wbuf)
+		{
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(&conn->wbuf[conn->wlen], &msg[sent], len - sent);
+	conn->wlen += len - sent;
+}
+
+static
+void poolsim_reply_push(const unsigned connidx, char * const msg, const size_t len)
+{
+	int64_t delay_us = (int64_t)opt_latency_ms * 1000, due_us;
+	size_t i;
+	
+	if (opt_jitter_ms)
+		delay_us += (int64_t)(poolsim_rand() % (2 * opt_jitter_ms * 1000 + 1)) - opt_jitter_ms * 1000;
+	if (delay_us <= 0)
+	{
+		poolsim_conn_send(conns[connidx], msg, len);
+		free(msg);
+		return;
+	}
+	
+	if (replies_count == replies_sz)
+	{
+		replies_sz = replies_sz ? (replies_sz * 2) : 0x100;
+		replies = realloc(replies, replies_sz * sizeof(*replies));
+		if (!replies)
+		{
+			perror("realloc");
+			exit(1);
+		}
+	}
+	// Binary min-heap on due_us
+	due_us = poolsim_now_us() + delay_us;
+	i = replies_count++;
+	while (i && replies[(i - 1) / 2].due_us > due_us)
+	{
+		replies[i] = replies[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	replies[i] = (struct poolsim_reply){
+		.due_us = due_us,
+		.conn = connidx,
+		.gen = conns[connidx]->gen,
+		.msg = msg,
+		.len = len,
+	};
+}
+
+static
+void poolsim_reply_pop()
+{
+	struct poolsim_reply last = replies[--replies_count];
+	size_t i = 0, child;
+	
+	while ((child = i * 2 + 1) < replies_count)
+	{
+		if (child + 1 < replies_count && replies[child + 1].due_us < replies[child].due_us)
+			++child;
+		if (last.due_us <= replies[child].due_us)
+			break;
+		replies[i] = replies[child];
+		i = child;
+	}
+	replies[i] = last;
+}
+
+static
+void poolsim_replies_due(const int64_t now)
+{
+	struct poolsim_reply *r;
+	struct poolsim_conn *conn;
+	
+	while (replies_count && replies[0].due_us <= now)
+	{
+		r = &replies[0];
+		conn = conns[r->conn];
+		// The connection may have closed, and the slot reused, meanwhile
+		if (conn && conn->gen == r->gen)
+			poolsim_conn_send(conn, r->msg, r->len);
+		free(r->msg);
+		poolsim_reply_pop();
+	}
+}
+
+static
+void poolsim_reply(const unsigned connidx, const char * const idstr, const char * const result, const int errcode, const char * const errmsg, const bool delayed)
+{
+	char *msg;
+	size_t len;
+	
+	msg = malloc(0x40 + strlen(idstr) + (result ? strlen(result) : 0) + (errmsg ? strlen(errmsg) : 0));
+	if (errcode)
+		len = sprintf(msg, "{\"id\":%s,\"result\":null,\"error\":[%d,\"%s\",null]}\n", idstr, errcode, errmsg);
+	else
+		len = sprintf(msg, "{\"id\":%s,\"result\":%s,\"error\":null}\n", idstr, result);
+	if (delayed)
+		poolsim_reply_push(connidx, msg, len);
+	else
+	{
+		poolsim_conn_send(conns[connidx], msg, len);
+		free(msg);
+	}
+}
+
+static
+void poolsim_seen_grow()
+{
+	uint64_t * const old = seen;
+	const size_t oldsz = seen_sz;
+	size_t i, j;
+	
+	seen_sz = oldsz ? (oldsz * 2) : 0x400;
+	seen = calloc(seen_sz, sizeof(*seen));
+	if (!seen)
+	{
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < oldsz; ++i)
+	{
+		if (!old[i])
+			continue;
+		for (j = old[i] & (seen_sz - 1); seen[j]; j = (j + 1) & (seen_sz - 1))
+		{}
+		seen[j] = old[i];
+	}
+	free(old);
+}
+
+// Returns false if the share was already seen
+static
+bool poolsim_seen_add(uint64_t key)
+{
+	size_t i;
+	
+	if (!key)
+		key = 1;
+	if ((seen_count + 1) * 2 > seen_sz)
+		poolsim_seen_grow();
+	for (i = key & (seen_sz - 1); seen[i]; i = (i + 1) & (seen_sz - 1))
+		if (seen[i] == key)
+			return false;
+	seen[i] = key;
+	++seen_count;
+	return true;
+}
+
+// Returns 0 and the share difficulty, or a stratum error code
+static
+int poolsim_check_share(const struct poolsim_conn * const conn, json_t * const params, const char ** const errmsg, double * const share_diff)
+{
+	const char * const job_idstr = json_string_value(json_array_get(params, 1));
+	const char * const nonce2hex = json_string_value(json_array_get(params, 2));
+	const char * const ntimehex = json_string_value(json_array_get(params, 3));
+	const char * const noncehex = json_string_value(json_array_get(params, 4));
+	const struct poolsim_job *job;
+	uint8_t coinbase[POOLSIM_COINB1_LEN + 4 + 0x20 + POOLSIM_COINB2_LEN];
+	uint8_t data[80], header[80], buf[64], hash[32];
+	uint32_t job_id, ntime;
+	char *endptr;
+	double h;
+	int i;
+	
+	if (!(job_idstr && job_idstr[0]))
+		goto invalid;
+	job_id = strtoul(job_idstr, &endptr, 0x10);
+	if (*endptr)
+		goto invalid;
+	job = &jobs[job_id % POOLSIM_JOBS];
+	if (job->id != job_id || job->block != cur_block)
+	{
+		if (job_id > cur_job_id || !job_id)
+			goto invalid;
+		*errmsg = "Job not found (=stale)";
+		return 21;
+	}
+	
+	memcpy(coinbase, job->coinb1, POOLSIM_COINB1_LEN);
+	coinbase[POOLSIM_COINB1_LEN] = conn->nonce1 >> 24;
+	coinbase[POOLSIM_COINB1_LEN + 1] = conn->nonce1 >> 16;
+	coinbase[POOLSIM_COINB1_LEN + 2] = conn->nonce1 >> 8;
+	coinbase[POOLSIM_COINB1_LEN + 3] = conn->nonce1;
+	if (!unhexstr(&coinbase[POOLSIM_COINB1_LEN + 4], nonce2hex, opt_n2size))
+		goto invalid;
+	memcpy(&coinbase[POOLSIM_COINB1_LEN + 4 + opt_n2size], job->coinb2, POOLSIM_COINB2_LEN);
+	
+	// The header is assembled as sent in mining.notify, then word swapped
+	memcpy(&data[0], job->version, 4);
+	memcpy(&data[4], job->prevhash, 32);
+	memcpy(&data[72], job->nbits, 4);
+	if (!(unhexstr(&data[68], ntimehex, 4) && unhexstr(&data[76], noncehex, 4)))
+		goto invalid;
+	ntime = ((uint32_t)data[68] << 24) | ((uint32_t)data[69] << 16) | ((uint32_t)data[70] << 8) | data[71];
+	if (ntime < job->ntime || ntime > job->ntime + POOLSIM_NTIME_ROLL)
+	{
+		*errmsg = "ntime out of range";
+		return 20;
+	}
+	swap32(header, data, 80);
+	
+	sha256d(coinbase, POOLSIM_COINB1_LEN + 4 + opt_n2size + POOLSIM_COINB2_LEN, buf);
+	for (i = 0; i < opt_merkles; ++i)
+	{
+		memcpy(&buf[32], job->merkle[i], 32);
+		sha256d(buf, 64, buf);
+	}
+	memcpy(&header[36], buf, 32);
+	
+	sha256d(header, 80, hash);
+	
+	// Hashes are little endian numbers; difficulty 1 is 0xffff * 2**208
+	h = 0;
+	for (i = 31; i >= 0; --i)
+		h = h * 256 + hash[i];
+	*share_diff = h ? (ldexp(0xffff, 208) / h) : HUGE_VAL;
+	if (*share_diff < opt_diff * (1 - 1e-9))
+	{
+		*errmsg = "Low difficulty share";
+		return 23;
+	}
+	
+	if (!poolsim_seen_add(((uint64_t)hash[0] << 56) | ((uint64_t)hash[1] << 48) | ((uint64_t)hash[2] << 40) | ((uint64_t)hash[3] << 32)
+	                    | ((uint64_t)hash[4] << 24) | ((uint64_t)hash[5] << 16) | ((uint64_t)hash[6] << 8) | hash[7]))
+	{
+		*errmsg = "Duplicate share";
+		return 22;
+	}
+	
+	return 0;
+
+invalid:
+	*errmsg = "Invalid share";
+	return 20;
+}
+
+static
+void poolsim_handle_line(const unsigned connidx, char * const line)
+{
+	struct poolsim_conn * const conn = conns[connidx];
+	json_t *json, *params, *id;
+	json_error_t jerr;
+	const char *method, *errmsg;
+	char idstr[0x40], buf[0x100];
+	double share_diff;
+	int errcode;
+	
+	json = JSON_LOADS(line, &jerr);
+	if (!json)
+		return;
+	method = json_string_value(json_object_get(json, "method"));
+	params = json_object_get(json, "params");
+	id = json_object_get(json, "id");
+	
+	if (!id || json_is_null(id))
+		// Notifications (like mining.suggest_target) need no reply
+		goto out;
+	if (json_is_integer(id))
+		snprintf(idstr, sizeof(idstr), "%"JSON_INTEGER_FORMAT, json_integer_value(id));
+	else
+	if (json_is_string(id) && strlen(json_string_value(id)) < sizeof(idstr) - 2 && !strpbrk(json_string_value(id), "\"\\"))
+		snprintf(idstr, sizeof(idstr), "\"%s\"", json_string_value(id));
+	else
+		goto out;
+	
+	if (!method)
+		poolsim_reply(connidx, idstr, NULL, 20, "Missing method", false);
+	else
+	if (!strcmp(method, "mining.subscribe"))
+	{
+		conn->subscribed = true;
+		conn->nonce1 = next_nonce1++;
+		snprintf(buf, sizeof(buf), "[[[\"mining.set_difficulty\",\"%08"PRIx32"\"],[\"mining.notify\",\"%08"PRIx32"\"]],\"%08"PRIx32"\",%d]",
+		         conn->nonce1, conn->nonce1, conn->nonce1, opt_n2size);
+		poolsim_reply(connidx, idstr, buf, 0, NULL, false);
+		snprintf(buf, sizeof(buf), "{\"params\":[%.16g],\"id\":null,\"method\":\"mining.set_difficulty\"}\n", opt_diff);
+		poolsim_conn_send(conn, buf, strlen(buf));
+		poolsim_conn_send(conn, jobs[cur_job_id % POOLSIM_JOBS].notify, jobs[cur_job_id % POOLSIM_JOBS].notify_len);
+	}
+	else
+	if (!strcmp(method, "mining.authorize"))
+	{
+		conn->authorized = true;
+		poolsim_reply(connidx, idstr, "true", 0, NULL, false);
+	}
+	else
+	if (!strcmp(method, "mining.submit"))
+	{
+		if (!conn->subscribed)
+			poolsim_reply(connidx, idstr, NULL, 25, "Not subscribed", true);
+		else
+		if (!conn->authorized)
+			poolsim_reply(connidx, idstr, NULL, 24, "Unauthorized worker", true);
+		else
+		if ((errcode = poolsim_check_share(conn, params, &errmsg, &share_diff)))
+		{
+			switch (errcode)
+			{
+				case 21:  ++stats.stale;      break;
+				case 22:  ++stats.duplicate;  break;
+				case 23:  ++stats.lowdiff;    break;
+				default:  ++stats.invalid;    break;
+			}
+			poolsim_reply(connidx, idstr, NULL, errcode, errmsg, true);
+		}
+		else
+		{
+			++stats.accepted;
+			stats.diff_accepted += opt_diff;
+			poolsim_reply(connidx, idstr, "true", 0, NULL, true);
+		}
+	}
+	else
+	if (!strcmp(method, "mining.get_transactions"))
+	{
+		// Just enough dummy transactions for bfgminer's transparency check to pass
+		const unsigned txns = opt_merkles ? (1 << (opt_merkles - 1)) : 0;
+		char * const txlist = malloc(3 + txns * 5);
+		char *p = txlist;
+		unsigned i;
+		*(p++) = '[';
+		for (i = 0; i < txns; ++i)
+			p += sprintf(p, "%s\"00\"", i ? "," : "");
+		strcpy(p, "]");
+		poolsim_reply(connidx, idstr, txlist, 0, NULL, false);
+		free(txlist);
+	}
+	else
+		poolsim_reply(connidx, idstr, NULL, 20, "Unsupported method", false);
+
+out:
+	json_decref(json);
+}
+
+static
+void poolsim_conn_close(const unsigned connidx)
+{
+	struct poolsim_conn * const conn = conns[connidx];
+	
+	close(conn->fd);
+	free(conn->wbuf);
+	free(conn);
+	conns[connidx] = NULL;
+	--conns_count;
+	++stats.disconnects;
+}
+
+static
+void poolsim_accept(const int lsock)
+{
+	struct poolsim_conn *conn;
+	unsigned i;
+	int fd, one = 1;
+	
+	while ((fd = accept(lsock, NULL, NULL)) >= 0)
+	{
+		for (i = 0; i < POOLSIM_MAX_CONNS && conns[i]; ++i)
+		{}
+		if (i == POOLSIM_MAX_CONNS)
+		{
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		conn = calloc(1, sizeof(*conn));
+		if (!conn)
+		{
+			perror("calloc");
+			exit(1);
+		}
+		conn->fd = fd;
+		conn->gen = ++conn_gen;
+		conns[i] = conn;
+		++conns_count;
+		++stats.connections;
+	}
+}
+
+// Returns false if the connection is gone
+static
+bool poolsim_conn_read(const unsigned connidx)
+{
+	struct poolsim_conn * const conn = conns[connidx];
+	char *nl, *line;
+	ssize_t rd;
+	
+	rd = recv(conn->fd, &conn->rbuf[conn->rlen], sizeof(conn->rbuf) - 1 - conn->rlen, 0);
+	if (rd <= 0)
+		return (rd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+	conn->rlen += rd;
+	conn->rbuf[conn->rlen] = '\0';
+	
+	line = conn->rbuf;
+	while ((nl = strchr(line, '\n')))
+	{
+		*nl = '\0';
+		poolsim_handle_line(connidx, line);
+		line = nl + 1;
+	}
+	conn->rlen -= line - conn->rbuf;
+	if (conn->rlen == sizeof(conn->rbuf) - 1)
+		// Line too long
+		return false;
+	memmove(conn->rbuf, line, conn->rlen);
+	return true;
+}
+
+static
+bool poolsim_conn_flush(struct poolsim_conn * const conn)
+{
+	ssize_t sent;
+	
+	if (conn->overflow)
+		return false;
+	if (!conn->wlen)
+		return true;
+	sent = send(conn->fd, conn->wbuf, conn->wlen, MSG_NOSIGNAL);
+	if (sent < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+	conn->wlen -= sent;
+	memmove(conn->wbuf, &conn->wbuf[sent], conn->wlen);
+	return true;
+}
+
+static
+double poolsim_cpu_secs()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static
+void poolsim_report(const double elapsed, const double interval)
+{
+	printf("%7.1fs: %u miners, %u notifies, %.2f shares/s (%.2f diff1/s), %"PRIu64" stale, %"PRIu64" duplicate, %"PRIu64" low difficulty, %"PRIu64" invalid\n",
+	       elapsed, conns_count, notify_count,
+	       (stats.accepted - last_stats.accepted) / interval,
+	       (stats.diff_accepted - last_stats.diff_accepted) / interval,
+	       stats.stale - last_stats.stale, stats.duplicate - last_stats.duplicate,
+	       stats.lowdiff - last_stats.lowdiff, stats.invalid - last_stats.invalid);
+	fflush(stdout);
+	last_stats = stats;
+}
+
+static
+void poolsim_summary(const double elapsed)
+{
+	const uint64_t submitted = stats.accepted + stats.stale + stats.duplicate + stats.lowdiff + stats.invalid;
+	
+	printf("\n"
+	       "Elapsed: %.1f s\n"
+	       "Notifies: %u\n"
+	       "Connections: %"PRIu64"\n"
+	       "Disconnects: %"PRIu64"\n"
+	       "Shares submitted: %"PRIu64"\n"
+	       "Shares accepted: %"PRIu64"\n"
+	       "Shares/s: %.3f\n"
+	       "Hashrate: %.3f Mh/s\n"
+	       "Stale: %"PRIu64" (%.2f%%)\n"
+	       "Duplicate: %"PRIu64"\n"
+	       "Low difficulty: %"PRIu64"\n"
+	       "Invalid: %"PRIu64"\n"
+	       "Simulator CPU: %.2f s\n",
+	       elapsed, notify_count, stats.connections, stats.disconnects,
+	       submitted, stats.accepted, stats.accepted / elapsed,
+	       stats.diff_accepted * 4294967296. / elapsed / 1e6,
+	       stats.stale, submitted ? (stats.stale * 100. / submitted) : 0.,
+	       stats.duplicate, stats.lowdiff, stats.invalid,
+	       poolsim_cpu_secs());
+}
+
+static
+void poolsim_sighandler(int sig)
+{
+	want_quit = 1;
+}
+
+static
+void usage(const char * const argv0)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+	        "  -b <addr>     Address to listen on (default: %s)\n"
+	        "  -p <port>     Port to listen on (default: %d)\n"
+	        "  -m <depth>    Merkle branch depth, 0-%d (default: %d)\n"
+	        "  -n <ms>       Time between notifies (default: %d)\n"
+	        "  -c <count>    Start a new block every this many notifies (default: %d)\n"
+	        "  -d <diff>     Share difficulty (default: %g)\n"
+	        "  -l <ms>       Latency of replies to submitted shares (default: 0)\n"
+	        "  -j <ms>       Random jitter added to that latency, plus or minus (default: 0)\n"
+	        "  -x <secs>     Disconnect every miner this often (default: never)\n"
+	        "  -e <bytes>    Extranonce2 size, 1-32 (default: %d)\n"
+	        "  -t <secs>     Exit after this long (default: run until interrupted)\n"
+	        "  -r <secs>     Report progress this often (default: %d)\n"
+	        "  -s <seed>     Seed for generating jobs (default: %"PRIu64")\n",
+	        argv0, opt_bind, opt_port, POOLSIM_MAX_MERKLES, opt_merkles, opt_notify_ms, opt_clean_every,
+	        opt_diff, opt_n2size, opt_report_secs, opt_seed);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd *pfds;
+	unsigned *pfd_conn;
+	struct sockaddr_in sa = {
+		.sin_family = AF_INET,
+	};
+	int64_t start, now, next_notify, next_disconnect, next_report, last_report, wait_us;
+	unsigned i, npfds;
+	int lsock, one = 1, c;
+	
+	while ((c = getopt(argc, argv, "b:p:m:n:c:d:l:j:x:e:t:r:s:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'b':  opt_bind = optarg;                     break;
+			case 'p':  opt_port = atoi(optarg);               break;
+			case 'm':  opt_merkles = atoi(optarg);            break;
+			case 'n':  opt_notify_ms = atoi(optarg);          break;
+			case 'c':  opt_clean_every = atoi(optarg);        break;
+			case 'd':  opt_diff = atof(optarg);               break;
+			case 'l':  opt_latency_ms = atoi(optarg);         break;
+			case 'j':  opt_jitter_ms = atoi(optarg);          break;
+			case 'x':  opt_disconnect_secs = atoi(optarg);    break;
+			case 'e':  opt_n2size = atoi(optarg);             break;
+			case 't':  opt_duration = atoi(optarg);           break;
+			case 'r':  opt_report_secs = atoi(optarg);        break;
+			case 's':  opt_seed = strtoull(optarg, NULL, 0);  break;
+			default:
+				usage(argv[0]);
+				return (c == 'h') ? 0 : 1;
+		}
+	}
+	if (optind != argc || opt_merkles < 0 || opt_merkles > POOLSIM_MAX_MERKLES || opt_notify_ms < 1
+	 || opt_clean_every < 1 || !(opt_diff > 0) || opt_latency_ms < 0 || opt_jitter_ms < 0
+	 || opt_n2size < 1 || opt_n2size > 0x20 || opt_report_secs < 1)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	rng_state = opt_seed ?: 1;
+	
+	sa.sin_port = htons(opt_port);
+	if (inet_pton(AF_INET, opt_bind, &sa.sin_addr) != 1)
+	{
+		fprintf(stderr, "%s: not an IPv4 address\n", opt_bind);
+		return 1;
+	}
+	lsock = socket(AF_INET, SOCK_STREAM, 0);
+	if (lsock < 0)
+	{
+		perror("socket");
+		return 1;
+	}
+	setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(lsock, (struct sockaddr *)&sa, sizeof(sa)) || listen(lsock, 0x80))
+	{
+		fprintf(stderr, "%s:%d: %s\n", opt_bind, opt_port, strerror(errno));
+		return 1;
+	}
+	fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL) | O_NONBLOCK);
+	
+	signal(SIGINT, poolsim_sighandler);
+	signal(SIGTERM, poolsim_sighandler);
+	signal(SIGPIPE, SIG_IGN);
+	
+	pfds = malloc(sizeof(*pfds) * (POOLSIM_MAX_CONNS + 1));
+	pfd_conn = malloc(sizeof(*pfd_conn) * (POOLSIM_MAX_CONNS + 1));
+	poolsim_seen_grow();
+	
+	printf("Listening on %s:%d\n", opt_bind, opt_port);
+	fflush(stdout);
+	
+	start = last_report = poolsim_now_us();
+	next_notify = start;
+	next_disconnect = opt_disconnect_secs ? (start + (int64_t)opt_disconnect_secs * 1000000) : INT64_MAX;
+	next_report = start + (int64_t)opt_report_secs * 1000000;
+	while (!want_quit)
+	{
+		now = poolsim_now_us();
+		if (opt_duration && now - start >= (int64_t)opt_duration * 1000000)
+			break;
+		
+		if (now >= next_notify)
+		{
+			const bool clean = !(notify_count % opt_clean_every);
+			poolsim_new_job(clean);
+			++notify_count;
+			for (i = 0; i < POOLSIM_MAX_CONNS; ++i)
+				if (conns[i] && conns[i]->subscribed)
+					poolsim_conn_send(conns[i], jobs[cur_job_id % POOLSIM_JOBS].notify, jobs[cur_job_id % POOLSIM_JOBS].notify_len);
+			next_notify += (int64_t)opt_notify_ms * 1000;
+			if (next_notify < now)
+				next_notify = now + (int64_t)opt_notify_ms * 1000;
+		}
+		if (now >= next_disconnect)
+		{
+			for (i = 0; i < POOLSIM_MAX_CONNS; ++i)
+				if (conns[i])
+					poolsim_conn_close(i);
+			next_disconnect += (int64_t)opt_disconnect_secs * 1000000;
+		}
+		if (now >= next_report)
+		{
+			poolsim_report((now - start) / 1e6, (now - last_report) / 1e6);
+			last_report = now;
+			next_report += (int64_t)opt_report_secs * 1000000;
+		}
+		poolsim_replies_due(now);
+		
+		wait_us = next_notify;
+		if (next_disconnect < wait_us)
+			wait_us = next_disconnect;
+		if (next_report < wait_us)
+			wait_us = next_report;
+		if (replies_count && replies[0].due_us < wait_us)
+			wait_us = replies[0].due_us;
+		wait_us -= now;
+		if (wait_us < 0)
+			wait_us = 0;
+		
+		pfds[0] = (struct pollfd){ .fd = lsock, .events = POLLIN };
+		npfds = 1;
+		for (i = 0; i < POOLSIM_MAX_CONNS; ++i)
+		{
+			if (!conns[i])
+				continue;
+			pfds[npfds] = (struct pollfd){
+				.fd = conns[i]->fd,
+				.events = POLLIN | (conns[i]->wlen ? POLLOUT : 0),
+			};
+			pfd_conn[npfds++] = i;
+		}
+		if (poll(pfds, npfds, (wait_us + 999) / 1000) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+		
+		for (i = 1; i < npfds; ++i)
+		{
+			const unsigned connidx = pfd_conn[i];
+			if (!conns[connidx])
+				continue;
+			if ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !poolsim_conn_read(connidx))
+			{
+				poolsim_conn_close(connidx);
+				continue;
+			}
+			if (!poolsim_conn_flush(conns[connidx]))
+				poolsim_conn_close(connidx);
+		}
+		if (pfds[0].revents & POLLIN)
+			poolsim_accept(lsock);
+	}
+	
+	poolsim_summary((poolsim_now_us() - start) / 1e6);
+	return 0;
+}
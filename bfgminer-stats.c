@@ -0,0 +1,258 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Reads the memory-mapped stats file maintained by bfgminer --stats-file */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "statshm.h"
+
+static const char *status_str[] = {
+	[BFG_STATSHM_DISABLED] = "Disabled",
+	[BFG_STATSHM_ALIVE] = "Alive",
+	[BFG_STATSHM_SICK] = "Sick",
+	[BFG_STATSHM_DEAD] = "Dead",
+	[BFG_STATSHM_OTHER] = "Other",
+};
+
+// Copies a record that may be older (shorter) or newer (longer) than ours
+static
+bool read_record(void * const out, const size_t outsz, const volatile uint8_t * const rec, const size_t recsz)
+{
+	memset(out, 0, outsz);
+	return bfg_statshm_read(out, rec, (recsz < outsz) ? recsz : outsz);
+}
+
+static
+bool check_header(const struct bfg_statshm_header * const hdr, const size_t len)
+{
+	if (len < sizeof(*hdr) || hdr->magic != BFG_STATSHM_MAGIC)
+	{
+		fprintf(stderr, "Not a bfgminer stats file (or not initialised yet)\n");
+		return false;
+	}
+	if (hdr->version != BFG_STATSHM_VERSION)
+	{
+		fprintf(stderr, "Unsupported stats file version %u\n", (unsigned)hdr->version);
+		return false;
+	}
+	if ((uint64_t)hdr->processor_offset + (uint64_t)hdr->processor_capacity * hdr->processor_record_size > len
+	 || (uint64_t)hdr->pool_offset + (uint64_t)hdr->pool_capacity * hdr->pool_record_size > len
+	 || hdr->processor_count > hdr->processor_capacity || hdr->pool_count > hdr->pool_capacity)
+	{
+		fprintf(stderr, "Stats file is truncated or corrupt\n");
+		return false;
+	}
+	return true;
+}
+
+static
+void print_stats(const struct bfg_statshm_header * const hdr)
+{
+	const volatile uint8_t * const base = (const volatile uint8_t *)hdr;
+	struct bfg_statshm_global g;
+	struct bfg_statshm_processor proc;
+	struct bfg_statshm_pool pool;
+	uint32_t i, n;
+	
+	if (!bfg_statshm_read(&g, &hdr->global, sizeof(g)))
+	{
+		fprintf(stderr, "Totals busy, skipping\n");
+		return;
+	}
+	printf("bfgminer pid %d, elapsed %.0fs, updated %lds ago\n",
+	       (int)hdr->pid, g.elapsed, (long)(time(NULL) - g.updated));
+	printf("Total: %.2f Mh/s rolling, %.2f Mh/s average | A:%lld R:%lld S:%lld HW:%lld | Diff A:%.0f R:%.0f S:%.0f | GW:%lld\n",
+	       g.rolling_mhs, g.elapsed ? (g.total_mhashes / g.elapsed) : 0.,
+	       (long long)g.accepted, (long long)g.rejected, (long long)g.stale, (long long)g.hw_errors,
+	       g.diff_accepted, g.diff_rejected, g.diff_stale,
+	       (long long)g.getworks);
+	
+	printf("\n%-8s %-6s %-8s %10s %8s %8s %8s %8s %6s\n",
+	       "Proc", "Driver", "Status", "Mh/s", "Accepted", "Rejected", "Stale", "HW", "Temp");
+	n = hdr->processor_count;
+	for (i = 0; i < n; ++i)
+	{
+		if (!read_record(&proc, sizeof(proc), &base[hdr->processor_offset + i * hdr->processor_record_size], hdr->processor_record_size))
+		{
+			printf("%-8s (busy)\n", "?");
+			continue;
+		}
+		if (!proc.name[0])
+			continue;
+		proc.name[sizeof(proc.name) - 1] = '\0';
+		proc.driver[sizeof(proc.driver) - 1] = '\0';
+		printf("%-8s %-6s %-8s %10.2f %8lld %8lld %8lld %8lld ",
+		       proc.name, proc.driver,
+		       ((unsigned)proc.status < sizeof(status_str) / sizeof(*status_str)) ? status_str[proc.status] : "?",
+		       proc.rolling_mhs,
+		       (long long)proc.accepted, (long long)proc.rejected, (long long)proc.stale, (long long)proc.hw_errors);
+		if (proc.temp)
+			printf("%5.1fC\n", proc.temp);
+		else
+			printf("%6s\n", "-");
+	}
+	
+	printf("\n%-4s %-5s %8s %8s %8s %8s  %s\n",
+	       "Pool", "Alive", "Accepted", "Rejected", "Stale", "Getworks", "URL");
+	n = hdr->pool_count;
+	for (i = 0; i < n; ++i)
+	{
+		if (!read_record(&pool, sizeof(pool), &base[hdr->pool_offset + i * hdr->pool_record_size], hdr->pool_record_size))
+		{
+			printf("%-4u (busy)\n", (unsigned)i);
+			continue;
+		}
+		pool.url[sizeof(pool.url) - 1] = '\0';
+		printf("%-4d %-5s %8lld %8lld %8lld %8lld  %s\n",
+		       (int)pool.pool_no, pool.alive ? "Yes" : "No",
+		       (long long)pool.accepted, (long long)pool.rejected, (long long)pool.stale, (long long)pool.getworks,
+		       pool.url);
+	}
+}
+
+struct stats_map {
+	struct bfg_statshm_header *hdr;
+	size_t len;
+	// Identifies the file mapped, as bfgminer replaces it on every start
+	dev_t dev;
+	ino_t ino;
+	int64_t started;
+	int32_t pid;
+};
+
+static
+void unmap_stats(struct stats_map * const map)
+{
+	if (map->hdr)
+		munmap(map->hdr, map->len);
+	map->hdr = NULL;
+}
+
+static
+bool map_stats(struct stats_map * const map, const char * const path)
+{
+	struct stat st;
+	void *p;
+	int fd;
+	
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+	*map = (struct stats_map){
+		.hdr = p,
+		.len = st.st_size,
+		.dev = st.st_dev,
+		.ino = st.st_ino,
+	};
+	if (!check_header(map->hdr, map->len))
+	{
+		unmap_stats(map);
+		return false;
+	}
+	map->started = map->hdr->started;
+	map->pid = map->hdr->pid;
+	return true;
+}
+
+// Whether the mapped file is no longer the one bfgminer is updating
+static
+bool stats_replaced(const struct stats_map * const map, const char * const path)
+{
+	struct stat st;
+	
+	if (stat(path, &st))
+		// Gone: bfgminer is probably restarting, so keep showing the old one
+		return false;
+	if (st.st_dev != map->dev || st.st_ino != map->ino)
+		return true;
+	// Should the same file be reinitialised in place
+	return (map->hdr->started != map->started || map->hdr->pid != map->pid);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path;
+	struct stats_map map = {
+		.hdr = NULL,
+	};
+	int interval = 0, c;
+	
+	while ((c = getopt(argc, argv, "i:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-i <seconds>] <stats file>\n", argv[0]);
+				return (c == 'h') ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1)
+	{
+		fprintf(stderr, "Usage: %s [-i <seconds>] <stats file>\n", argv[0]);
+		return 1;
+	}
+	path = argv[optind];
+	
+	if (!map_stats(&map, path))
+		return 1;
+	
+	while (true)
+	{
+		print_stats(map.hdr);
+		if (interval <= 0)
+			break;
+		fflush(stdout);
+		sleep(interval);
+		printf("\n");
+		if (stats_replaced(&map, path))
+		{
+			struct stats_map newmap;
+			
+			// A new file may not be initialised yet, so only switch once it is
+			if (map_stats(&newmap, path))
+			{
+				unmap_stats(&map);
+				map = newmap;
+				printf("(bfgminer restarted, reopened %s)\n", path);
+			}
+		}
+	}
+	
+	unmap_stats(&map);
+	return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Binary nonce log and share log format (--noncelog-binary and
+ * --sharelog-binary), converted back to the CSV logs by bfgminer-logconv.
+ *
+ * A file is a bfg_binlog_filehdr followed by records, each starting with a
+ * bfg_binlog_rechdr giving its type and total length. Nonce and share records
+ * are fixed-size, and refer to pools and processors by id. A pool record
+ * (giving its URL) or processor record (giving its name) is written whenever
+ * an id is first used in the file, or names something else now. A file may
+ * hold several file headers back to back if the miner was restarted appending
+ * to it; ids are only named again as the new run uses them. Everything is in
+ * the miner's native byte order, which byteorder in the file header
+ * identifies.
+ */
+
+#ifndef BFG_BINLOG_H
+#define BFG_BINLOG_H
+
+#include <stdint.h>
+
+#define BFG_BINLOG_MAGIC      "BFGBLOG"
+#define BFG_BINLOG_VERSION    2
+#define BFG_BINLOG_BYTEORDER  0x01020304
+
+struct bfg_binlog_filehdr {
+	char magic[8];  // BFG_BINLOG_MAGIC, NUL padded
+	uint32_t version;
+	uint32_t byteorder;
+};
+
+enum bfg_binlog_type {
+	BFG_BINLOG_POOL  = 1,
+	BFG_BINLOG_NONCE = 2,
+	BFG_BINLOG_SHARE = 3,
+	BFG_BINLOG_PROC  = 4,
+};
+
+// What became of a nonce meeting difficulty 1
+enum bfg_binlog_nonce_result {
+	BFG_BINLOG_NONCE_BELOW_TARGET = 1,  // not a share for its pool
+	BFG_BINLOG_NONCE_SHARE        = 2,  // submitted (see the share log)
+};
+
+struct bfg_binlog_rechdr {
+	uint8_t type;
+	uint8_t _pad;
+	uint16_t len;  // including this header
+};
+
+// BFG_BINLOG_POOL (the name is its URL) or BFG_BINLOG_PROC
+struct bfg_binlog_name {
+	struct bfg_binlog_rechdr hdr;
+	uint32_t id;
+	char name[];  // NUL terminated, hdr.len covers it
+};
+
+struct bfg_binlog_nonce {
+	struct bfg_binlog_rechdr hdr;
+	uint32_t pool_id;
+	uint64_t timestamp;
+	uint32_t proc_id;
+	uint8_t result;  // enum bfg_binlog_nonce_result
+	uint8_t _pad[3];
+	uint8_t data[80];  // block header, including the nonce
+	uint8_t hash[32];
+	uint8_t midstate[32];
+};
+
+struct bfg_binlog_share {
+	struct bfg_binlog_rechdr hdr;
+	uint32_t pool_id;
+	uint64_t timestamp;
+	uint32_t proc_id;
+	uint32_t thr_id;
+	char disposition[36];
+	uint8_t target[32];
+	uint8_t hash[32];
+	uint8_t data[128];
+};
+
+#endif
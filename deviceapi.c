@@ -108,6 +108,9 @@ bool hashes_done(struct thr_info *thr, int64_t hashes, struct timeval *tvp_hashe
 	else
 		thr->scanhash_working = true;
 	
+	if (unlikely(thr->hw_errors_deferred))
+		run_deferred_hw_errors(thr);
+	
 	thr->hashes_done += hashes;
 	if (hashes > cgpu->max_hashes)
 		cgpu->max_hashes = hashes;
@@ -748,6 +751,7 @@ bool _add_cgpu(struct cgpu_info *cgpu)
 		cgpu->procs = 1;
 	lpcount = cgpu->procs;
 	cgpu->device = cgpu;
+	mutex_init(&cgpu->hashmeter_lock);
 	
 	cgpu->dev_repr = malloc(6);
 	sprintf(cgpu->dev_repr, "%s%2u", cgpu->drv->name, cgpu->device_id % 100);
@@ -783,6 +787,7 @@ bool _add_cgpu(struct cgpu_info *cgpu)
 		{
 			slave = malloc(sizeof(*slave));
 			*slave = *cgpu;
+			mutex_init(&slave->hashmeter_lock);
 			slave->proc_id = i;
 			if (manylp)
 			{
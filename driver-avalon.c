@@ -320,7 +320,7 @@ static bool avalon_decode_nonce(struct thr_info *thr, struct avalon_result *ar,
 	info = avalon->device_data;
 	info->matching_work[work->subid]++;
 	*nonce = htole32(ar->nonce);
-	submit_nonce(thr, work, *nonce);
+	submit_nonce_async(thr, work, *nonce);
 	
 	free_work(work);
 
@@ -370,7 +370,7 @@ void bifury_handle_cmd(struct cgpu_info * const dev, const char * const cmd)
 		if (work)
 		{
 			const uint32_t work_ntime = be32toh(*(uint32_t*)&work->data[68]);
-			submit_noffset_nonce(thr, work, nonce, ntime - work_ntime);
+			submit_noffset_nonce_async(thr, work, nonce, ntime - work_ntime);
 		}
 		else
 		if (!jobid)
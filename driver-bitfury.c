@@ -358,6 +358,61 @@ int bitfury_select_freq(struct bitfury_device *bitfury, struct cgpu_info *proc)
 	return 0;
 }
 
+// Sends the atrvec of each chip in a chain sharing one SPI port
+// If the chain is unchanged since the last transaction on the port, only the changed payload words are rewritten
+static
+void bitfury_chain_io(struct spi_port * const spi, struct cgpu_info ** const procs, const int n_chips, void ** const rxbuf)
+{
+	unsigned char * const rxbase = spi_getrxbuf(spi);
+	struct bitfury_device *bitfury = NULL;
+	bool reuse = true;
+	int i, lastchip = -1;
+	
+	for (i = 0; i < n_chips; ++i)
+	{
+		bitfury = procs[i]->device_data;
+		if (bitfury->txn_bufgen != spi->bufgen || bitfury->txn_prev_fasync != lastchip)
+		{
+			reuse = false;
+			break;
+		}
+		lastchip = bitfury->fasync;
+	}
+	if (reuse && spi_getbufsz(spi) != bitfury->txn_off + sizeof(bitfury->txn_atrvec))
+		reuse = false;
+	
+	if (reuse)
+	{
+		for (i = 0; i < n_chips; ++i)
+		{
+			bitfury = procs[i]->device_data;
+			spi_patch_data(spi, bitfury->txn_off, bitfury->atrvec, bitfury->txn_atrvec, sizeof(bitfury->txn_atrvec));
+			memcpy(bitfury->txn_atrvec, bitfury->atrvec, sizeof(bitfury->txn_atrvec));
+			rxbuf[i] = &rxbase[bitfury->txn_off];
+		}
+	}
+	else
+	{
+		spi_clear_buf(spi);
+		spi_emit_break(spi);
+		lastchip = -1;
+		for (i = 0; i < n_chips; ++i)
+		{
+			bitfury = procs[i]->device_data;
+			spi_emit_fasync(spi, bitfury->fasync - (lastchip < 0 ? 0 : lastchip));
+			rxbuf[i] = spi_emit_data(spi, 0x3000, &bitfury->atrvec[0], sizeof(bitfury->txn_atrvec));
+			memcpy(bitfury->txn_atrvec, bitfury->atrvec, sizeof(bitfury->txn_atrvec));
+			bitfury->txn_bufgen = spi->bufgen;
+			bitfury->txn_off = (unsigned char *)rxbuf[i] - rxbase;
+			bitfury->txn_prev_fasync = lastchip;
+			lastchip = bitfury->fasync;
+		}
+	}
+	
+	spi_txrx(spi);
+	spi_stat_update(spi);
+}
+
 void bitfury_do_io(struct thr_info * const master_thr)
 {
 	struct cgpu_info *proc;
@@ -368,7 +423,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 	int n, i, j;
 	bool newjob;
 	uint32_t nonce;
-	int n_chips = 0, lastchip = 0;
+	int n_chips = 0, chain_start = 0;
 	struct spi_port *spi = NULL;
 	bool should_be_running;
 	struct timeval tv_now;
@@ -398,16 +453,11 @@ void bitfury_do_io(struct thr_info * const master_thr)
 			if (spi != bitfury->spi)
 			{
 				if (spi)
-					spi_txrx(spi);
+					bitfury_chain_io(spi, &procs[chain_start], n_chips - chain_start, &rxbuf[chain_start]);
 				spi = bitfury->spi;
-				spi_clear_buf(spi);
-				spi_emit_break(spi);
-				lastchip = 0;
+				chain_start = n_chips;
 			}
 			procs[n_chips] = proc;
-			spi_emit_fasync(spi, bitfury->fasync - lastchip);
-			lastchip = bitfury->fasync;
-			rxbuf[n_chips] = spi_emit_data(spi, 0x3000, &bitfury->atrvec[0], 19 * 4);
 			++n_chips;
 		}
 		else
@@ -420,7 +470,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 		return;
 	}
 	timer_set_now(&tv_now);
-	spi_txrx(spi);
+	bitfury_chain_io(spi, &procs[chain_start], n_chips - chain_start, &rxbuf[chain_start]);
 	
 	for (j = 0; j < n_chips; ++j)
 	{
@@ -588,7 +638,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 				{
 					applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (work=%p)",
 					       proc->proc_repr, i, (unsigned long)nonce, thr->work);
-					submit_nonce(thr, thr->work, nonce);
+					submit_nonce_async(thr, thr->work, nonce);
 					bitfury->counter2 += 1;
 				}
 				else
@@ -596,7 +646,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 				{
 					applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (prev work=%p)",
 					       proc->proc_repr, i, (unsigned long)nonce, thr->prev_work);
-					submit_nonce(thr, thr->prev_work, nonce);
+					submit_nonce_async(thr, thr->prev_work, nonce);
 					bitfury->counter2 += 1;
 				}
 				else
@@ -667,6 +717,12 @@ struct api_data *bitfury_api_device_status(struct cgpu_info * const cgpu)
 	root = api_add_int(root, "Clock Bits", &clock_bits, true);
 	root = api_add_freq(root, "Frequency", &bitfury->mhz, false);
 	
+	// Totals for the whole SPI port (shared by every chip on it), over the last SPI_STAT_WINDOW_MS
+	const struct spi_port * const spi = bitfury->spi;
+	double txns_sec = spi->stat_txns_sec, bytes_sec = spi->stat_bytes_sec;
+	root = api_add_double(root, "SPI Port Transactions/s", &txns_sec, true);
+	root = api_add_double(root, "SPI Port Bytes/s", &bytes_sec, true);
+	
 	return root;
 }
 
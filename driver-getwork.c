@@ -127,14 +127,20 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 		// NOTE: expecting hex2bin to fail since we only parse 80 of the 128
 		hex2bin(hdr, submit, 80);
 		nonce = le32toh(*(uint32_t *)&hdr[76]);
+		// Held while using the work, so it can't be expired from under us
+		mutex_lock(&client->work_lock);
 		HASH_FIND(hh, client->work, hdr, 76, work);
 		if (!work)
 		{
+			mutex_unlock(&client->work_lock);
+			mutex_lock(&client->thr_lock);
 			inc_hw_errors2(thr, NULL, &nonce);
+			mutex_unlock(&client->thr_lock);
 			rejreason = "unknown-work";
 		}
 		else
 		{
+			mutex_lock(&client->thr_lock);
 			if (!submit_nonce(thr, work, nonce))
 				rejreason = "H-not-zero";
 			else
@@ -142,6 +148,8 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 				rejreason = "stale";
 			else
 				rejreason = NULL;
+			mutex_unlock(&client->thr_lock);
+			mutex_unlock(&client->work_lock);
 			
 			if (!hashesdone)
 				hashesdone = "0x100000000";
@@ -173,7 +181,10 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 	{
 		const size_t replysz = 590 + idstr_sz;
 		
-		work = get_work(thr);
+		if (opt_httpsrv_prefetch)
+			work = proxy_client_get_work(client);
+		else
+			work = get_work(thr);
 		reply = malloc(replysz);
 		memcpy(reply, "{\"error\":null,\"result\":{\"target\":\"ffffffffffffffffffffffffffffffffffffffffffffffffffffffff00000000\",\"data\":\"", 108);
 		bin2hex(&reply[108], work->data, 128);
@@ -183,8 +194,7 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 		memcpy(&reply[589], idstr ?: "0", idstr_sz);
 		memcpy(&reply[589 + idstr_sz], "}", 1);
 		
-		timer_set_now(&work->tv_work_start);
-		HASH_ADD_KEYPTR(hh, client->work, work->data, 76, work);
+		proxy_client_issue_work(client, work);
 		
 		resp = MHD_create_response_from_buffer(replysz, reply, MHD_RESPMEM_MUST_FREE);
 		getwork_prepare_resp(resp);
@@ -195,7 +205,11 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 	
 out:
 	if (hashesdone)
+	{
+		mutex_lock(&client->thr_lock);
 		hashes_done2(thr, strtoll(hashesdone, NULL, 0), NULL);
+		mutex_unlock(&client->thr_lock);
+	}
 	
 	free(idstr);
 	if (json)
@@ -204,6 +204,8 @@ bool hashbusterusb_lowl_probe(const struct lowlevel_device_info * const info)
 	int chip_n;
 	
 	port = malloc(sizeof(*port));
+	/* Be careful, read spidevc.h comments for warnings */
+	memset(port, 0, sizeof(*port));
 	port->cgpu = &dummy_cgpu;
 	port->txrx = hashbusterusb_spi_txrx;
 	port->userp = ep;
@@ -234,6 +234,7 @@ int littlefury_chip_count(struct cgpu_info * const info)
 {
 	/* Do not allocate spi_port on the stack! OS X, at least, has a 512 KB default stack size for secondary threads */
 	struct spi_port *spi = malloc(sizeof(*spi));
+	memset(spi, 0, sizeof(*spi));
 	spi->txrx = littlefury_txrx;
 	spi->cgpu = info;
 	spi->repr = littlefury_drv.dname;
@@ -9,8 +9,6 @@
 
 #include "config.h"
 
-#include <unistd.h>
-
 #include <pthread.h>
 
 #include <uthash.h>
@@ -27,11 +25,54 @@ struct proxy_client *proxy_clients;
 static
 pthread_mutex_t proxy_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static
+pthread_mutex_t proxy_prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static
+pthread_cond_t proxy_prefetch_cond = PTHREAD_COND_INITIALIZER;
+static
+struct proxy_client *proxy_prefetch_queue;
+
+// Caller must hold client->work_lock
+static
+void proxy_worklog_expire(struct proxy_client * const client, const struct timeval * const tv_now)
+{
+	struct work *work;
+	
+	while (client->worklog_count)
+	{
+		work = client->worklog[client->worklog_tail];
+		if (timer_elapsed(&work->tv_work_start, tv_now) <= opt_expiry)
+			break;
+		HASH_DEL(client->work, work);
+		free_work(work);
+		client->worklog_tail = (client->worklog_tail + 1) % client->worklog_size;
+		--client->worklog_count;
+	}
+}
+
+// Caller must hold client->work_lock
+static
+void proxy_worklog_grow(struct proxy_client * const client)
+{
+	const unsigned newsz = client->worklog_size ? (client->worklog_size * 2) : PROXY_WORKLOG_SIZE;
+	struct work ** const worklog = malloc(newsz * sizeof(*worklog));
+	
+	if (unlikely(!worklog))
+		quit(1, "Failed to grow proxy worklog for %s", client->username);
+	// Unwrap the ring, so the oldest work is first again
+	for (unsigned i = 0; i < client->worklog_count; ++i)
+		worklog[i] = client->worklog[(client->worklog_tail + i) % client->worklog_size];
+	free(client->worklog);
+	client->worklog = worklog;
+	client->worklog_size = newsz;
+	client->worklog_tail = 0;
+}
+
 static
 void prune_worklog()
 {
 	struct proxy_client *client, *tmp;
-	struct work *work, *tmp2;
+	struct work *work;
 	struct timeval tv_now;
 	
 	timer_set_now(&tv_now);
@@ -39,32 +80,124 @@ void prune_worklog()
 	mutex_lock(&proxy_clients_mutex);
 	HASH_ITER(hh, proxy_clients, client, tmp)
 	{
-		HASH_ITER(hh, client->work, work, tmp2)
-		{
-			if (timer_elapsed(&work->tv_work_start, &tv_now) <= opt_expiry)
-				break;
-			HASH_DEL(client->work, work);
+		mutex_lock(&client->work_lock);
+		proxy_worklog_expire(client, &tv_now);
+		// Don't hold on to work for clients that stopped asking for it
+		work = client->prefetch;
+		if (work && stale_work(work, false))
+			client->prefetch = NULL;
+		else
+			work = NULL;
+		mutex_unlock(&client->work_lock);
+		if (work)
 			free_work(work);
-		}
 	}
 	mutex_unlock(&proxy_clients_mutex);
 }
 
+void proxy_client_issue_work(struct proxy_client * const client, struct work * const work)
+{
+	timer_set_now(&work->tv_work_start);
+	
+	mutex_lock(&client->work_lock);
+	proxy_worklog_expire(client, &work->tv_work_start);
+	// Work is only forgotten once it expires, so submissions for it are still recognised
+	if (client->worklog_count == client->worklog_size)
+		proxy_worklog_grow(client);
+	client->worklog[(client->worklog_tail + client->worklog_count) % client->worklog_size] = work;
+	++client->worklog_count;
+	HASH_ADD_KEYPTR(hh, client->work, work->data, 76, work);
+	mutex_unlock(&client->work_lock);
+}
+
 static
-pthread_t prune_worklog_pth;
+void proxy_prefetch_queue_client(struct proxy_client * const client)
+{
+	mutex_lock(&proxy_prefetch_mutex);
+	if (!client->prefetch_queued)
+	{
+		client->prefetch_queued = true;
+		client->prefetch_next = proxy_prefetch_queue;
+		proxy_prefetch_queue = client;
+		pthread_cond_signal(&proxy_prefetch_cond);
+	}
+	mutex_unlock(&proxy_prefetch_mutex);
+}
+
+// Takes the client's prefetched work if it is still good, and queues the next
+struct work *proxy_client_get_work(struct proxy_client * const client)
+{
+	struct work *work;
+	
+	mutex_lock(&client->work_lock);
+	work = client->prefetch;
+	client->prefetch = NULL;
+	mutex_unlock(&client->work_lock);
+	
+	if (work && stale_work(work, false))
+	{
+		free_work(work);
+		work = NULL;
+	}
+	
+	proxy_prefetch_queue_client(client);
+	
+	if (!work)
+		work = get_work(client->cgpu->thr[0]);
+	return work;
+}
+
+static
+pthread_t proxy_prefetch_pth;
 
 static
-void *prune_worklog_thread(void *userdata)
+void *proxy_prefetch_thread(void *userdata)
 {
 	struct cgpu_info *cgpu = userdata;
+	struct proxy_client *client;
+	struct work *work, *old_work;
+	struct timeval tv_prune, tv_now;
+	struct timespec ts;
 	
 	pthread_detach(pthread_self());
-	RenameThread("PXY_pruner");
+	RenameThread("PXY_prefetch");
 	
+	timer_set_now(&tv_prune);
 	while (!cgpu->shutdown)
 	{
-		prune_worklog();
-		sleep(60);
+		mutex_lock(&proxy_prefetch_mutex);
+		if (!proxy_prefetch_queue)
+		{
+			gettimeofday(&tv_now, NULL);
+			ts.tv_sec = tv_now.tv_sec + 60;
+			ts.tv_nsec = tv_now.tv_usec * 1000;
+			pthread_cond_timedwait(&proxy_prefetch_cond, &proxy_prefetch_mutex, &ts);
+		}
+		client = proxy_prefetch_queue;
+		if (client)
+		{
+			proxy_prefetch_queue = client->prefetch_next;
+			client->prefetch_queued = false;
+		}
+		mutex_unlock(&proxy_prefetch_mutex);
+		
+		if (client)
+		{
+			work = get_work(client->cgpu->thr[0]);
+			mutex_lock(&client->work_lock);
+			old_work = client->prefetch;
+			client->prefetch = work;
+			mutex_unlock(&client->work_lock);
+			if (old_work)
+				free_work(old_work);
+		}
+		
+		timer_set_now(&tv_now);
+		if (timer_elapsed(&tv_prune, &tv_now) >= 60)
+		{
+			prune_worklog();
+			tv_prune = tv_now;
+		}
 	}
 	return NULL;
 }
@@ -72,7 +205,7 @@ void *prune_worklog_thread(void *userdata)
 static
 void proxy_first_client(struct cgpu_info *cgpu)
 {
-	pthread_create(&prune_worklog_pth, NULL, prune_worklog_thread, cgpu);
+	pthread_create(&proxy_prefetch_pth, NULL, proxy_prefetch_thread, cgpu);
 }
 
 struct proxy_client *proxy_find_or_create_client(const char *username)
@@ -109,6 +242,8 @@ struct proxy_client *proxy_find_or_create_client(const char *username)
 			.username = user,
 			.cgpu = cgpu,
 		};
+		mutex_init(&client->work_lock);
+		mutex_init(&client->thr_lock);
 		
 		b = HASH_COUNT(proxy_clients);
 		HASH_ADD_KEYPTR(hh, proxy_clients, client->username, strlen(user), client);
@@ -128,12 +263,27 @@ void proxy_wlogprint_status(struct cgpu_info *cgpu)
 {
 	struct proxy_client *client = cgpu->device_data;
 	wlogprint("Username: %s\n", client->username);
+	if (client->diff)
+		wlogprint("Difficulty: %g\n", client->diff);
 }
 #endif
 
+static
+struct api_data *proxy_api_stats(struct cgpu_info *cgpu)
+{
+	struct proxy_client * const client = cgpu->device_data;
+	struct api_data *root = NULL;
+	
+	if (client->diff)
+		root = api_add_diff(root, "Difficulty", &client->diff, false);
+	
+	return root;
+}
+
 struct device_drv proxy_drv = {
 	.dname = "proxy",
 	.name = "PXY",
+	.get_api_stats = proxy_api_stats,
 #ifdef HAVE_CURSES
 	.proc_wlogprint_status = proxy_wlogprint_status,
 #endif
@@ -1,19 +1,41 @@
 #ifndef BFG_DRIVER_PROXY_H
 #define BFG_DRIVER_PROXY_H
 
+#include <pthread.h>
+
 #include <uthash.h>
 
 #include "miner.h"
 
+// Initial size of the per-client log of issued getwork; it doubles whenever
+// more work than fits is still within --expiry
+#define PROXY_WORKLOG_SIZE 0x400
+
 struct proxy_client {
 	char *username;
 	struct cgpu_info *cgpu;
-	struct work *work;
+	
+	// Protects work, worklog and prefetch
+	pthread_mutex_t work_lock;
+	struct work *work;  // issued work, keyed by the first 76 bytes of data
+	struct work **worklog;  // the same, in order issued (ring of worklog_size)
+	unsigned worklog_size, worklog_tail, worklog_count;
+	struct work *prefetch;
+	bool prefetch_queued;
+	struct proxy_client *prefetch_next;
+	
+	// Serialises submit_nonce and hashes_done on cgpu->thr[0], which the
+	// server threads may call concurrently; taken after work_lock
+	pthread_mutex_t thr_lock;
+	
 	struct timeval tv_hashes_done;
+	double diff;  // last difficulty assigned to this client's miners
 	
 	UT_hash_handle hh;
 };
 
 extern struct proxy_client *proxy_find_or_create_client(const char *user);
+extern struct work *proxy_client_get_work(struct proxy_client *);
+extern void proxy_client_issue_work(struct proxy_client *, struct work *);
 
 #endif
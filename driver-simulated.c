@@ -0,0 +1,400 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Simulated devices for profiling the queue minerloop, get_work and
+ * submit_nonce without hardware. Each processor "hashes" its queued work at
+ * the configured rate, and reports nonces at the configured rate after the
+ * configured latency. Solutions are only known in advance for the benchmark
+ * block, so use --benchmark to have every nonce pass submit_nonce's checks.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utlist.h>
+
+#include "bench_block.h"
+#include "deviceapi.h"
+#include "logging.h"
+#include "miner.h"
+#include "util.h"
+
+#define SIM_POLL_INTERVAL_US  10000
+#define SIM_MAX_PROCS  (26 * 26)
+
+BFG_REGISTER_DRIVER(sim_drv)
+
+static const uint8_t sim_bench_block[] = { CGMINER_BENCHMARK_BLOCK };
+
+// The only nonce meeting difficulty 1 for the benchmark block (of all 2^32)
+static const uint32_t sim_bench_nonces[] = {
+	0xef8b187d,
+};
+
+struct sim_result {
+	struct work *work;
+	uint32_t nonce;
+	struct timeval tv_due;
+	struct sim_result *prev;
+	struct sim_result *next;
+};
+
+struct sim_proc {
+	// Settings
+	double hashrate;
+	int queue_max;
+	double nonce_rate;
+	int latency_ms;
+	bool report_unknown;
+	
+	struct work *queue;
+	int queue_size;
+	struct work *current;
+	int64_t current_hashes;
+	
+	struct timeval tv_last;
+	double hash_credit;
+	double nonce_credit;
+	unsigned table_pos;
+	
+	struct sim_result *results;
+	uint64_t unknown_nonces;
+};
+
+static
+bool sim_detect_one(const char *spec)
+{
+	struct cgpu_info *cgpu;
+	char *p;
+	long devs, procs = 1, i;
+	
+	// <devices>[x<processors>]
+	devs = strtol(spec, &p, 10);
+	if (p[0] == 'x')
+		procs = strtol(&p[1], &p, 10);
+	if (p[0] || devs < 1 || procs < 1 || procs > SIM_MAX_PROCS)
+		return false;
+	
+	for (i = 0; i < devs; ++i)
+	{
+		cgpu = malloc(sizeof(*cgpu));
+		*cgpu = (struct cgpu_info){
+			.drv = &sim_drv,
+			.devtype = "SIM",
+			.deven = DEV_ENABLED,
+			.procs = procs,
+			.threads = 1,
+		};
+		if (!add_cgpu(cgpu))
+			return false;
+	}
+	
+	return true;
+}
+
+static
+void sim_detect(void)
+{
+	generic_detect(&sim_drv, sim_detect_one, NULL, GDF_REQUIRE_DNAME | GDF_DEFAULT_NOAUTO);
+}
+
+static
+bool sim_init(struct thr_info * const thr)
+{
+	struct cgpu_info * const cgpu = thr->cgpu, *proc;
+	struct sim_proc *sp;
+	
+	for (proc = cgpu; proc; proc = proc->next_proc)
+	{
+		struct thr_info * const mythr = proc->thr[0];
+		
+		mythr->cgpu_data = sp = malloc(sizeof(*sp));
+		*sp = (struct sim_proc){
+			.hashrate = 1e9,
+			.queue_max = 2,
+			.nonce_rate = 1.,
+		};
+		timer_set_now(&sp->tv_last);
+		timer_set_now(&mythr->tv_poll);
+	}
+	
+	return true;
+}
+
+static
+void sim_found_nonce(struct thr_info * const thr, const struct timeval * const tvp_now)
+{
+	struct sim_proc * const sp = thr->cgpu_data;
+	struct work * const work = sp->current;
+	struct sim_result *res;
+	uint32_t nonce;
+	
+	if (!memcmp(work->data, sim_bench_block, 76))
+		nonce = sim_bench_nonces[sp->table_pos++ % ARRAY_SIZE(sim_bench_nonces)];
+	else
+	{
+		++sp->unknown_nonces;
+		if (!sp->report_unknown)
+			return;
+		// Wrong, but costs submit_nonce as much to check as a real one
+		nonce = sp->current_hashes - 1;
+	}
+	
+	res = malloc(sizeof(*res));
+	*res = (struct sim_result){
+		.work = copy_work(work),
+		.nonce = nonce,
+	};
+	timer_set_delay(&res->tv_due, tvp_now, sp->latency_ms * 1000);
+	DL_APPEND(sp->results, res);
+}
+
+// Credits the hashes done since the last call to the current and queued work
+static
+void sim_advance(struct thr_info * const thr, const struct timeval * const tvp_now)
+{
+	struct sim_proc * const sp = thr->cgpu_data;
+	int64_t hashes, step, total = 0;
+	
+	sp->hash_credit += timer_elapsed_us(&sp->tv_last, tvp_now) * sp->hashrate / 1e6;
+	sp->tv_last = *tvp_now;
+	hashes = sp->hash_credit;
+	sp->hash_credit -= hashes;
+	
+	while (hashes)
+	{
+		if (!sp->current)
+		{
+			if (!sp->queue)
+				break;
+			sp->current = sp->queue;
+			DL_DELETE(sp->queue, sp->current);
+			--sp->queue_size;
+			sp->current_hashes = 0;
+			thr->queue_full = false;
+		}
+		
+		step = 0x100000000 - sp->current_hashes;
+		if (step > hashes)
+			step = hashes;
+		sp->current_hashes += step;
+		hashes -= step;
+		total += step;
+		
+		sp->nonce_credit += step * sp->nonce_rate / 0x100000000;
+		while (sp->nonce_credit >= 1)
+		{
+			sp->nonce_credit -= 1;
+			sim_found_nonce(thr, tvp_now);
+		}
+		
+		if (sp->current_hashes >= 0x100000000)
+		{
+			free_work(sp->current);
+			sp->current = NULL;
+		}
+	}
+	
+	if (total)
+		hashes_done2(thr, total, NULL);
+}
+
+static
+bool sim_queue_append(struct thr_info * const thr, struct work * const work)
+{
+	struct sim_proc * const sp = thr->cgpu_data;
+	
+	if (sp->queue_size >= sp->queue_max)
+	{
+		thr->queue_full = true;
+		return false;
+	}
+	
+	DL_APPEND(sp->queue, work);
+	++sp->queue_size;
+	thr->queue_full = (sp->queue_size >= sp->queue_max);
+	
+	return true;
+}
+
+static
+void sim_queue_flush(struct thr_info * const thr)
+{
+	struct sim_proc * const sp = thr->cgpu_data;
+	struct work *work, *tmp;
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	sim_advance(thr, &tv_now);
+	
+	DL_FOREACH_SAFE(sp->queue, work, tmp)
+	{
+		DL_DELETE(sp->queue, work);
+		free_work(work);
+	}
+	sp->queue_size = 0;
+	if (sp->current)
+	{
+		free_work(sp->current);
+		sp->current = NULL;
+	}
+	thr->queue_full = false;
+}
+
+static
+void sim_poll(struct thr_info * const thr)
+{
+	struct sim_proc * const sp = thr->cgpu_data;
+	struct sim_result *res;
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	sim_advance(thr, &tv_now);
+	
+	while ((res = sp->results) && timer_passed(&res->tv_due, &tv_now))
+	{
+		DL_DELETE(sp->results, res);
+		submit_nonce(thr, res->work, res->nonce);
+		free_work(res->work);
+		free(res);
+	}
+	
+	timer_set_delay(&thr->tv_poll, &tv_now, SIM_POLL_INTERVAL_US);
+	if (sp->results)
+		reduce_timeout_to(&thr->tv_poll, &sp->results->tv_due);
+}
+
+static
+char *sim_set_device(struct cgpu_info * const proc, char * const option, char * const setting, char * const replybuf)
+{
+	struct sim_proc * const sp = proc->thr[0]->cgpu_data;
+	
+	if (!strcasecmp(option, "help"))
+	{
+		sprintf(replybuf, "hashrate: Mh/s per processor\n"
+		                  "queue: work items queued per processor\n"
+		                  "nonces: nonces per 2^32 hashes (1 is a difficulty 1 share rate)\n"
+		                  "latency: milliseconds before each nonce is reported\n"
+		                  "unknown: 1 to report nonces for non-benchmark work (as hardware errors)");
+		return replybuf;
+	}
+	
+	if (!setting || !*setting)
+	{
+		sprintf(replybuf, "missing setting");
+		return replybuf;
+	}
+	
+	if (!strcasecmp(option, "hashrate"))
+	{
+		const double val = atof(setting);
+		if (val <= 0)
+			goto invalid;
+		sp->hashrate = val * 1e6;
+		return NULL;
+	}
+	
+	if (!strcasecmp(option, "queue"))
+	{
+		const int val = atoi(setting);
+		if (val < 1 || val > 0x1000)
+			goto invalid;
+		sp->queue_max = val;
+		return NULL;
+	}
+	
+	if (!strcasecmp(option, "nonces"))
+	{
+		const double val = atof(setting);
+		if (val < 0)
+			goto invalid;
+		sp->nonce_rate = val;
+		return NULL;
+	}
+	
+	if (!strcasecmp(option, "latency"))
+	{
+		const int val = atoi(setting);
+		if (val < 0 || val > 60000)
+			goto invalid;
+		sp->latency_ms = val;
+		return NULL;
+	}
+	
+	if (!strcasecmp(option, "unknown"))
+	{
+		sp->report_unknown = atoi(setting);
+		return NULL;
+	}
+	
+	sprintf(replybuf, "Unknown option: %s", option);
+	return replybuf;
+	
+invalid:
+	sprintf(replybuf, "invalid setting");
+	return replybuf;
+}
+
+static
+struct api_data *sim_api_stats(struct cgpu_info * const proc)
+{
+	struct sim_proc * const sp = proc->thr[0]->cgpu_data;
+	struct api_data *root = NULL;
+	
+	if (!sp)
+		return NULL;
+	
+	double mhashes = sp->hashrate / 1e6;
+	
+	root = api_add_mhs(root, "Simulated MHS", &mhashes, true);
+	root = api_add_int(root, "Queue Depth", &sp->queue_max, false);
+	root = api_add_double(root, "Nonce Rate", &sp->nonce_rate, false);
+	root = api_add_int(root, "Latency", &sp->latency_ms, false);
+	root = api_add_uint64(root, "Unknown Work Nonces", &sp->unknown_nonces, false);
+	
+	return root;
+}
+
+#ifdef HAVE_CURSES
+static
+void sim_wlogprint_status(struct cgpu_info * const proc)
+{
+	struct sim_proc * const sp = proc->thr[0]->cgpu_data;
+	
+	if (!sp)
+		return;
+	wlogprint("Simulated: %.0f Mh/s  Queue: %d/%d  Latency: %d ms\n",
+	          sp->hashrate / 1e6, sp->queue_size, sp->queue_max, sp->latency_ms);
+}
+#endif
+
+struct device_drv sim_drv = {
+	.dname = "sim",
+	.name = "SIM",
+	.drv_detect = sim_detect,
+	
+	.thread_init = sim_init,
+	
+	.minerloop = minerloop_queue,
+	.queue_append = sim_queue_append,
+	.queue_flush = sim_queue_flush,
+	.poll = sim_poll,
+	
+	.get_api_stats = sim_api_stats,
+	.set_device = sim_set_device,
+#ifdef HAVE_CURSES
+	.proc_wlogprint_status = sim_wlogprint_status,
+#endif
+};
@@ -15,6 +15,7 @@
 #include <winsock2.h>
 #endif
 
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
@@ -29,20 +30,54 @@
 #include "deviceapi.h"
 #include "driver-proxy.h"
 #include "miner.h"
+#include "sha2.h"
 #include "util.h"
 
-#define MAX_CLIENTS 255
+// Stratum difficulty matching bfgminer's own diff1 target (pdiff 1)
+#define SSM_DIFF1  0.9999847412109375
+// Shortest period vardiff measures a connection's share rate over
+#define SSM_VARDIFF_MIN_SECS  15
+// How far the share rate may drift from the target before retargeting
+#define SSM_VARDIFF_TOLERANCE  1.5
+// Jobs per connection whose difficulty is remembered for checking shares
+#define SSM_CONN_JOB_DIFFS  8
 
-static bool _ssm_xnonce1s[MAX_CLIENTS + 1] = { true };
+// Bitmap of extranonce1 slots in use; slot 0 marks an unsubscribed connection
+static pthread_mutex_t _ssm_xnonce1s_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t *_ssm_xnonce1s;
+static uint32_t _ssm_xnonce1s_words;
+static uint32_t _ssm_xnonce1s_cursor;
+static unsigned _ssm_xnonce1s_used, _ssm_xnonce1s_peak;
+static bool _ssm_xnonce1s_warned;
 static uint8_t _ssm_client_octets;
 static uint8_t _ssm_client_xnonce2sz;
-static char *_ssm_notify;
-static int _ssm_notify_sz;
+
+// One copy of each mining.notify is shared by every connection's output buffer
+struct stratumsrv_notify {
+	int refs;
+	int sz;
+	uint64_t job_id;
+	
+	// Broadcast latency, from receiving the upstream job to the last downstream socket write
+	bool measure;
+	int pending;
+	struct timeval tv_upstream;
+	
+	char buf[];
+};
+
+// Protects _ssm_notify, _ssm_notify_gen and the latency stats
+static pthread_mutex_t _ssm_notify_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stratumsrv_notify *_ssm_notify;
+static unsigned _ssm_notify_gen;
+static char *_ssm_notify_upstream_job_id;
+static unsigned long _ssm_notify_latency_us, _ssm_notify_latency_max_us;
+static uint64_t _ssm_notify_latency_total_us, _ssm_notify_broadcasts;
 static struct event *ev_notify;
 static notifier_t _ssm_update_notifier;
 
 struct stratumsrv_job {
-	char *my_job_id;
+	uint64_t id;
 	
 	struct pool *pool;
 	uint8_t work_restart_id;
@@ -51,32 +86,151 @@ struct stratumsrv_job {
 	struct stratum_work swork;
 	char *nonce1;
 	
-	UT_hash_handle hh;
+	// Precomputed so checking a share only hashes its coinbase and header
+	struct work work;
+	sha256_ctx coinbase_prefix;
 };
 
-static struct stratumsrv_job *_ssm_jobs;
+// Job ids index a ring of recent jobs; older ones are dropped once it wraps
+#define SSM_JOB_RING_SIZE  0x100  // must be a power of 2
+
+// Jobs are only added and removed by the main server thread, and looked up by the shards
+static pthread_rwlock_t _ssm_jobs_lock;
+static struct stratumsrv_job *_ssm_jobs[SSM_JOB_RING_SIZE];
 static struct work _ssm_cur_job_work;
+static double _ssm_upstream_diff;
 static uint64_t _ssm_jobid;
 
 static struct event_base *_smm_evbase;
 static bool _smm_running;
 static struct evconnlistener *_smm_listener;
 
+struct stratumsrv_shard;
+
 struct stratumsrv_conn {
+	struct stratumsrv_shard *shard;
+	evutil_socket_t sock;
 	struct bufferevent *bev;
 	uint32_t xnonce1_le;
 	struct timeval tv_hashes_done;
 	bool hashes_done_ext;
+	struct proxy_client *client;
+	
+	// Vardiff: shares are checked against the difficulty their job was sent at
+	double diff;
+	struct {
+		uint64_t job_id;
+		double diff;
+	} job_diffs[SSM_CONN_JOB_DIFFS];
+	unsigned job_diffs_next;
+	unsigned vardiff_shares;
+	struct timeval tv_vardiff_start;
 	
 	struct stratumsrv_conn *next;
 };
 
-static struct stratumsrv_conn *_ssm_connections;
+/* The main server thread accepts connections and builds jobs; each connection
+ * is then handed to one of the shards, which runs its own event loop for
+ * reading, share checking and sending jobs. */
+struct stratumsrv_shard {
+	int id;
+	struct event_base *evbase;
+	notifier_t notifier;
+	
+	pthread_mutex_t lock;
+	struct stratumsrv_conn *new_conns;  // accepted, but not yet taken by the shard
+	
+	struct stratumsrv_conn *connections;
+	unsigned notify_gen;
+};
+
+static struct stratumsrv_shard *_ssm_shards;
+static int _ssm_shard_count;
+static unsigned _ssm_next_shard;
 
 static
-void _ssm_gen_dummy_work(struct work *work, struct stratumsrv_job *ssj, const char * const extranonce2, uint32_t xnonce1)
+void stratumsrv_xnonce1s_init(void)
 {
-	uint8_t *p, *s;
+	const uint32_t slots = (uint32_t)opt_stratumsrv_clients + 1;
+	uint32_t i;
+	
+	_ssm_xnonce1s_words = (slots + 31) / 32;
+	_ssm_xnonce1s = calloc(_ssm_xnonce1s_words, sizeof(*_ssm_xnonce1s));
+	if (unlikely(!_ssm_xnonce1s))
+		quit(1, "Failed to allocate stratum client slots");
+	
+	// Reserve slot 0 and the padding past the last slot, so they are never handed out
+	_ssm_xnonce1s[0] = 1;
+	for (i = slots; i < _ssm_xnonce1s_words * 32; ++i)
+		_ssm_xnonce1s[i / 32] |= (uint32_t)1 << (i % 32);
+}
+
+// Returns a free extranonce1 slot, or 0 if all are in use
+static
+uint32_t stratumsrv_xnonce1_alloc(void)
+{
+	uint32_t i, w, bit, slot = 0;
+	
+	mutex_lock(&_ssm_xnonce1s_lock);
+	// Slots are freed behind the cursor, so everything before it is full
+	for (i = _ssm_xnonce1s_cursor; i < _ssm_xnonce1s_words; ++i)
+	{
+		w = _ssm_xnonce1s[i];
+		if (w == UINT32_MAX)
+			continue;
+		bit = __builtin_ctz(~w);
+		_ssm_xnonce1s[i] = w | ((uint32_t)1 << bit);
+		_ssm_xnonce1s_cursor = i;
+		slot = i * 32 + bit;
+		
+		if (++_ssm_xnonce1s_used > _ssm_xnonce1s_peak)
+			_ssm_xnonce1s_peak = _ssm_xnonce1s_used;
+		if (!_ssm_xnonce1s_warned && _ssm_xnonce1s_used * 10 >= (unsigned)opt_stratumsrv_clients * 9)
+		{
+			applog(LOG_WARNING, "SSM: %u of %d client slots in use", _ssm_xnonce1s_used, opt_stratumsrv_clients);
+			_ssm_xnonce1s_warned = true;
+		}
+		goto out;
+	}
+	_ssm_xnonce1s_cursor = _ssm_xnonce1s_words;
+out:
+	mutex_unlock(&_ssm_xnonce1s_lock);
+	return slot;
+}
+
+static
+void stratumsrv_xnonce1_free(const uint32_t slot)
+{
+	const uint32_t i = slot / 32;
+	
+	mutex_lock(&_ssm_xnonce1s_lock);
+	_ssm_xnonce1s[i] &= ~((uint32_t)1 << (slot % 32));
+	if (i < _ssm_xnonce1s_cursor)
+		_ssm_xnonce1s_cursor = i;
+	--_ssm_xnonce1s_used;
+	if (_ssm_xnonce1s_warned && _ssm_xnonce1s_used * 10 < (unsigned)opt_stratumsrv_clients * 8)
+		_ssm_xnonce1s_warned = false;
+	mutex_unlock(&_ssm_xnonce1s_lock);
+}
+
+// Read by the API without locking; the values are only informative
+bool stratumsrv_get_client_stats(unsigned * const out_used, unsigned * const out_peak, unsigned * const out_capacity)
+{
+	if (!_ssm_xnonce1s)
+		return false;
+	*out_used = _ssm_xnonce1s_used;
+	*out_peak = _ssm_xnonce1s_peak;
+	*out_capacity = opt_stratumsrv_clients;
+	return true;
+}
+
+// Generates the job's template work, with the client's part of nonce2 zeroed
+static
+void _ssm_gen_job_work(struct stratumsrv_job * const ssj)
+{
+	struct work * const work = &ssj->work;
+	const size_t client_n2size = _ssm_client_octets + _ssm_client_xnonce2sz;
+	uint8_t *s;
 	
 	*work = (struct work){
 		.pool = ssj->pool,
@@ -85,42 +239,289 @@ void _ssm_gen_dummy_work(struct work *work, struct stratumsrv_job *ssj, const ch
 	};
 	bytes_resize(&work->nonce2, ssj->n2size);
 	s = bytes_buf(&work->nonce2);
+	memset(s, '\xbb', ssj->n2size - client_n2size);
+	memset(&s[ssj->n2size - client_n2size], '\0', client_n2size);
+	gen_stratum_work2(work, &ssj->swork, ssj->nonce1);
+	
+	// The coinbase up to nonce2 is the same for every share
+	sha256_init(&ssj->coinbase_prefix);
+	sha256_update(&ssj->coinbase_prefix, bytes_buf(&ssj->swork.coinbase), ssj->swork.nonce2_offset);
+}
+
+// Fills in a work for checking a client's share, from the job's template work
+static
+void _ssm_gen_dummy_work(struct work * const work, const struct stratumsrv_job * const ssj, const char * const extranonce2, const uint32_t xnonce1)
+{
+	const struct stratum_work * const swork = &ssj->swork;
+	const uint8_t * const coinbase = bytes_buf(&swork->coinbase);
+	const size_t n2end = swork->nonce2_offset + ssj->n2size;
+	sha256_ctx ctx = ssj->coinbase_prefix;
+	unsigned char hash1[32], merkle_sha[64], merkle_root[32];
+	const uint8_t *merkle_bin;
+	uint8_t *p, *s;
+	int i;
+	
+	memset(work, 0, sizeof(*work));
+	__copy_work(work, &ssj->work);
+	s = bytes_buf(&work->nonce2);
 	p = &s[ssj->n2size - _ssm_client_xnonce2sz];
-	if (extranonce2)
-		hex2bin(p, extranonce2, _ssm_client_xnonce2sz);
-#ifndef __OPTIMIZE__
-	else
-		memset(p, '\0', _ssm_client_xnonce2sz);
-#endif
+	hex2bin(p, extranonce2, _ssm_client_xnonce2sz);
 	p -= _ssm_client_octets;
 	memcpy(p, &xnonce1, _ssm_client_octets);
-	if (p != s)
-		memset(s, '\xbb', p - s);
-	gen_stratum_work2(work, &ssj->swork, ssj->nonce1);
+	
+	sha256_update(&ctx, s, ssj->n2size);
+	sha256_update(&ctx, &coinbase[n2end], bytes_len(&swork->coinbase) - n2end);
+	sha256_final(&ctx, hash1);
+	sha256(hash1, 32, merkle_sha);
+	merkle_bin = bytes_buf(&swork->merkle_bin);
+	for (i = 0; i < swork->merkles; ++i, merkle_bin += 32)
+	{
+		memcpy(&merkle_sha[32], merkle_bin, 32);
+		gen_hash(merkle_sha, merkle_root, 64);
+		memcpy(merkle_sha, merkle_root, 32);
+	}
+	flip32(merkle_root, merkle_sha);
+	memcpy(&work->data[36], merkle_root, 32);
+	calc_midstate(work);
+}
+
+static
+void stratumsrv_notify_release(struct stratumsrv_notify * const notify)
+{
+	if (!__sync_sub_and_fetch(&notify->refs, 1))
+		free(notify);
+}
+
+static
+void stratumsrv_notify_cleanup(__maybe_unused const void * const data, __maybe_unused const size_t datalen, void * const p)
+{
+	stratumsrv_notify_release(p);
+}
+
+// The main thread and each shard hold one pending count until they are done queuing
+static
+void stratumsrv_notify_pending_done(struct stratumsrv_notify * const notify)
+{
+	unsigned long us;
+	
+	if (__sync_sub_and_fetch(&notify->pending, 1))
+		return;
+	
+	us = timer_elapsed_us(&notify->tv_upstream, NULL);
+	mutex_lock(&_ssm_notify_lock);
+	_ssm_notify_latency_us = us;
+	if (us > _ssm_notify_latency_max_us)
+		_ssm_notify_latency_max_us = us;
+	_ssm_notify_latency_total_us += us;
+	++_ssm_notify_broadcasts;
+	mutex_unlock(&_ssm_notify_lock);
+	applog(LOG_DEBUG, "SSM: Job reached all miners %lu ms after upstream notify", us / 1000);
+}
+
+static
+void stratumsrv_notify_broadcast_cleanup(const void * const data, const size_t datalen, void * const p)
+{
+	stratumsrv_notify_pending_done(p);
+	stratumsrv_notify_cleanup(data, datalen, p);
+}
+
+// Returns a reference to the current notify, or NULL if there is none
+static
+struct stratumsrv_notify *stratumsrv_notify_get(unsigned * const out_gen)
+{
+	struct stratumsrv_notify *notify;
+	
+	mutex_lock(&_ssm_notify_lock);
+	notify = _ssm_notify;
+	if (notify)
+		__sync_add_and_fetch(&notify->refs, 1);
+	if (out_gen)
+		*out_gen = _ssm_notify_gen;
+	mutex_unlock(&_ssm_notify_lock);
+	
+	return notify;
+}
+
+// Replaces the current notify, taking the caller's reference, and has every shard send it on
+static
+void stratumsrv_notify_set(struct stratumsrv_notify * const notify)
+{
+	struct stratumsrv_notify *old;
+	int i;
+	
+	mutex_lock(&_ssm_notify_lock);
+	old = _ssm_notify;
+	_ssm_notify = notify;
+	++_ssm_notify_gen;
+	mutex_unlock(&_ssm_notify_lock);
+	
+	if (old)
+		stratumsrv_notify_release(old);
+	for (i = 0; i < _ssm_shard_count; ++i)
+		notifier_wake(_ssm_shards[i].notifier);
+}
+
+// Queues a notify on a connection without copying it
+static
+void stratumsrv_send_notify2(struct bufferevent * const bev, struct stratumsrv_notify * const notify, evbuffer_ref_cleanup_cb cleanupfn)
+{
+	__sync_add_and_fetch(&notify->refs, 1);
+	if (unlikely(evbuffer_add_reference(bufferevent_get_output(bev), notify->buf, notify->sz, cleanupfn, notify)))
+	{
+		cleanupfn(notify->buf, notify->sz, notify);
+		bufferevent_write(bev, notify->buf, notify->sz);
+	}
+}
+#define stratumsrv_send_notify(bev, notify)  stratumsrv_send_notify2(bev, notify, stratumsrv_notify_cleanup)
+
+bool stratumsrv_get_notify_stats(unsigned long * const out_last_us, unsigned long * const out_max_us, double * const out_avg_us)
+{
+	bool rv = false;
+	
+	mutex_lock(&_ssm_notify_lock);
+	if (_ssm_notify_broadcasts)
+	{
+		*out_last_us = _ssm_notify_latency_us;
+		*out_max_us = _ssm_notify_latency_max_us;
+		*out_avg_us = (double)_ssm_notify_latency_total_us / _ssm_notify_broadcasts;
+		rv = true;
+	}
+	mutex_unlock(&_ssm_notify_lock);
+	return rv;
+}
+
+static
+void stratumsrv_set_difficulty(struct stratumsrv_conn * const conn, const double diff)
+{
+	char buf[0x80];
+	int bufsz;
+	
+	bufsz = snprintf(buf, sizeof(buf), "{\"params\":[%.16g],\"id\":null,\"method\":\"mining.set_difficulty\"}\n", diff);
+	bufferevent_write(conn->bev, buf, bufsz);
+	conn->diff = diff;
+	if (conn->client)
+		conn->client->diff = diff;
+}
+
+// Records the difficulty a job is sent to the connection at (again, if it is resent)
+static
+void stratumsrv_job_sent(struct stratumsrv_conn * const conn, const struct stratumsrv_notify * const notify)
+{
+	const unsigned last = (conn->job_diffs_next + SSM_CONN_JOB_DIFFS - 1) % SSM_CONN_JOB_DIFFS;
+	unsigned i = conn->job_diffs_next;
+	
+	if (conn->job_diffs[last].job_id == notify->job_id)
+		i = last;
+	else
+		conn->job_diffs_next = (i + 1) % SSM_CONN_JOB_DIFFS;
+	conn->job_diffs[i].job_id = notify->job_id;
+	conn->job_diffs[i].diff = conn->diff;
+}
+
+// The difficulty job_id was last sent to the connection at; the current one for jobs too old to remember
+static
+double stratumsrv_job_diff(const struct stratumsrv_conn * const conn, const uint64_t job_id)
+{
+	for (int i = 0; i < SSM_CONN_JOB_DIFFS; ++i)
+		if (conn->job_diffs[i].job_id == job_id && conn->job_diffs[i].diff)
+			return conn->job_diffs[i].diff;
+	return conn->diff;
+}
+
+// Picks the difficulty that would give the target share rate, or 0 if the current one is close enough
+static
+double stratumsrv_vardiff_retarget(struct stratumsrv_conn * const conn, const double elapsed)
+{
+	const double target = opt_stratumsrv_vardiff;
+	const double spm = conn->vardiff_shares * 60. / elapsed;
+	double newdiff, maxdiff;
+	
+	if (spm * SSM_VARDIFF_TOLERANCE >= target && spm <= target * SSM_VARDIFF_TOLERANCE)
+		return 0;
+	
+	if (conn->vardiff_shares)
+		newdiff = conn->diff * spm / target;
+	else
+		newdiff = conn->diff / 4;
+	
+	// Powers of two keep the difficulty from bouncing between near values
+	if (newdiff < 1)
+		newdiff = SSM_DIFF1;
+	else
+		newdiff = pow(2, floor(log2(newdiff)));
+	
+	// Shares above the upstream difficulty are wasted on the pool
+	maxdiff = _ssm_upstream_diff;
+	if (maxdiff >= 1 && newdiff > maxdiff)
+		newdiff = pow(2, floor(log2(maxdiff)));
+	
+	if (newdiff == conn->diff)
+		return 0;
+	return newdiff;
+}
+
+static
+void stratumsrv_vardiff_reset(struct stratumsrv_conn * const conn, const struct timeval * const tv_now)
+{
+	conn->vardiff_shares = 0;
+	conn->tv_vardiff_start = *tv_now;
 }
 
+// Called before sending a new job, so any new difficulty applies from that job on
+static
+void stratumsrv_vardiff_job(struct stratumsrv_conn * const conn, const struct timeval * const tv_now)
+{
+	double elapsed, newdiff;
+	
+	if (!opt_stratumsrv_vardiff)
+		return;
+	
+	elapsed = timer_elapsed_us(&conn->tv_vardiff_start, tv_now) / 1e6;
+	if (elapsed < SSM_VARDIFF_MIN_SECS)
+		return;
+	
+	newdiff = stratumsrv_vardiff_retarget(conn, elapsed);
+	if (newdiff)
+	{
+		applog(LOG_DEBUG, "SSM: Retargeting connection %08lx from difficulty %g to %g (%u shares in %.1f seconds)",
+		       (unsigned long)le32toh(conn->xnonce1_le), conn->diff, newdiff, conn->vardiff_shares, elapsed);
+		stratumsrv_set_difficulty(conn, newdiff);
+	}
+	stratumsrv_vardiff_reset(conn, tv_now);
+}
+
+static void _ssj_free(struct stratumsrv_job *);
+
 static
 bool stratumsrv_update_notify_str(struct pool * const pool, bool clean)
 {
 	cg_rlock(&pool->data_lock);
 	
-	struct stratumsrv_conn *conn;
 	const struct stratum_work * const swork = &pool->swork;
 	const int n2size = pool->n2size;
-	char my_job_id[33];
+	char my_job_id[17];
 	int i;
 	struct stratumsrv_job *ssj;
 	ssize_t n2pad = n2size - _ssm_client_octets - _ssm_client_xnonce2sz;
 	if (n2pad < 0)
+	{
+		cg_runlock(&pool->data_lock);
+		applog(LOG_WARNING, "SSM: Pool %d extranonce2 size %d is too small for %d-byte client extranonce1 plus %d-byte extranonce2 (see --stratum-clients and --stratum-xnonce2-size)",
+		       pool->pool_no, n2size, (int)_ssm_client_octets, (int)_ssm_client_xnonce2sz);
 		return false;
+	}
 	size_t coinb1in_lenx = swork->nonce2_offset * 2;
 	size_t n2padx = n2pad * 2;
 	size_t coinb1_lenx = coinb1in_lenx + n2padx;
 	size_t coinb2_len = bytes_len(&swork->coinbase) - swork->nonce2_offset - n2size;
 	size_t coinb2_lenx = coinb2_len * 2;
-	sprintf(my_job_id, "%"PRIx64"-%"PRIx64, (uint64_t)time(NULL), _ssm_jobid++);
+	const uint64_t job_id = ++_ssm_jobid;
+	sprintf(my_job_id, "%"PRIx64, job_id);
 	size_t bufsz = 166 + strlen(my_job_id) + coinb1_lenx + coinb2_lenx + (swork->merkles * 67);
-	char * const buf = malloc(bufsz);
+	struct stratumsrv_notify * const notify = malloc(sizeof(*notify) + bufsz);
+	if (unlikely(!notify))
+		quit(1, "Failed to allocate stratum notify");
+	char * const buf = notify->buf;
 	char *p = buf;
 	char prevhash[65], coinb1[coinb1_lenx + 1], coinb2[coinb2_lenx], version[9], nbits[9], ntime[9];
 	uint32_t ntime_n;
@@ -147,7 +548,7 @@ bool stratumsrv_update_notify_str(struct pool * const pool, bool clean)
 	
 	ssj = malloc(sizeof(*ssj));
 	*ssj = (struct stratumsrv_job){
-		.my_job_id = strdup(my_job_id),
+		.id = job_id,
 		
 		.pool = pool,
 		.work_restart_id = pool->work_restart_id,
@@ -160,51 +561,104 @@ bool stratumsrv_update_notify_str(struct pool * const pool, bool clean)
 	cg_runlock(&pool->data_lock);
 	
 	ssj->swork.data_lock_p = NULL;
-	HASH_ADD_KEYPTR(hh, _ssm_jobs, ssj->my_job_id, strlen(ssj->my_job_id), ssj);
+	_ssm_gen_job_work(ssj);
+	
+	struct stratumsrv_job ** const slot = &_ssm_jobs[job_id & (SSM_JOB_RING_SIZE - 1)];
+	struct stratumsrv_job * const old_ssj = *slot;
+	wr_lock(&_ssm_jobs_lock);
+	*slot = ssj;
+	wr_unlock(&_ssm_jobs_lock);
+	if (old_ssj)
+		_ssj_free(old_ssj);
 	
-	if (likely(_ssm_cur_job_work.pool))
-		clean_work(&_ssm_cur_job_work);
-	_ssm_gen_dummy_work(&_ssm_cur_job_work, ssj, NULL, 0);
+	__copy_work(&_ssm_cur_job_work, &ssj->work);
+	_ssm_upstream_diff = _ssm_cur_job_work.sdiff;
 	
-	_ssm_notify_sz = p - buf;
-	assert(_ssm_notify_sz <= bufsz);
-	free(_ssm_notify);
-	_ssm_notify = buf;
+	notify->sz = p - buf;
+	assert(notify->sz <= bufsz);
+	notify->refs = 1;
+	notify->job_id = job_id;
 	
-	LL_FOREACH(_ssm_connections, conn)
+	// Only the first broadcast of each upstream job is measured, not ntime updates
+	notify->measure = !(_ssm_notify_upstream_job_id && ssj->swork.job_id && !strcmp(_ssm_notify_upstream_job_id, ssj->swork.job_id));
+	if (notify->measure)
 	{
-		if (unlikely(!conn->xnonce1_le))
-			continue;
-		bufferevent_write(conn->bev, _ssm_notify, _ssm_notify_sz);
+		free(_ssm_notify_upstream_job_id);
+		_ssm_notify_upstream_job_id = maybe_strdup(ssj->swork.job_id);
+		notify->tv_upstream = ssj->swork.tv_received;
+		notify->pending = _ssm_shard_count + 1;
 	}
 	
+	stratumsrv_notify_set(notify);
+	// notify is still referenced as _ssm_notify, which only this thread replaces
+	if (notify->measure)
+		stratumsrv_notify_pending_done(notify);
+	
 	return true;
 }
 
+// Called in the shard, for each new notify
+static
+void stratumsrv_broadcast_notify(struct stratumsrv_shard * const shard, struct stratumsrv_notify * const notify)
+{
+	struct stratumsrv_conn *conn;
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	LL_FOREACH(shard->connections, conn)
+	{
+		if (unlikely(!conn->xnonce1_le))
+			continue;
+		stratumsrv_vardiff_job(conn, &tv_now);
+		stratumsrv_job_sent(conn, notify);
+		if (notify->measure)
+		{
+			__sync_add_and_fetch(&notify->pending, 1);
+			stratumsrv_send_notify2(conn->bev, notify, stratumsrv_notify_broadcast_cleanup);
+		}
+		else
+			stratumsrv_send_notify(conn->bev, notify);
+	}
+	if (notify->measure)
+		stratumsrv_notify_pending_done(notify);
+}
+
 static
 void _ssj_free(struct stratumsrv_job * const ssj)
 {
-	free(ssj->my_job_id);
+	clean_work(&ssj->work);
 	stratum_work_clean(&ssj->swork);
 	free(ssj->nonce1);
 	free(ssj);
 }
 
+// Removes jobs older than --expiry, or all of them
 static
-void stratumsrv_job_pruner()
+void stratumsrv_job_pruner(const bool all)
 {
-	struct stratumsrv_job *ssj, *tmp_ssj;
+	struct stratumsrv_job *pruned[SSM_JOB_RING_SIZE], *ssj;
 	struct timeval tv_now;
+	int i, n = 0;
 	
 	timer_set_now(&tv_now);
 	
-	HASH_ITER(hh, _ssm_jobs, ssj, tmp_ssj)
+	wr_lock(&_ssm_jobs_lock);
+	for (i = 0; i < SSM_JOB_RING_SIZE; ++i)
 	{
-		if (timer_elapsed(&ssj->tv_prepared, &tv_now) <= opt_expiry)
-			break;
-		HASH_DEL(_ssm_jobs, ssj);
-		applog(LOG_DEBUG, "SSM: Pruning job_id %s", ssj->my_job_id);
-		_ssj_free(ssj);
+		ssj = _ssm_jobs[i];
+		if (!ssj)
+			continue;
+		if (!all && timer_elapsed(&ssj->tv_prepared, &tv_now) <= opt_expiry)
+			continue;
+		_ssm_jobs[i] = NULL;
+		pruned[n++] = ssj;
+	}
+	wr_unlock(&_ssm_jobs_lock);
+	
+	for (i = 0; i < n; ++i)
+	{
+		applog(LOG_DEBUG, "SSM: Pruning job_id %"PRIx64, pruned[i]->id);
+		_ssj_free(pruned[i]);
 	}
 }
 
@@ -232,16 +686,14 @@ void stratumsrv_boot(struct stratumsrv_conn * const conn, const char * const msg
 	bufferevent_setcb(bev, NULL, stratumsrv_conn_close_completion_cb, stratumsrv_event, conn);
 }
 
+// Called in the shard, when the notify is cleared
 static
-void stratumsrv_boot_all_subscribed(const char * const msg)
+void stratumsrv_boot_all_subscribed(struct stratumsrv_shard * const shard, const char * const msg)
 {
 	struct stratumsrv_conn *conn, *tmp_conn;
 	
-	free(_ssm_notify);
-	_ssm_notify = NULL;
-	
 	// Boot all connections
-	LL_FOREACH_SAFE(_ssm_connections, conn, tmp_conn)
+	LL_FOREACH_SAFE(shard->connections, conn, tmp_conn)
 	{
 		if (!conn->xnonce1_le)
 			continue;
@@ -264,24 +716,15 @@ void _stratumsrv_update_notify(evutil_socket_t fd, short what, __maybe_unused vo
 	
 	clean = _ssm_cur_job_work.pool ? stale_work(&_ssm_cur_job_work, true) : true;
 	if (clean)
-	{
-		struct stratumsrv_job *ssj, *tmp;
-		
 		applog(LOG_DEBUG, "SSM: Current replacing job stale, pruning all jobs");
-		HASH_ITER(hh, _ssm_jobs, ssj, tmp)
-		{
-			HASH_DEL(_ssm_jobs, ssj);
-			_ssj_free(ssj);
-		}
-	}
-	else
-		stratumsrv_job_pruner();
+	stratumsrv_job_pruner(clean);
 	
 	if (!pool->stratum_notify)
 	{
 		applog(LOG_WARNING, "SSM: Not using a stratum server upstream!");
 		if (clean)
-			stratumsrv_boot_all_subscribed("Current upstream pool does not have active stratum");
+			// Shards boot their miners when they see the notify cleared
+			stratumsrv_notify_set(NULL);
 		goto out;
 	}
 	
@@ -289,7 +732,7 @@ void _stratumsrv_update_notify(evutil_socket_t fd, short what, __maybe_unused vo
 	{
 		applog(LOG_WARNING, "SSM: Failed to subdivide upstream stratum notify!");
 		if (clean)
-			stratumsrv_boot_all_subscribed("Current upstream pool does not have active stratum");
+			stratumsrv_notify_set(NULL);
 	}
 	
 out: ;
@@ -352,44 +795,54 @@ void _stratumsrv_success(struct bufferevent * const bev, const char * const idst
 }
 
 static
-void stratumsrv_mining_subscribe(struct bufferevent *bev, json_t *params, const char *idstr, uint32_t *xnonce1_p)
+void stratumsrv_mining_subscribe(struct bufferevent *bev, json_t *params, const char *idstr, struct stratumsrv_conn * const conn)
 {
+	uint32_t * const xnonce1_p = &conn->xnonce1_le;
 	char buf[90 + strlen(idstr) + (_ssm_client_octets * 2 * 2) + 0x10];
 	char xnonce1x[(_ssm_client_octets * 2) + 1];
+	struct stratumsrv_notify *notify;
 	int bufsz;
 	
-	if (!_ssm_notify)
+	notify = stratumsrv_notify_get(NULL);
+	if (!notify)
 	{
-		evtimer_del(ev_notify);
-		_stratumsrv_update_notify(-1, 0, NULL);
-		if (!_ssm_notify)
-			return_stratumsrv_failure(20, "No notify set (upstream not stratum?)");
+		// Have the server thread try again, for the next miner
+		notifier_wake(_ssm_update_notifier);
+		return_stratumsrv_failure(20, "No notify set (upstream not stratum?)");
 	}
 	
 	if (!*xnonce1_p)
 	{
-		uint32_t xnonce1;
-		for (xnonce1 = MAX_CLIENTS; _ssm_xnonce1s[xnonce1]; --xnonce1)
-			if (!xnonce1)
-				return_stratumsrv_failure(20, "Maximum clients already connected");
+		const uint32_t xnonce1 = stratumsrv_xnonce1_alloc();
+		if (!xnonce1)
+		{
+			stratumsrv_notify_release(notify);
+			return_stratumsrv_failure(20, "Maximum clients already connected");
+		}
 		*xnonce1_p = htole32(xnonce1);
 	}
 	
 	bin2hex(xnonce1x, xnonce1_p, _ssm_client_octets);
 	bufsz = sprintf(buf, "{\"id\":%s,\"result\":[[[\"mining.set_difficulty\",\"x\"],[\"mining.notify\",\"%s\"]],\"%s\",%d],\"error\":null}\n", idstr, xnonce1x, xnonce1x, _ssm_client_xnonce2sz);
 	bufferevent_write(bev, buf, bufsz);
-	bufferevent_write(bev, "{\"params\":[0.9999847412109375],\"id\":null,\"method\":\"mining.set_difficulty\"}\n", 75);
-	bufferevent_write(bev, _ssm_notify, _ssm_notify_sz);
+	stratumsrv_set_difficulty(conn, conn->diff);
+	timer_set_now(&conn->tv_vardiff_start);
+	conn->vardiff_shares = 0;
+	stratumsrv_job_sent(conn, notify);
+	stratumsrv_send_notify(bev, notify);
+	stratumsrv_notify_release(notify);
 }
 
 static
-void stratumsrv_mining_authorize(struct bufferevent *bev, json_t *params, const char *idstr, uint32_t *xnonce1_p)
+void stratumsrv_mining_authorize(struct bufferevent *bev, json_t *params, const char *idstr, struct stratumsrv_conn * const conn)
 {
 	struct proxy_client * const client = stratumsrv_find_or_create_client(__json_array_string(params, 0));
 	
 	if (unlikely(!client))
 		return_stratumsrv_failure(20, "Failed creating new cgpu");
 	
+	conn->client = client;
+	client->diff = conn->diff;
 	_stratumsrv_success(bev, idstr);
 }
 
@@ -399,6 +852,8 @@ void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const cha
 	uint32_t * const xnonce1_p = &conn->xnonce1_le;
 	struct work _work, *work;
 	struct stratumsrv_job *ssj;
+	uint64_t job_id_n;
+	char *endptr;
 	struct proxy_client *client = stratumsrv_find_or_create_client(__json_array_string(params, 0));
 	struct cgpu_info *cgpu;
 	struct thr_info *thr;
@@ -407,6 +862,8 @@ void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const cha
 	const char * const ntime = __json_array_string(params, 3);
 	const char * const nonce = __json_array_string(params, 4);
 	uint32_t nonce_n;
+	double min_diff, nonce_diff;
+	bool valid = false;
 	
 	if (unlikely(!client))
 		return_stratumsrv_failure(20, "Failed creating new cgpu");
@@ -422,36 +879,103 @@ void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const cha
 	cgpu = client->cgpu;
 	thr = cgpu->thr[0];
 	
-	// Lookup job_id
-	HASH_FIND_STR(_ssm_jobs, job_id, ssj);
-	if (!ssj)
+	// Lookup job_id and generate dummy work
+	job_id_n = strtoull(job_id, &endptr, 0x10);
+	if (unlikely(endptr == job_id || *endptr))
 		return_stratumsrv_failure(21, "Job not found");
-	
-	// Generate dummy work
 	work = &_work;
-	_ssm_gen_dummy_work(work, ssj, extranonce2, *xnonce1_p);
+	rd_lock(&_ssm_jobs_lock);
+	ssj = _ssm_jobs[job_id_n & (SSM_JOB_RING_SIZE - 1)];
+	if (ssj && ssj->id == job_id_n)
+		_ssm_gen_dummy_work(work, ssj, extranonce2, *xnonce1_p);
+	else
+		ssj = NULL;
+	rd_unlock(&_ssm_jobs_lock);
+	if (!ssj)
+		return_stratumsrv_failure(21, "Job not found");
 	
 	// Submit nonce
 	hex2bin(&work->data[68], ntime, 4);
 	hex2bin((void*)&nonce_n, nonce, 4);
 	nonce_n = le32toh(nonce_n);
-	if (!submit_nonce(thr, work, nonce_n))
-		_stratumsrv_failure(bev, idstr, 23, "H-not-zero");
-	else
-	if (stale_work(work, true))
-		_stratumsrv_failure(bev, idstr, 21, "stale");
+	if (!opt_stratumsrv_vardiff)
+	{
+		min_diff = 1;
+		mutex_lock(&client->thr_lock);
+		const bool found = submit_nonce(thr, work, nonce_n);
+		mutex_unlock(&client->thr_lock);
+		if (!found)
+			_stratumsrv_failure(bev, idstr, 23, "H-not-zero");
+		else
+		{
+			valid = true;
+			if (stale_work(work, true))
+				_stratumsrv_failure(bev, idstr, 21, "stale");
+			else
+				_stratumsrv_success(bev, idstr);
+		}
+	}
 	else
-		_stratumsrv_success(bev, idstr);
+	{
+		min_diff = stratumsrv_job_diff(conn, job_id_n);
+		mutex_lock(&client->thr_lock);
+		nonce_diff = submit_nonce_min_diff(thr, work, nonce_n, min_diff);
+		mutex_unlock(&client->thr_lock);
+		if (!nonce_diff)
+			_stratumsrv_failure(bev, idstr, 23, "H-not-zero");
+		else
+		if (nonce_diff < min_diff)
+			_stratumsrv_failure(bev, idstr, 23, "Low difficulty share");
+		else
+		{
+			valid = true;
+			if (stale_work(work, true))
+				_stratumsrv_failure(bev, idstr, 21, "stale");
+			else
+				_stratumsrv_success(bev, idstr);
+			++conn->vardiff_shares;
+		}
+	}
 	
 	clean_work(work);
 	
-	if (!conn->hashes_done_ext)
+	struct timeval tv_now;
+	timer_set_now(&tv_now);
+	
+	// Only a share meeting the difficulty shows that much hashing was done
+	if (valid && !conn->hashes_done_ext)
 	{
-		struct timeval tv_now, tv_delta;
-		timer_set_now(&tv_now);
+		struct timeval tv_delta;
 		timersub(&tv_now, &conn->tv_hashes_done, &tv_delta);
 		conn->tv_hashes_done = tv_now;
-		hashes_done(thr, 0x100000000, &tv_delta, NULL);
+		mutex_lock(&client->thr_lock);
+		hashes_done(thr, 0x100000000 * min_diff, &tv_delta, NULL);
+		mutex_unlock(&client->thr_lock);
+	}
+	
+	// Don't wait for the next job if a miner is flooding us with shares
+	if (opt_stratumsrv_vardiff && conn->vardiff_shares > (unsigned)opt_stratumsrv_vardiff)
+	{
+		const double elapsed = timer_elapsed_us(&conn->tv_vardiff_start, &tv_now) / 1e6;
+		if (elapsed >= SSM_VARDIFF_MIN_SECS && conn->vardiff_shares * 60. / elapsed > opt_stratumsrv_vardiff * 4)
+		{
+			const double newdiff = stratumsrv_vardiff_retarget(conn, elapsed);
+			if (newdiff)
+			{
+				applog(LOG_DEBUG, "SSM: Retargeting connection %08lx early from difficulty %g to %g (%u shares in %.1f seconds)",
+				       (unsigned long)le32toh(conn->xnonce1_le), conn->diff, newdiff, conn->vardiff_shares, elapsed);
+				stratumsrv_set_difficulty(conn, newdiff);
+				// Resend the job, so the miner starts over at the new difficulty
+				struct stratumsrv_notify * const notify = stratumsrv_notify_get(NULL);
+				if (notify)
+				{
+					stratumsrv_job_sent(conn, notify);
+					stratumsrv_send_notify(bev, notify);
+					stratumsrv_notify_release(notify);
+				}
+			}
+			stratumsrv_vardiff_reset(conn, &tv_now);
+		}
 	}
 }
 
@@ -477,7 +1001,9 @@ void stratumsrv_mining_hashes_done(struct bufferevent * const bev, json_t * cons
 	tv_delta.tv_usec = (f - tv_delta.tv_sec) * 1e6;
 	
 	f = json_number_value(jhashcount);
+	mutex_lock(&client->thr_lock);
 	hashes_done(thr, f, &tv_delta, NULL);
+	mutex_unlock(&client->thr_lock);
 	
 	conn->hashes_done_ext = true;
 }
@@ -524,10 +1050,10 @@ bool stratumsrv_process_line(struct bufferevent * const bev, const char * const
 		stratumsrv_mining_hashes_done(bev, params, idstr, conn);
 	else
 	if (!strcasecmp(method, "mining.authorize"))
-		stratumsrv_mining_authorize(bev, params, idstr, &conn->xnonce1_le);
+		stratumsrv_mining_authorize(bev, params, idstr, conn);
 	else
 	if (!strcasecmp(method, "mining.subscribe"))
-		stratumsrv_mining_subscribe(bev, params, idstr, &conn->xnonce1_le);
+		stratumsrv_mining_subscribe(bev, params, idstr, conn);
 	else
 		_stratumsrv_failure(bev, idstr, -3, "Method not supported");
 	
@@ -540,8 +1066,10 @@ void stratumsrv_client_close(struct stratumsrv_conn * const conn)
 {
 	struct bufferevent * const bev = conn->bev;
 	
+	if (conn->xnonce1_le)
+		stratumsrv_xnonce1_free(le32toh(conn->xnonce1_le));
 	bufferevent_free(bev);
-	LL_DELETE(_ssm_connections, conn);
+	LL_DELETE(conn->shard->connections, conn);
 	free(conn);
 }
 
@@ -577,19 +1105,67 @@ void stratumsrv_event(struct bufferevent *bev, short events, void *p)
 	}
 }
 
+// Called in the shard, to take over a connection accepted by the main server thread
+static
+void stratumsrv_conn_start(struct stratumsrv_shard * const shard, struct stratumsrv_conn * const conn)
+{
+	struct bufferevent * const bev = bufferevent_socket_new(shard->evbase, conn->sock, BEV_OPT_CLOSE_ON_FREE);
+	
+	conn->bev = bev;
+	LL_PREPEND(shard->connections, conn);
+	bufferevent_setcb(bev, stratumsrv_read, NULL, stratumsrv_event, conn);
+	bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+static
+void stratumsrv_shard_wake(__maybe_unused evutil_socket_t fd, __maybe_unused short what, void * const p)
+{
+	struct stratumsrv_shard * const shard = p;
+	struct stratumsrv_conn *conn, *tmp_conn, *new_conns;
+	struct stratumsrv_notify *notify;
+	unsigned gen;
+	
+	notifier_read(shard->notifier);
+	
+	mutex_lock(&shard->lock);
+	new_conns = shard->new_conns;
+	shard->new_conns = NULL;
+	mutex_unlock(&shard->lock);
+	LL_FOREACH_SAFE(new_conns, conn, tmp_conn)
+	{
+		LL_DELETE(new_conns, conn);
+		stratumsrv_conn_start(shard, conn);
+	}
+	
+	notify = stratumsrv_notify_get(&gen);
+	if (gen != shard->notify_gen)
+	{
+		shard->notify_gen = gen;
+		if (notify)
+			stratumsrv_broadcast_notify(shard, notify);
+		else
+			stratumsrv_boot_all_subscribed(shard, "Current upstream pool does not have active stratum");
+	}
+	if (notify)
+		stratumsrv_notify_release(notify);
+}
+
 static
 void stratumlistener(struct evconnlistener *listener, evutil_socket_t sock, struct sockaddr *addr, int len, void *p)
 {
+	struct stratumsrv_shard * const shard = &_ssm_shards[_ssm_next_shard++ % _ssm_shard_count];
 	struct stratumsrv_conn *conn;
-	struct event_base *evbase = evconnlistener_get_base(listener);
-	struct bufferevent *bev = bufferevent_socket_new(evbase, sock, BEV_OPT_CLOSE_ON_FREE);
+	
 	conn = malloc(sizeof(*conn));
 	*conn = (struct stratumsrv_conn){
-		.bev = bev,
+		.shard = shard,
+		.sock = sock,
+		.diff = SSM_DIFF1,
 	};
-	LL_PREPEND(_ssm_connections, conn);
-	bufferevent_setcb(bev, stratumsrv_read, NULL, stratumsrv_event, conn);
-	bufferevent_enable(bev, EV_READ | EV_WRITE);
+	mutex_lock(&shard->lock);
+	LL_PREPEND(shard->new_conns, conn);
+	mutex_unlock(&shard->lock);
+	notifier_wake(shard->notifier);
 }
 
 void stratumsrv_start();
@@ -617,15 +1193,64 @@ void stratumsrv_change_port()
 	), 0x10, (void*)&sin, sizeof(sin));
 }
 
+static
+void *stratumsrv_shard_thread(void * const p)
+{
+	struct stratumsrv_shard * const shard = p;
+	char threadname[20];
+	
+	pthread_detach(pthread_self());
+	snprintf(threadname, sizeof(threadname), "stratumsrv/%d", shard->id);
+	RenameThread(threadname);
+	
+	event_base_dispatch(shard->evbase);
+	
+	return NULL;
+}
+
+static
+void stratumsrv_shards_start(void)
+{
+	struct stratumsrv_shard *shard;
+	pthread_t pth;
+	int i;
+	
+	_ssm_shard_count = opt_stratumsrv_threads ?: bfg_cpu_count();
+	_ssm_shards = calloc(_ssm_shard_count, sizeof(*_ssm_shards));
+	if (unlikely(!_ssm_shards))
+		quit(1, "Failed to allocate stratum server shards");
+	for (i = 0; i < _ssm_shard_count; ++i)
+	{
+		shard = &_ssm_shards[i];
+		shard->id = i;
+		shard->evbase = event_base_new();
+		if (unlikely(!shard->evbase))
+			quit(1, "Failed to create stratum server event base");
+		notifier_init(shard->notifier);
+		mutex_init(&shard->lock);
+		struct event * const ev_wake = event_new(shard->evbase, shard->notifier[0], EV_READ | EV_PERSIST, stratumsrv_shard_wake, shard);
+		event_add(ev_wake, NULL);
+		if (unlikely(pthread_create(&pth, NULL, stratumsrv_shard_thread, shard)))
+			quit(1, "stratumsrv shard thread create failed");
+	}
+	applog(LOG_DEBUG, "SSM: Started %d connection threads", _ssm_shard_count);
+}
+
 static
 void *stratumsrv_thread(__maybe_unused void *p)
 {
 	pthread_detach(pthread_self());
 	RenameThread("stratumsrv");
 	
-	for (uint64_t n = MAX_CLIENTS; n; n >>= 8)
+	for (uint64_t n = opt_stratumsrv_clients; n; n >>= 8)
 		++_ssm_client_octets;
-	_ssm_client_xnonce2sz = 2;
+	_ssm_client_xnonce2sz = opt_stratumsrv_xnonce2sz;
+	stratumsrv_xnonce1s_init();
+	applog(LOG_DEBUG, "SSM: %d client slots, using %d-byte extranonce1 and %d-byte extranonce2 (upstream extranonce2 size must be at least %d)",
+	       opt_stratumsrv_clients, (int)_ssm_client_octets, (int)_ssm_client_xnonce2sz,
+	       (int)(_ssm_client_octets + _ssm_client_xnonce2sz));
+	rwlock_init(&_ssm_jobs_lock);
+	stratumsrv_shards_start();
 	
 	struct event_base *evbase = event_base_new();
 	_smm_evbase = evbase;
@@ -299,7 +299,7 @@ static bool twinfury_process_results(struct cgpu_info * const proc)
 					proc->proc_repr,
 				   (unsigned long)rx_len, rx_buffer[j], state.chip, state.state, state.switched, (unsigned long)nonce);
 			if (bitfury_fudge_nonce(work->midstate, m7, ntime, nbits, &nonce))
-				submit_nonce(proc->thr[0], work, nonce);
+				submit_nonce_async(proc->thr[0], work, nonce);
 			else
 				inc_hw_errors(proc->thr[0], work, nonce);
 		}
@@ -84,6 +84,10 @@ struct ft232r_device_handle {
 	uint16_t osz;
 	unsigned char *obuf;
 	uint16_t obufsz;
+	
+	// Only used by simulated devices (which have no libusb handle)
+	unsigned char *simbuf;
+	uint16_t simbufsz;
 };
 
 struct ft232r_device_handle *ft232r_open(struct lowlevel_device_info *info)
@@ -138,8 +142,28 @@ struct ft232r_device_handle *ft232r_open(struct lowlevel_device_info *info)
 	return ftdi;
 }
 
+// Simulates a FT232R in synchronous bit-bang mode with nothing attached to its pins, for benchmarking
+struct ft232r_device_handle *ft232r_open_sim(void)
+{
+	struct ft232r_device_handle *ftdi;
+	
+	ftdi = calloc(1, sizeof(*ftdi));
+	ftdi->osz = 0x1000;
+	ftdi->obuf = malloc(ftdi->osz);
+	ftdi->simbuf = malloc(ftdi->osz);
+	
+	return ftdi;
+}
+
 void ft232r_close(struct ft232r_device_handle *dev)
 {
+	if (!dev->h)
+	{
+		free(dev->simbuf);
+		free(dev->obuf);
+		free(dev);
+		return;
+	}
 	libusb_release_interface(dev->h, 0);
 	libusb_reset_device(dev->h);
 	libusb_close(dev->h);
@@ -170,9 +194,48 @@ bool ft232r_set_bitmode(struct ft232r_device_handle *dev, uint8_t mask, uint8_t
 	return !libusb_control_transfer(dev->h, FTDI_REQTYPE_OUT, FTDI_REQUEST_SET_BITMODE, (mode << 8) | mask, FTDI_INDEX, NULL, 0, FTDI_TIMEOUT);
 }
 
+// Each byte written reads back the pin state; like the real chip, excess unread data is dropped
+static ssize_t ft232r_sim_readwrite(struct ft232r_device_handle *dev, unsigned char endpoint, void *data, size_t count)
+{
+	unsigned char *p = data;
+	size_t n, total = 0;
+	
+	if (endpoint == dev->o)
+	{
+		n = dev->osz - dev->simbufsz;
+		if (n > count)
+			n = count;
+		memcpy(&dev->simbuf[dev->simbufsz], data, n);
+		dev->simbufsz += n;
+		return count;
+	}
+	
+	// Every 0x40 byte packet starts with 2 status bytes
+	while (count > 2 && (dev->simbufsz || !total))
+	{
+		p[0] = 0x31;
+		p[1] = 0x60;
+		n = count - 2;
+		if (n > 0x40 - 2)
+			n = 0x40 - 2;
+		if (n > dev->simbufsz)
+			n = dev->simbufsz;
+		memcpy(&p[2], dev->simbuf, n);
+		dev->simbufsz -= n;
+		memmove(dev->simbuf, &dev->simbuf[n], dev->simbufsz);
+		p += n + 2;
+		count -= n + 2;
+		total += n + 2;
+	}
+	return total;
+}
+
 static ssize_t ft232r_readwrite(struct ft232r_device_handle *dev, unsigned char endpoint, void *data, size_t count)
 {
 	int transferred;
+	
+	if (unlikely(!dev->h))
+		return ft232r_sim_readwrite(dev, endpoint, data, count);
 	switch (libusb_bulk_transfer(dev->h, endpoint, data, count, &transferred, FTDI_TIMEOUT)) {
 		case LIBUSB_ERROR_TIMEOUT:
 			if (!transferred) {
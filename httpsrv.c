@@ -14,6 +14,8 @@
 #endif
 
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #ifndef WIN32
 #include <sys/types.h>
@@ -24,8 +26,11 @@
 #include <microhttpd.h>
 
 #include "logging.h"
+#include "miner.h"
 #include "util.h"
 
+#define HTTPSRV_IDLE_TIMEOUT  120
+
 static struct MHD_Daemon *httpsrv;
 
 extern int handle_getwork(struct MHD_Connection *, bytes_t *);
@@ -35,9 +40,296 @@ void httpsrv_prepare_resp(struct MHD_Response *resp)
 	MHD_add_response_header(resp, MHD_HTTP_HEADER_SERVER, PACKAGE"/"VERSION" getwork server");
 }
 
+/*
+ * /metrics: OpenMetrics text exposition, rendered straight from the miner's
+ * counters (locking only to read the hash total and walk the pool list), one
+ * metric family at a time as the format requires. Processor counters are labelled with their
+ * device, so per-device figures are a sum by that label.
+ */
+static
+void metrics_printf(bytes_t * const b, const char * const fmt, ...)
+{
+	va_list ap, ap2;
+	char *out;
+	int n;
+	
+	va_start(ap, fmt);
+	va_copy(ap2, ap);
+	// Sized first, so long label values are never cut off
+	n = vsnprintf(NULL, 0, fmt, ap);
+	if (n > 0)
+	{
+		// Room for vsnprintf's terminator, which isn't kept
+		out = bytes_preappend(b, n + 1);
+		vsnprintf(out, n + 1, fmt, ap2);
+		bytes_postappend(b, n);
+	}
+	va_end(ap2);
+	va_end(ap);
+}
+
+static
+void metrics_family(bytes_t * const b, const char * const name, const char * const type, const char * const help)
+{
+	metrics_printf(b, "# TYPE bfgminer_%s %s\n# HELP bfgminer_%s %s\n", name, type, name, help);
+}
+
+// Label values can't contain a raw quote, backslash or newline
+static
+void metrics_label_escape(char *out, size_t outsz, const char *in)
+{
+	for ( ; *in && outsz > 2; ++in)
+	{
+		if (*in == '"' || *in == '\\' || *in == '\n')
+		{
+			*(out++) = '\\';
+			--outsz;
+		}
+		*(out++) = (*in == '\n') ? 'n' : *in;
+		--outsz;
+	}
+	*out = '\0';
+}
+
+#define METRICS_PROC_FIELD(name, expr)  \
+	static double metrics_proc_ ## name(const struct cgpu_info * const proc)  \
+	{  \
+		return (expr);  \
+	}
+METRICS_PROC_FIELD(hashes, proc->total_mhashes * 1e6)
+METRICS_PROC_FIELD(hashrate, proc->rolling * 1e6)
+METRICS_PROC_FIELD(accepted, proc->accepted)
+METRICS_PROC_FIELD(rejected, proc->rejected)
+METRICS_PROC_FIELD(stale, proc->stale)
+METRICS_PROC_FIELD(diff1, proc->diff1)
+METRICS_PROC_FIELD(diff_accepted, proc->diff_accepted)
+METRICS_PROC_FIELD(diff_rejected, proc->diff_rejected)
+METRICS_PROC_FIELD(diff_stale, proc->diff_stale)
+METRICS_PROC_FIELD(hw_errors, proc->hw_errors)
+METRICS_PROC_FIELD(temperature, proc->temp)
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	double (*get)(const struct cgpu_info *);
+	// Only shown when positive
+	bool optional;
+} metrics_proc_families[] = {
+	{"proc_hashes", "counter", "Hashes done", metrics_proc_hashes},
+	{"proc_hashrate", "gauge", "Rolling hashrate in hashes per second", metrics_proc_hashrate},
+	{"proc_accepted", "counter", "Accepted shares", metrics_proc_accepted},
+	{"proc_rejected", "counter", "Rejected shares", metrics_proc_rejected},
+	{"proc_stale", "counter", "Stale shares", metrics_proc_stale},
+	{"proc_diff1", "counter", "Difficulty 1 shares found", metrics_proc_diff1},
+	{"proc_diff_accepted", "counter", "Difficulty of accepted shares", metrics_proc_diff_accepted},
+	{"proc_diff_rejected", "counter", "Difficulty of rejected shares", metrics_proc_diff_rejected},
+	{"proc_diff_stale", "counter", "Difficulty of stale shares", metrics_proc_diff_stale},
+	{"proc_hw_errors", "counter", "Hardware errors", metrics_proc_hw_errors},
+	{"proc_temperature_celsius", "gauge", "Temperature", metrics_proc_temperature, true},
+};
+
+#define METRICS_POOL_FIELD(name, expr)  \
+	static double metrics_pool_ ## name(const struct pool * const pool)  \
+	{  \
+		return (expr);  \
+	}
+METRICS_POOL_FIELD(alive, (pool->enabled == POOL_ENABLED && !pool->idle))
+METRICS_POOL_FIELD(accepted, pool->accepted)
+METRICS_POOL_FIELD(rejected, pool->rejected)
+METRICS_POOL_FIELD(stale, pool->stale_shares)
+METRICS_POOL_FIELD(diff1, pool->diff1)
+METRICS_POOL_FIELD(diff_accepted, pool->diff_accepted)
+METRICS_POOL_FIELD(diff_rejected, pool->diff_rejected)
+METRICS_POOL_FIELD(diff_stale, pool->diff_stale)
+METRICS_POOL_FIELD(getworks, pool->getwork_requested)
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	double (*get)(const struct pool *);
+} metrics_pool_families[] = {
+	{"pool_alive", "gauge", "Whether the pool is enabled and not idle", metrics_pool_alive},
+	{"pool_accepted", "counter", "Accepted shares", metrics_pool_accepted},
+	{"pool_rejected", "counter", "Rejected shares", metrics_pool_rejected},
+	{"pool_stale", "counter", "Stale shares", metrics_pool_stale},
+	{"pool_diff1", "counter", "Difficulty 1 shares found", metrics_pool_diff1},
+	{"pool_diff_accepted", "counter", "Difficulty of accepted shares", metrics_pool_diff_accepted},
+	{"pool_diff_rejected", "counter", "Difficulty of rejected shares", metrics_pool_diff_rejected},
+	{"pool_diff_stale", "counter", "Difficulty of stale shares", metrics_pool_diff_stale},
+	{"pool_getworks", "counter", "Work requested", metrics_pool_getworks},
+};
+
+static
+void metrics_sample(bytes_t * const b, const char * const name, const char * const type, const char * const labels, const double val)
+{
+	metrics_printf(b, "bfgminer_%s%s%s %.17g\n", name, strcmp(type, "counter") ? "" : "_total", labels, val);
+}
+
+static
+void metrics_render(bytes_t * const b)
+{
+	const int procs = total_devices;
+	char (*proc_labels)[0x40] = malloc(sizeof(*proc_labels) * (procs ?: 1));
+	char (*pool_labels)[0x140] = NULL;
+	int npools;
+	struct cgpu_info *proc;
+	struct pool *pool;
+	char url[0x100], labels[0x180];
+	int diff1, hw_errors, bad_nonces;
+	unsigned verify_depth;
+	uint64_t verify_done, verify_overflows, cumulative;
+	int i, j;
+	
+	if (unlikely(!proc_labels))
+		quit(1, "Failed to malloc metrics labels");
+	
+	metrics_family(b, "uptime_seconds", "gauge", "Time since mining started");
+	metrics_sample(b, "uptime_seconds", "gauge", "", total_secs);
+	mutex_lock(&hash_lock);
+	hashmeter_flush_pending();
+	const double mhashes = total_mhashes_done;
+	mutex_unlock(&hash_lock);
+	metrics_family(b, "hashes", "counter", "Hashes done");
+	metrics_sample(b, "hashes", "counter", "", mhashes * 1e6);
+	metrics_family(b, "hashrate", "gauge", "Rolling hashrate in hashes per second");
+	metrics_sample(b, "hashrate", "gauge", "", total_rolling * 1e6);
+	metrics_family(b, "accepted", "counter", "Accepted shares");
+	metrics_sample(b, "accepted", "counter", "", total_accepted);
+	metrics_family(b, "rejected", "counter", "Rejected shares");
+	metrics_sample(b, "rejected", "counter", "", total_rejected);
+	metrics_family(b, "stale", "counter", "Stale shares");
+	metrics_sample(b, "stale", "counter", "", total_stale);
+	metrics_family(b, "diff_accepted", "counter", "Difficulty of accepted shares");
+	metrics_sample(b, "diff_accepted", "counter", "", total_diff_accepted);
+	metrics_family(b, "diff_rejected", "counter", "Difficulty of rejected shares");
+	metrics_sample(b, "diff_rejected", "counter", "", total_diff_rejected);
+	metrics_family(b, "diff_stale", "counter", "Difficulty of stale shares");
+	metrics_sample(b, "diff_stale", "counter", "", total_diff_stale);
+	get_share_totals(&diff1, &hw_errors, &bad_nonces);
+	metrics_family(b, "diff1", "counter", "Difficulty 1 shares found");
+	metrics_sample(b, "diff1", "counter", "", diff1);
+	metrics_family(b, "hw_errors", "counter", "Hardware errors");
+	metrics_sample(b, "hw_errors", "counter", "", hw_errors);
+	metrics_family(b, "getworks", "counter", "Work requested");
+	metrics_sample(b, "getworks", "counter", "", total_getworks);
+	metrics_family(b, "staged_work", "gauge", "Work items staged for the devices");
+	metrics_sample(b, "staged_work", "gauge", "", total_staged());
+	if (get_nonce_verify_stats(&verify_depth, &verify_done, &verify_overflows))
+	{
+		metrics_family(b, "verify_queue", "gauge", "Nonces waiting for the verify threads");
+		metrics_sample(b, "verify_queue", "gauge", "", verify_depth);
+		metrics_family(b, "verified_nonces", "counter", "Nonces checked by the verify threads");
+		metrics_sample(b, "verified_nonces", "counter", "", verify_done);
+	}
+	
+	for (i = 0; i < procs; ++i)
+	{
+		proc = get_devices(i);
+		snprintf(proc_labels[i], sizeof(*proc_labels), "{device=\"%s\",proc=\"%s\"}", proc->device->dev_repr_ns, proc->proc_repr_ns);
+	}
+	for (j = 0; j < sizeof(metrics_proc_families) / sizeof(*metrics_proc_families); ++j)
+	{
+		metrics_family(b, metrics_proc_families[j].name, metrics_proc_families[j].type, metrics_proc_families[j].help);
+		for (i = 0; i < procs; ++i)
+		{
+			proc = get_devices(i);
+			const double val = metrics_proc_families[j].get(proc);
+			if (metrics_proc_families[j].optional && val <= 0)
+				continue;
+			metrics_sample(b, metrics_proc_families[j].name, metrics_proc_families[j].type, proc_labels[i], val);
+		}
+	}
+	
+	// Pools may be added or removed meanwhile
+	mutex_lock(&pools_lock);
+	npools = total_pools;
+	pool_labels = malloc(sizeof(*pool_labels) * (npools ?: 1));
+	if (unlikely(!pool_labels))
+		quit(1, "Failed to malloc metrics labels");
+	for (i = 0; i < npools; ++i)
+	{
+		metrics_label_escape(url, sizeof(url), pools[i]->rpc_url ?: "");
+		snprintf(pool_labels[i], sizeof(*pool_labels), "{pool=\"%d\",url=\"%s\"}", pools[i]->pool_no, url);
+	}
+	for (j = 0; j < sizeof(metrics_pool_families) / sizeof(*metrics_pool_families); ++j)
+	{
+		metrics_family(b, metrics_pool_families[j].name, metrics_pool_families[j].type, metrics_pool_families[j].help);
+		for (i = 0; i < npools; ++i)
+			metrics_sample(b, metrics_pool_families[j].name, metrics_pool_families[j].type, pool_labels[i], metrics_pool_families[j].get(pools[i]));
+	}
+	
+	metrics_family(b, "pool_submit_latency_seconds", "histogram", "Time from sending a share to the pool's reply");
+	for (i = 0; i < npools; ++i)
+	{
+		pool = pools[i];
+		const struct cgminer_pool_stats * const stats = &pool->cgminer_pool_stats;
+		uint64_t count;
+		// Drop the closing brace, to add the bucket bound
+		snprintf(labels, sizeof(labels), "%s", pool_labels[i]);
+		labels[strlen(labels) - 1] = '\0';
+		cumulative = 0;
+		for (j = 0; j < SUBMIT_LATENCY_BUCKETS; ++j)
+		{
+			cumulative += bfg_atomic_load_u64(&stats->submit_latency_bucket[j]);
+			metrics_printf(b, "bfgminer_pool_submit_latency_seconds_bucket%s,le=\"%g\"} %"PRIu64"\n", labels, submit_latency_bucket_secs[j], cumulative);
+		}
+		// Read after the buckets, so a reply being counted can't make it smaller than them
+		count = bfg_atomic_load_u64(&stats->submit_latency_count);
+		if (count < cumulative)
+			count = cumulative;
+		metrics_printf(b, "bfgminer_pool_submit_latency_seconds_bucket%s,le=\"+Inf\"} %"PRIu64"\n", labels, count);
+		metrics_printf(b, "bfgminer_pool_submit_latency_seconds_sum%s %.6f\n", pool_labels[i], bfg_atomic_load_u64(&stats->submit_latency_us) / 1e6);
+		metrics_printf(b, "bfgminer_pool_submit_latency_seconds_count%s %"PRIu64"\n", pool_labels[i], count);
+	}
+	mutex_unlock(&pools_lock);
+	
+	bytes_append(b, "# EOF\n", 6);
+	
+	free(proc_labels);
+	free(pool_labels);
+}
+
+static
+int httpsrv_metrics(struct MHD_Connection *conn)
+{
+	bytes_t out = BYTES_INIT;
+	struct MHD_Response *resp;
+	int ret;
+	
+	metrics_render(&out);
+	resp = MHD_create_response_from_buffer(bytes_len(&out), bytes_buf(&out), MHD_RESPMEM_MUST_FREE);
+	httpsrv_prepare_resp(resp);
+	MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "application/openmetrics-text; version=1.0.0; charset=utf-8");
+	ret = MHD_queue_response(conn, MHD_HTTP_OK, resp);
+	MHD_destroy_response(resp);
+	return ret;
+}
+
+static
+int httpsrv_method_not_allowed(struct MHD_Connection *conn)
+{
+	struct MHD_Response *resp;
+	int ret;
+	
+	resp = MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+	httpsrv_prepare_resp(resp);
+	MHD_add_response_header(resp, MHD_HTTP_HEADER_ALLOW, MHD_HTTP_METHOD_GET ", " MHD_HTTP_METHOD_HEAD);
+	ret = MHD_queue_response(conn, MHD_HTTP_METHOD_NOT_ALLOWED, resp);
+	MHD_destroy_response(resp);
+	return ret;
+}
+
 static
 int httpsrv_handle_req(struct MHD_Connection *conn, const char *url, const char *method, bytes_t *upbuf)
 {
+	if (!strcmp(url, "/metrics"))
+	{
+		if (strcmp(method, MHD_HTTP_METHOD_GET) && strcmp(method, MHD_HTTP_METHOD_HEAD))
+			return httpsrv_method_not_allowed(conn);
+		return httpsrv_metrics(conn);
+	}
 	return handle_getwork(conn, upbuf);
 }
 
@@ -88,15 +380,21 @@ void httpsrv_log(void *arg, const char *fmt, va_list ap)
 
 void httpsrv_start(unsigned short port)
 {
+	// Getwork may block waiting for work, so one slow request mustn't hold up the rest
+	const unsigned threads = opt_httpsrv_threads ?: bfg_cpu_count();
+	
 	httpsrv = MHD_start_daemon(
 		MHD_USE_SELECT_INTERNALLY | MHD_USE_DEBUG,
 		port, NULL, NULL,
 		&httpsrv_handle_access, NULL,
 		MHD_OPTION_NOTIFY_COMPLETED, &httpsrv_cleanup_request, NULL,
 		MHD_OPTION_EXTERNAL_LOGGER, &httpsrv_log, NULL,
+		MHD_OPTION_THREAD_POOL_SIZE, threads,
+		// Idle keep-alive connections are closed after this many seconds
+		MHD_OPTION_CONNECTION_TIMEOUT, (unsigned)HTTPSRV_IDLE_TIMEOUT,
 	MHD_OPTION_END);
 	if (httpsrv)
-		applog(LOG_NOTICE, "HTTP server listening on port %d", (int)port);
+		applog(LOG_NOTICE, "HTTP server listening on port %d with %u threads", (int)port, threads);
 	else
 		applog(LOG_ERR, "Failed to start HTTP server on port %d", (int)port);
 }
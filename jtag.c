@@ -25,6 +25,9 @@
 
 #define FTDI_READ_BUFFER_SIZE 100
 
+// Upper bound on bytes assembled for a single ft232r write in async mode
+#define JTAG_BATCH_BUFSZ 0x400
+
 static
 unsigned char jtag_clock_byte(struct jtag_port *jp, bool tms, bool tdi)
 {
@@ -126,6 +129,98 @@ void setbit(void *data, uint32_t bitnum, bool nv)
 		*p &= ~o;
 }
 
+// Shifts bitlength bits of data (MSB first) in as few ft232r transfers as possible
+// Each bit is clocked as a pair of bytes (TCK low, TCK high); when reading, TDO for bit N is sampled from the byte after its rising edge
+static
+bool jtag_shift_batch(struct jtag_port * const jp, uint8_t * const data, const size_t bitlength, const bool do_read, const bool do_exit)
+{
+	struct jtag_port_a * const a = jp->a;
+	unsigned char wbuf[JTAG_BATCH_BUFSZ], rbuf[FTDI_READ_BUFFER_SIZE];
+	unsigned char *p;
+	size_t bitoff = 0, n, i, maxbits, rbufsz, base;
+	ssize_t carrybit = -1;
+	bool last;
+	
+	if (unlikely(do_read && a->async)) {
+		applog(LOG_WARNING, "%s: request for tdo in async mode not possible", __func__);
+		return false;
+	}
+	
+	while (bitoff < bitlength) {
+		if (a->async)
+			maxbits = sizeof(wbuf) / 2;
+		else {
+			// Keep the unread data within what the ft232r can buffer; one byte is reserved for the final TDO sample
+			maxbits = (FTDI_READ_BUFFER_SIZE - 1 - a->bufread) / 2;
+			if (unlikely(!maxbits)) {
+				rbufsz = a->bufread;
+				if (ft232r_read_all(a->ftdi, rbuf, rbufsz) != (ssize_t)rbufsz)
+					return false;
+				a->bufread = 0;
+				continue;
+			}
+		}
+		n = bitlength - bitoff;
+		last = (n <= maxbits);
+		if (!last)
+			n = maxbits;
+		
+		p = wbuf;
+		for (i = 0; i < n; ++i, p += 2) {
+			p[0] = jtag_clock_byte(jp, (last && do_exit && i == n - 1), getbit(data, bitoff + i));
+			p[1] = p[0] | jp->tck;
+		}
+		if (last && do_read) {
+			// Extra byte to sample TDO of the final bit
+			p[0] = p[-1];
+			++p;
+		}
+		if (ft232r_write_all(a->ftdi, wbuf, p - wbuf) != p - wbuf)
+			return false;
+		a->state = p[-1];
+		
+		if (a->async) {
+			bitoff += n;
+			continue;
+		}
+		a->bufread += p - wbuf;
+		if (!do_read) {
+			bitoff += n;
+			if (a->bufread < FTDI_READ_BUFFER_SIZE - 3)
+				// By deferring unnecessary reads, we can avoid some USB latency
+				continue;
+			rbufsz = a->bufread;
+			a->bufread = 0;
+			if (ft232r_read_all(a->ftdi, rbuf, rbufsz) != (ssize_t)rbufsz)
+				return false;
+			continue;
+		}
+		
+		rbufsz = a->bufread;
+		a->bufread = 0;
+		if (ft232r_read_all(a->ftdi, rbuf, rbufsz) != (ssize_t)rbufsz)
+			return false;
+		base = rbufsz - (p - wbuf);
+		
+		// The last bit of the previous batch was sampled by the first byte of this one
+		if (carrybit >= 0)
+		{
+			setbit(data, carrybit, (rbuf[base] & jp->tdo));
+			carrybit = -1;
+		}
+		for (i = 0; i < n; ++i) {
+			if (base + (i * 2) + 2 >= rbufsz) {
+				carrybit = bitoff + i;
+				break;
+			}
+			setbit(data, bitoff + i, (rbuf[base + (i * 2) + 2] & jp->tdo));
+		}
+		bitoff += n;
+	}
+	
+	return true;
+}
+
 // Expects to start at the Capture step, to handle 0-length gracefully
 bool _jtag_llrw(struct jtag_port *jp, void *buf, size_t bitlength, bool do_read, int stage)
 {
@@ -139,55 +234,15 @@ bool _jtag_llrw(struct jtag_port *jp, void *buf, size_t bitlength, bool do_read,
 			return false;
 
 #ifndef DEBUG_JTAG_CLOCK
-	// This alternate implementation is designed to minimize ft232r reads (which are slow)
-	if (do_read) {
-		unsigned char rbuf[FTDI_READ_BUFFER_SIZE];
-		unsigned char wbuf[3];
-		ssize_t rbufsz, bitspending = 0;
-		size_t databitoff = 0, i;
-
-		--bitlength;
-		for (i = 0; i < bitlength; ++i) {
-			wbuf[0] = jtag_clock_byte(jp, false, getbit(data, i));
-			wbuf[1] = wbuf[0] | jp->tck;
-			if (ft232r_write_all(jp->a->ftdi, wbuf, 2) != 2)
-				return false;
-			jp->a->bufread += 2;
-			++bitspending;
-			if (jp->a->bufread > FTDI_READ_BUFFER_SIZE - 2) {
-				// The next bit would overflow, so read now
-				rbufsz = jp->a->bufread;
-				if (ft232r_read_all(jp->a->ftdi, rbuf, rbufsz) != rbufsz)
-					return false;
-				for (ssize_t j = rbufsz - ((bitspending - 1) * 2); j < rbufsz; j += 2)
-					setbit(data, databitoff++, (rbuf[j] & jp->tdo));
-				bitspending = 1;
-				jp->a->bufread = 0;
-			}
-		}
-		// Last bit needs special treatment
-		wbuf[0] = jtag_clock_byte(jp, (stage & 2), getbit(data, i));
-		wbuf[2] = wbuf[1] = wbuf[0] | jp->tck;
-		if (ft232r_write_all(jp->a->ftdi, wbuf, sizeof(wbuf)) != sizeof(wbuf))
-			return false;
-		rbufsz = jp->a->bufread + 3;
-		if (ft232r_read_all(jp->a->ftdi, rbuf, rbufsz) != rbufsz)
+	if (!jtag_shift_batch(jp, data, bitlength, do_read, (stage & 2)))
+		return false;
+	if (stage & 2)
+		if (!jtag_clock(jp, true, false, NULL))  // Update
 			return false;
-		--rbufsz;
-		for (ssize_t j = rbufsz - (bitspending * 2); j < rbufsz; j += 2)
-			setbit(data, databitoff++, (rbuf[j] & jp->tdo));
-		setbit(data, databitoff++, (rbuf[rbufsz] & jp->tdo));
-		jp->a->bufread = 0;
-		
-		if (stage & 2) {
-			if (!jtag_clock(jp, true, false, NULL))  // Update
-				return false;
-		}
-		
-		return true;
-	}
+	return true;
 #endif
 
+	// Bit-at-a-time implementation, used to verify the batched one
 	int i, j;
 	div_t d;
 
@@ -54,6 +54,12 @@ struct bitfury_device {
 	int desync_counter;
 	int sample_hwe;
 	int sample_tot;
+	
+	/* Where atrvec was last emitted into the SPI transaction, so bitfury_do_io can patch it in place */
+	unsigned long txn_bufgen;
+	size_t txn_off;
+	int txn_prev_fasync;
+	uint32_t txn_atrvec[19];
 };
 
 extern void work_to_bitfury_payload(struct bitfury_payload *, struct work *);
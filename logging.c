@@ -11,7 +11,14 @@
 
 #include "config.h"
 
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "compat.h"
@@ -26,6 +33,61 @@ bool opt_log_microseconds;
 /* per default priorities higher than LOG_NOTICE are logged */
 int opt_log_level = LOG_NOTICE;
 
+/* Asynchronous logging: producers claim a slot in a bounded MPSC ring
+ * (sequence numbers per slot, as in Vyukov's bounded queue), copy the already
+ * formatted record in, and a single writer thread outputs the records in
+ * batches, flushing each file once per batch instead of once per line.
+ * Nothing is allocated on the producer side: log lines too long for a slot
+ * are truncated, and file records too long for one take several consecutive
+ * slots. */
+
+#define LOGQ_INLINE  0x200
+#define LOGQ_MAX_DIRTY  8
+
+int opt_log_queue;
+bool opt_log_queue_drop;
+
+enum logq_kind {
+	LOGQ_CONSOLE,
+	LOGQ_SYSLOG,
+	LOGQ_FILE,
+	// Flush and fsync a file, once the records before it are written
+	LOGQ_SYNC,
+};
+
+struct logq_record {
+	volatile unsigned seq;
+	enum logq_kind kind;
+	int prio;
+	bool tofile;
+	bool tocon;
+	FILE *f;
+	pthread_mutex_t *lock;
+	char datetime[40];
+	size_t len;
+	char buf[LOGQ_INLINE];
+};
+
+struct logq_dirty {
+	FILE *f;
+	// NULL for stderr, which is under the console lock
+	pthread_mutex_t *lock;
+};
+
+static struct logq_record *logq;
+static unsigned logq_mask;
+static volatile unsigned logq_head;
+static volatile unsigned logq_tail;
+static volatile bool logq_active;
+static volatile bool logq_writer_idle;
+// Producers waiting for the writer to free slots
+static volatile int logq_space_waiters;
+static bool logq_stderr_file;
+static pthread_mutex_t logq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logq_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t logq_space_cond = PTHREAD_COND_INITIALIZER;
+static volatile uint64_t logq_written, logq_dropped;
+
 static void _my_log_curses(int prio, const char *datetime, const char *str)
 {
 #ifdef HAVE_CURSES
@@ -37,6 +99,397 @@ static void _my_log_curses(int prio, const char *datetime, const char *str)
 		printf(" %s %s%s", datetime, str, "                    \n");
 }
 
+static
+void applog_datetime(char * const datetime, const size_t datetimesz)
+{
+	if (opt_log_microseconds)
+	{
+		struct timeval tv;
+		struct tm tm;
+		
+		bfg_gettimeofday(&tv);
+		localtime_r(&tv.tv_sec, &tm);
+		
+		snprintf(datetime, datetimesz, "[%d-%02d-%02d %02d:%02d:%02d.%06ld]",
+			tm.tm_year + 1900,
+			tm.tm_mon + 1,
+			tm.tm_mday,
+			tm.tm_hour,
+			tm.tm_min,
+			tm.tm_sec,
+			(long)tv.tv_usec);
+	}
+	else
+		get_now_datestamp(datetime, datetimesz);
+}
+
+static
+void applog_output(const int prio, const char * const datetime, const char * const str, const bool writetofile, const bool writetocon, const bool flush)
+{
+	bfg_console_lock();
+	
+	/* Only output to stderr if it's not going to the screen as well */
+	if (writetofile) {
+		fprintf(stderr, " %s %s\n", datetime, str);	/* atomic write to stderr */
+		if (flush)
+			fflush(stderr);
+	}
+
+	if (writetocon)
+		_my_log_curses(prio, datetime, str);
+	
+	bfg_console_unlock();
+}
+
+static
+void logq_wake(void)
+{
+	__sync_synchronize();
+	if (logq_writer_idle)
+	{
+		mutex_lock(&logq_lock);
+		pthread_cond_signal(&logq_cond);
+		mutex_unlock(&logq_lock);
+	}
+}
+
+// Whether the n slots from pos are not all free yet (they are freed in order)
+static
+bool logq_full(const unsigned pos, const unsigned n)
+{
+	const unsigned last = pos + n - 1;
+	return ((int)(logq[last & logq_mask].seq - last) < 0);
+}
+
+// Sleeps until the writer frees some slots, releasing held (if any) meanwhile
+static
+void logq_wait_space(const unsigned pos, const unsigned n, pthread_mutex_t * const held)
+{
+	logq_wake();
+	if (held)
+		mutex_unlock(held);
+	mutex_lock(&logq_lock);
+	__sync_add_and_fetch(&logq_space_waiters, 1);
+	__sync_synchronize();
+	if (logq_full(pos, n) && logq_active)
+		pthread_cond_wait(&logq_space_cond, &logq_lock);
+	__sync_sub_and_fetch(&logq_space_waiters, 1);
+	mutex_unlock(&logq_lock);
+	if (held)
+		mutex_lock(held);
+}
+
+// Returns the first of n consecutive slots to fill in, or NULL if the record should be dropped
+static
+struct logq_record *logq_claim(const unsigned n, unsigned * const out_pos, pthread_mutex_t * const held)
+{
+	unsigned pos = logq_head, last;
+	int diff;
+	
+	while (true)
+	{
+		last = pos + n - 1;
+		diff = (int)(logq[last & logq_mask].seq - last);
+		if (likely(!diff))
+		{
+			if (__sync_bool_compare_and_swap(&logq_head, pos, pos + n))
+			{
+				*out_pos = pos;
+				return &logq[pos & logq_mask];
+			}
+		}
+		else
+		if (diff < 0)
+		{
+			// Queue is full
+			if (opt_log_queue_drop)
+			{
+				bfg_atomic_add_u64(&logq_dropped, 1);
+				return NULL;
+			}
+			logq_wait_space(pos, n, held);
+		}
+		pos = logq_head;
+	}
+}
+
+static
+void logq_publish(const unsigned pos, const unsigned n)
+{
+	unsigned i;
+	
+	__sync_synchronize();
+	for (i = 0; i < n; ++i)
+		logq[(pos + i) & logq_mask].seq = pos + i + 1;
+	logq_wake();
+}
+
+static
+bool logq_applog(const int prio, const char * const str, const enum logq_kind kind, const bool writetofile, const bool writetocon)
+{
+	struct logq_record *rec;
+	unsigned pos;
+	size_t len;
+	
+	if (!logq_active)
+		return false;
+	rec = logq_claim(1, &pos, NULL);
+	if (!rec)
+		return true;
+	rec->kind = kind;
+	rec->prio = prio;
+	rec->tofile = writetofile;
+	rec->tocon = writetocon;
+	if (kind != LOGQ_SYSLOG)
+		applog_datetime(rec->datetime, sizeof(rec->datetime));
+	len = strlen(str);
+	if (unlikely(len >= LOGQ_INLINE))
+		len = LOGQ_INLINE - 1;
+	memcpy(rec->buf, str, len);
+	rec->buf[len] = '\0';
+	rec->len = len;
+	logq_publish(pos, 1);
+	return true;
+}
+
+// Must be called with lock held; it is released while waiting for room in the queue
+bool bfg_logq_file(FILE * const f, pthread_mutex_t * const lock, const void * const data, const size_t len)
+{
+	const unsigned n = len ? ((len + LOGQ_INLINE - 1) / LOGQ_INLINE) : 1;
+	const uint8_t *p = data;
+	struct logq_record *rec;
+	unsigned pos, i;
+	size_t chunk, left = len;
+	
+	// Records bigger than the whole queue are written directly
+	if (!logq_active || n > logq_mask + 1)
+		return false;
+	if (!logq_claim(n, &pos, lock))
+		return true;
+	for (i = 0; i < n; ++i)
+	{
+		rec = &logq[(pos + i) & logq_mask];
+		chunk = (left > LOGQ_INLINE) ? LOGQ_INLINE : left;
+		rec->kind = LOGQ_FILE;
+		rec->f = f;
+		rec->lock = lock;
+		rec->len = chunk;
+		memcpy(rec->buf, p, chunk);
+		p += chunk;
+		left -= chunk;
+	}
+	logq_publish(pos, n);
+	return true;
+}
+
+// Must be called with lock held, like bfg_logq_file
+bool bfg_logq_sync(FILE * const f, pthread_mutex_t * const lock)
+{
+	struct logq_record *rec;
+	unsigned pos;
+	
+	if (!logq_active)
+		return false;
+	// Even in drop mode, as the caller would just sync now instead
+	rec = logq_claim(1, &pos, lock);
+	if (!rec)
+		return false;
+	rec->kind = LOGQ_SYNC;
+	rec->f = f;
+	rec->lock = lock;
+	rec->len = 0;
+	logq_publish(pos, 1);
+	return true;
+}
+
+static
+void logq_flush_file(const struct logq_dirty * const d)
+{
+	if (d->lock)
+		mutex_lock(d->lock);
+	else
+		bfg_console_lock();
+	fflush(d->f);
+	if (d->lock)
+		mutex_unlock(d->lock);
+	else
+		bfg_console_unlock();
+}
+
+static
+void logq_mark_dirty(struct logq_dirty * const dirty, int * const dirty_count, FILE * const f, pthread_mutex_t * const lock)
+{
+	const struct logq_dirty d = {
+		.f = f,
+		.lock = lock,
+	};
+	int i;
+	
+	for (i = 0; i < *dirty_count; ++i)
+		if (dirty[i].f == f)
+			return;
+	if (*dirty_count < LOGQ_MAX_DIRTY)
+		dirty[(*dirty_count)++] = d;
+	else
+		logq_flush_file(&d);
+}
+
+static
+void *logq_thread(void __maybe_unused *userdata)
+{
+	struct logq_record *rec;
+	struct logq_dirty dirty[LOGQ_MAX_DIRTY];
+	int dirty_count = 0, i;
+	uint64_t dropped_reported = 0, dropped;
+	bool ok;
+	struct timespec ts;
+	struct timeval tv;
+	
+	pthread_detach(pthread_self());
+	RenameThread("log");
+	
+	while (true)
+	{
+		while (true)
+		{
+			rec = &logq[logq_tail & logq_mask];
+			if ((int)(rec->seq - (logq_tail + 1)) < 0)
+				break;
+			__sync_synchronize();
+			
+			switch (rec->kind)
+			{
+				case LOGQ_SYSLOG:
+#ifdef HAVE_SYSLOG_H
+					syslog(rec->prio, "%s", rec->buf);
+#endif
+					break;
+				case LOGQ_CONSOLE:
+					applog_output(rec->prio, rec->datetime, rec->buf, rec->tofile, rec->tocon, false);
+					if (rec->tofile)
+						logq_mark_dirty(dirty, &dirty_count, stderr, NULL);
+					break;
+				case LOGQ_FILE:
+					// The log's other users (flushes, synchronous writes) hold its lock
+					mutex_lock(rec->lock);
+					ok = (fwrite(rec->buf, rec->len, 1, rec->f) == 1);
+					mutex_unlock(rec->lock);
+					if (unlikely(!ok))
+					{
+						char datetime[40];
+						applog_datetime(datetime, sizeof(datetime));
+						applog_output(LOG_ERR, datetime, "Log queue fwrite error", logq_stderr_file, true, true);
+					}
+					logq_mark_dirty(dirty, &dirty_count, rec->f, rec->lock);
+					break;
+				case LOGQ_SYNC:
+					mutex_lock(rec->lock);
+					ok = !(fflush(rec->f) || fsync(fileno(rec->f)));
+					mutex_unlock(rec->lock);
+					if (unlikely(!ok) && opt_debug)
+					{
+						char datetime[40], msg[80];
+						applog_datetime(datetime, sizeof(datetime));
+						snprintf(msg, sizeof(msg), "Log queue sync error: %s", bfg_strerror(errno, BST_ERRNO));
+						applog_output(LOG_DEBUG, datetime, msg, logq_stderr_file, true, true);
+					}
+					break;
+			}
+			
+			__sync_synchronize();
+			rec->seq = logq_tail + logq_mask + 1;
+			++logq_tail;
+			bfg_atomic_add_u64(&logq_written, 1);
+			
+			__sync_synchronize();
+			if (logq_space_waiters)
+			{
+				mutex_lock(&logq_lock);
+				pthread_cond_broadcast(&logq_space_cond);
+				mutex_unlock(&logq_lock);
+			}
+		}
+		
+		for (i = 0; i < dirty_count; ++i)
+			logq_flush_file(&dirty[i]);
+		dirty_count = 0;
+		
+		dropped = bfg_atomic_load_u64(&logq_dropped);
+		if (unlikely(dropped != dropped_reported))
+		{
+			// Written directly, since the queue is what overflowed
+			char datetime[40], msg[80];
+			applog_datetime(datetime, sizeof(datetime));
+			snprintf(msg, sizeof(msg), "Log queue full: dropped %"PRIu64" records", dropped - dropped_reported);
+			applog_output(LOG_WARNING, datetime, msg, logq_stderr_file, true, true);
+			dropped_reported = dropped;
+		}
+		
+		mutex_lock(&logq_lock);
+		logq_writer_idle = true;
+		__sync_synchronize();
+		rec = &logq[logq_tail & logq_mask];
+		if ((int)(rec->seq - (logq_tail + 1)) < 0)
+		{
+			gettimeofday(&tv, NULL);
+			ts.tv_sec = tv.tv_sec + 1;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			pthread_cond_timedwait(&logq_cond, &logq_lock, &ts);
+		}
+		logq_writer_idle = false;
+		mutex_unlock(&logq_lock);
+	}
+	
+	return NULL;
+}
+
+void logging_start_async(void)
+{
+	pthread_t pth;
+	unsigned sz, i;
+	
+	if (opt_log_queue <= 0 || logq)
+		return;
+	for (sz = 1; sz < (unsigned)opt_log_queue; sz <<= 1)
+	{}
+	logq = calloc(sz, sizeof(*logq));
+	if (unlikely(!logq))
+		quit(1, "Failed to calloc log queue");
+	for (i = 0; i < sz; ++i)
+		logq[i].seq = i;
+	logq_mask = sz - 1;
+	logq_stderr_file = !isatty(fileno((FILE *)stderr));
+	if (unlikely(pthread_create(&pth, NULL, logq_thread, NULL)))
+	{
+		applog(LOG_ERR, "Failed to create log writer thread, logging synchronously");
+		return;
+	}
+	logq_active = true;
+}
+
+// Stops queuing new records and waits briefly for the writer to drain the queue
+void logging_flush(void)
+{
+	int i;
+	
+	if (!logq_active)
+		return;
+	logq_active = false;
+	logq_wake();
+	for (i = 0; i < 200 && (logq_tail != logq_head || !logq_writer_idle); ++i)
+		cgsleep_ms(10);
+}
+
+bool get_log_queue_stats(unsigned * const out_depth, uint64_t * const out_written, uint64_t * const out_dropped)
+{
+	if (!logq)
+		return false;
+	*out_depth = logq_head - logq_tail;
+	*out_written = bfg_atomic_load_u64(&logq_written);
+	*out_dropped = bfg_atomic_load_u64(&logq_dropped);
+	return true;
+}
+
 /* high-level logging function, based on global opt_log_level */
 
 /*
@@ -46,7 +499,8 @@ void _applog(int prio, const char *str)
 {
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog) {
-		syslog(prio, "%s", str);
+		if (!logq_applog(prio, str, LOGQ_SYSLOG, false, false))
+			syslog(prio, "%s", str);
 	}
 #else
 	if (0) {}
@@ -55,46 +509,16 @@ void _applog(int prio, const char *str)
 		bool writetocon =
 			(opt_debug_console || (opt_log_output && prio != LOG_DEBUG) || prio <= LOG_NOTICE)
 		 && !(opt_quiet && prio != LOG_ERR);
-		bool writetofile = !isatty(fileno((FILE *)stderr));
+		bool writetofile = logq_active ? logq_stderr_file : !isatty(fileno((FILE *)stderr));
 		if (!(writetocon || writetofile))
 			return;
 
-		char datetime[64];
-
-		if (opt_log_microseconds)
-		{
-			struct timeval tv;
-			struct tm tm;
-			
-			bfg_gettimeofday(&tv);
-			localtime_r(&tv.tv_sec, &tm);
-			
-			snprintf(datetime, sizeof(datetime), "[%d-%02d-%02d %02d:%02d:%02d.%06ld]",
-				tm.tm_year + 1900,
-				tm.tm_mon + 1,
-				tm.tm_mday,
-				tm.tm_hour,
-				tm.tm_min,
-				tm.tm_sec,
-				(long)tv.tv_usec);
-		}
-		else
-			get_now_datestamp(datetime, sizeof(datetime));
+		if (logq_applog(prio, str, LOGQ_CONSOLE, writetofile, writetocon))
+			return;
 
-		if (writetofile || writetocon)
-		{
-			bfg_console_lock();
-			
-			/* Only output to stderr if it's not going to the screen as well */
-			if (writetofile) {
-				fprintf(stderr, " %s %s\n", datetime, str);	/* atomic write to stderr */
-				fflush(stderr);
-			}
+		char datetime[64];
 
-			if (writetocon)
-				_my_log_curses(prio, datetime, str);
-			
-			bfg_console_unlock();
-		}
+		applog_datetime(datetime, sizeof(datetime));
+		applog_output(prio, datetime, str, writetofile, writetocon, true);
 	}
 }
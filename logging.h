@@ -14,7 +14,9 @@
 #include "config.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdarg.h>
 
@@ -47,6 +49,15 @@ extern int opt_log_level;
 
 extern void _applog(int prio, const char *str);
 
+/* asynchronous log queue (--log-queue) */
+extern int opt_log_queue;
+extern bool opt_log_queue_drop;
+extern void logging_start_async(void);
+extern void logging_flush(void);
+extern bool bfg_logq_file(FILE *, pthread_mutex_t *lock, const void *, size_t);
+extern bool bfg_logq_sync(FILE *, pthread_mutex_t *lock);
+extern bool get_log_queue_stats(unsigned *out_depth, uint64_t *out_written, uint64_t *out_dropped);
+
 #define IN_FMT_FFL " in %s %s():%d"
 
 #define applog(prio, fmt, ...) do { \
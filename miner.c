@@ -65,6 +65,7 @@
 
 #include "compat.h"
 #include "deviceapi.h"
+#include "binlog.h"
 #include "logging.h"
 #include "miner.h"
 #include "findnonce.h"
@@ -82,6 +83,15 @@
 #include "lowlevel.h"
 #endif
 
+#ifdef USE_X6500
+#include "ft232r.h"
+#include "jtag.h"
+#endif
+
+#ifdef USE_BITFURY
+#include "spidevc.h"
+#endif
+
 #if defined(unix) || defined(__APPLE__)
 	#include <errno.h>
 	#include <fcntl.h>
@@ -109,6 +119,7 @@ static char packagename[256];
 bool opt_protocol;
 bool opt_dev_protocol;
 static bool opt_benchmark;
+static bool opt_bench_suite;
 static bool want_longpoll = true;
 static bool want_gbt = true;
 static bool want_getwork = true;
@@ -167,9 +178,15 @@ bool opt_restart = true;
 #ifdef USE_LIBMICROHTTPD
 #include "httpsrv.h"
 int httpsrv_port = -1;
+int opt_httpsrv_threads;
+bool opt_httpsrv_prefetch = true;
 #endif
 #ifdef USE_LIBEVENT
 int stratumsrv_port = -1;
+int opt_stratumsrv_vardiff;
+int opt_stratumsrv_clients = 255;
+int opt_stratumsrv_xnonce2sz = 2;
+int opt_stratumsrv_threads;
 #endif
 
 struct string_elist *scan_devices;
@@ -196,6 +213,7 @@ bool have_libusb;
 static bool opt_submit_stale = true;
 static int opt_shares;
 static int opt_submit_threads = 0x40;
+static int opt_verify_threads;
 bool opt_fail_only;
 bool opt_autofan;
 bool opt_autoengine;
@@ -246,6 +264,8 @@ static int api_thr_id;
 static int total_control_threads;
 
 pthread_mutex_t hash_lock;
+// Held while changing pools[], for readers outside the main threads (pools are never freed)
+pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t *stgd_lock;
 pthread_mutex_t console_lock;
 cglock_t ch_lock;
@@ -265,6 +285,9 @@ bool shutting_down;
 
 double total_rolling;
 double total_mhashes_done;
+// Hashes reported since hashmeter last updated total_mhashes_done
+static volatile uint64_t hashmeter_pending_hashes;
+static double hashmeter_local_mhashes_done;
 static struct timeval total_tv_start, total_tv_end;
 static struct timeval miner_started;
 
@@ -276,9 +299,7 @@ static int total_submitting;
 static struct work *submit_waiting;
 notifier_t submit_waiting_notifier;
 
-int hw_errors;
-int total_accepted, total_rejected, total_diff1;
-int total_bad_nonces;
+int total_accepted, total_rejected;
 int total_getworks, total_stale, total_discarded;
 uint64_t total_bytes_rcvd, total_bytes_sent;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
@@ -374,6 +395,7 @@ struct stratum_share {
 	bool block;
 	struct work *work;
 	int id;
+	struct timeval tv_submit;
 };
 
 static struct stratum_share *stratum_shares = NULL;
@@ -461,7 +483,11 @@ void get_datestamp(char *f, size_t fsiz, time_t tt)
 	struct tm *tm = &_tm;
 	
 	if (tt == INVALID_TIMESTAMP)
+	{
+		if (get_coarse_datestamp(f, fsiz))
+			return;
 		tt = time(NULL);
+	}
 
 	localtime_r(&tt, tm);
 	snprintf(f, fsiz, "[%d-%02d-%02d %02d:%02d:%02d]",
@@ -897,8 +923,197 @@ struct cgpu_info *get_devices(int id)
 static pthread_mutex_t noncelog_lock = PTHREAD_MUTEX_INITIALIZER;
 static FILE *noncelog_file = NULL;
 
+/* Binary nonce and share logs (see binlog.h) go through stdio buffering,
+ * and are only flushed and synced to disk every BINLOG_SYNC_INTERVAL */
+#define BINLOG_SYNC_INTERVAL  10
+
+static bool opt_noncelog_binary, opt_sharelog_binary;
+
+struct binlog_state {
+	bool started;
+	struct timeval tv_sync;
+	// What each pool and processor id was named as in this run, if at all
+	struct pool **pools;
+	int pools_sz;
+	bool *procs;
+	int procs_sz;
+};
+
+static struct binlog_state noncelog_binstate, sharelog_binstate;
+
+static
+bool binlog_emit(FILE * const f, pthread_mutex_t * const lock, const void * const rec, const size_t len)
+{
+	if (bfg_logq_file(f, lock, rec, len))
+		return true;
+	return (fwrite(rec, len, 1, f) == 1);
+}
+
+/* Caller must hold lock (which the log queue may release while waiting for
+ * room). Returns -1 if writing failed, an errno if syncing failed, or 0; it is
+ * for binlog_report once the lock is released, as logging might wait on the
+ * log queue too. */
+static
+int binlog_write(FILE * const f, pthread_mutex_t * const lock, struct binlog_state * const st, const void * const rec, const size_t len)
+{
+	bool ok = true;
+	int err = 0;
+	
+	if (unlikely(!st->started))
+	{
+		// Written at every start, so appended runs are self-describing
+		struct bfg_binlog_filehdr hdr = {
+			.magic = BFG_BINLOG_MAGIC,
+			.version = BFG_BINLOG_VERSION,
+			.byteorder = BFG_BINLOG_BYTEORDER,
+		};
+#ifdef WIN32
+		// The log was opened in text mode, which would mangle it
+		_setmode(_fileno(f), _O_BINARY);
+#endif
+		// Before emitting, as that may let another thread in
+		st->started = true;
+		timer_set_delay_from_now(&st->tv_sync, BINLOG_SYNC_INTERVAL * 1000000);
+		ok = binlog_emit(f, lock, &hdr, sizeof(hdr));
+	}
+	if (likely(ok))
+		ok = binlog_emit(f, lock, rec, len);
+	if (unlikely(!ok))
+		return -1;
+	
+	if (timer_passed(&st->tv_sync, NULL))
+	{
+		timer_set_delay_from_now(&st->tv_sync, BINLOG_SYNC_INTERVAL * 1000000);
+		// With the log queue, its writer thread syncs once it has written what came before
+		if (!bfg_logq_sync(f, lock))
+			if (fflush(f) || fsync(fileno(f)))
+				err = errno;
+	}
+	return err;
+}
+
+static
+void binlog_report(const int err, const char * const purpose)
+{
+	if (unlikely(err < 0))
+		applog(LOG_ERR, "%s fwrite error", purpose);
+	else
+	if (err)
+		applog(LOG_DEBUG, "%s sync error: %s", purpose, bfg_strerror(err, BST_ERRNO));
+}
+
+// Makes room for id in a zeroed array of *szp elements
+static
+void *binlog_grow(void * const p, int * const szp, const int id, const size_t elemsz)
+{
+	uint8_t *rv = p;
+	
+	if (likely(id < *szp))
+		return p;
+	
+	const int newsz = id + 8;
+	rv = realloc(rv, newsz * elemsz);
+	if (unlikely(!rv))
+		quit(1, "Failed to realloc binlog ids");
+	memset(&rv[*szp * elemsz], 0, (newsz - *szp) * elemsz);
+	*szp = newsz;
+	return rv;
+}
+
+// Caller must hold lock; returns as binlog_write
+static
+int binlog_write_name(FILE * const f, pthread_mutex_t * const lock, struct binlog_state * const st, const uint8_t type, const int id, const char * const name)
+{
+	const size_t namesz = strlen(name) + 1;
+	const size_t len = sizeof(struct bfg_binlog_name) + namesz;
+	struct bfg_binlog_name *rec;
+	
+	if (unlikely(len > UINT16_MAX))
+		return 0;
+	rec = alloca(len);
+	*rec = (struct bfg_binlog_name){
+		.hdr = {
+			.type = type,
+			.len = len,
+		},
+		.id = id,
+	};
+	memcpy(rec->name, name, namesz);
+	return binlog_write(f, lock, st, rec, len);
+}
+
+// Caller must hold lock; names pool's id in the log unless it was already
+static
+int binlog_name_pool(FILE * const f, pthread_mutex_t * const lock, struct binlog_state * const st, struct pool * const pool)
+{
+	const int id = pool->pool_no;
+	
+	st->pools = binlog_grow(st->pools, &st->pools_sz, id, sizeof(*st->pools));
+	// Pools are renumbered when one is removed, so the id may name another URL now
+	if (likely(st->pools[id] == pool))
+		return 0;
+	// Before writing, as that may let another thread in
+	st->pools[id] = pool;
+	return binlog_write_name(f, lock, st, BFG_BINLOG_POOL, id, pool->rpc_url);
+}
+
+// Caller must hold lock; names proc's id in the log unless it was already
+static
+int binlog_name_proc(FILE * const f, pthread_mutex_t * const lock, struct binlog_state * const st, const struct cgpu_info * const proc)
+{
+	const int id = proc->cgminer_id;
+	
+	st->procs = binlog_grow(st->procs, &st->procs_sz, id, sizeof(*st->procs));
+	if (likely(st->procs[id]))
+		return 0;
+	st->procs[id] = true;
+	return binlog_write_name(f, lock, st, BFG_BINLOG_PROC, id, proc->proc_repr_ns);
+}
+
+static
+void binlog_flush(FILE * const f, pthread_mutex_t * const lock)
+{
+	if (!f)
+		return;
+	mutex_lock(lock);
+	fflush(f);
+	fsync(fileno(f));
+	mutex_unlock(lock);
+}
+
 static
-void noncelog(const struct work * const work)
+void noncelog_binary(const struct work * const work, const struct cgpu_info * const proc, const enum test_nonce2_result res)
+{
+	struct bfg_binlog_nonce rec = {
+		.hdr = {
+			.type = BFG_BINLOG_NONCE,
+			.len = sizeof(rec),
+		},
+		.pool_id = work->pool->pool_no,
+		.timestamp = time_coarse(),
+		.proc_id = proc->cgminer_id,
+		.result = (res == TNR_HIGH) ? BFG_BINLOG_NONCE_BELOW_TARGET : BFG_BINLOG_NONCE_SHARE,
+	};
+	
+	memcpy(rec.data, work->data, sizeof(rec.data));
+	memcpy(rec.hash, work->hash, sizeof(rec.hash));
+	memcpy(rec.midstate, work->midstate, sizeof(rec.midstate));
+	
+	int err;
+	
+	mutex_lock(&noncelog_lock);
+	err = binlog_name_pool(noncelog_file, &noncelog_lock, &noncelog_binstate, work->pool);
+	if (!err)
+		err = binlog_name_proc(noncelog_file, &noncelog_lock, &noncelog_binstate, proc);
+	if (!err)
+		err = binlog_write(noncelog_file, &noncelog_lock, &noncelog_binstate, &rec, sizeof(rec));
+	mutex_unlock(&noncelog_lock);
+	binlog_report(err, "noncelog");
+}
+
+// res is only kept by the binary log
+static
+void noncelog(const struct work * const work, const enum test_nonce2_result res)
 {
 	const int thr_id = work->thr_id;
 	const struct cgpu_info *proc = get_thr_cgpu(thr_id);
@@ -906,13 +1121,19 @@ void noncelog(const struct work * const work)
 	int rv;
 	size_t ret;
 	
+	if (opt_noncelog_binary)
+	{
+		noncelog_binary(work, proc, res);
+		return;
+	}
+	
 	bin2hex(hash, work->hash, 32);
 	bin2hex(data, work->data, 80);
 	bin2hex(midstate, work->midstate, 32);
 	
 	// timestamp,proc,hash,data,midstate
 	rv = snprintf(buf, sizeof(buf), "%lu,%s,%s,%s,%s\n",
-	              (unsigned long)time(NULL), proc->proc_repr_ns,
+	              (unsigned long)time_coarse(), proc->proc_repr_ns,
 	              hash, data, midstate);
 	
 	if (unlikely(rv < 1))
@@ -922,14 +1143,50 @@ void noncelog(const struct work * const work)
 	}
 	
 	mutex_lock(&noncelog_lock);
-	ret = fwrite(buf, rv, 1, noncelog_file);
-	fflush(noncelog_file);
+	if (bfg_logq_file(noncelog_file, &noncelog_lock, buf, rv))
+		ret = 1;
+	else
+	{
+		ret = fwrite(buf, rv, 1, noncelog_file);
+		fflush(noncelog_file);
+	}
 	mutex_unlock(&noncelog_lock);
 	
 	if (ret != 1)
 		applog(LOG_ERR, "noncelog fwrite error");
 }
 
+static
+void sharelog_binary(const char * const disposition, const struct work * const work, const struct cgpu_info * const cgpu, struct pool * const pool, const int thr_id, const unsigned long t)
+{
+	struct bfg_binlog_share rec = {
+		.hdr = {
+			.type = BFG_BINLOG_SHARE,
+			.len = sizeof(rec),
+		},
+		.pool_id = pool->pool_no,
+		.timestamp = t,
+		.proc_id = cgpu->cgminer_id,
+		.thr_id = thr_id,
+	};
+	
+	strncpy(rec.disposition, disposition, sizeof(rec.disposition) - 1);
+	memcpy(rec.target, work->target, sizeof(rec.target));
+	memcpy(rec.hash, work->hash, sizeof(rec.hash));
+	memcpy(rec.data, work->data, sizeof(rec.data));
+	
+	int err;
+
+	mutex_lock(&sharelog_lock);
+	err = binlog_name_pool(sharelog_file, &sharelog_lock, &sharelog_binstate, pool);
+	if (!err)
+		err = binlog_name_proc(sharelog_file, &sharelog_lock, &sharelog_binstate, cgpu);
+	if (!err)
+		err = binlog_write(sharelog_file, &sharelog_lock, &sharelog_binstate, &rec, sizeof(rec));
+	mutex_unlock(&sharelog_lock);
+	binlog_report(err, "sharelog");
+}
+
 static void sharelog(const char*disposition, const struct work*work)
 {
 	char target[(sizeof(work->target) * 2) + 1];
@@ -949,6 +1206,11 @@ static void sharelog(const char*disposition, const struct work*work)
 	cgpu = get_thr_cgpu(thr_id);
 	pool = work->pool;
 	t = work->ts_getwork + timer_elapsed(&work->tv_getwork, &work->tv_work_found);
+	if (opt_sharelog_binary)
+	{
+		sharelog_binary(disposition, work, cgpu, pool, thr_id, t);
+		return;
+	}
 	bin2hex(target, work->target, sizeof(work->target));
 	bin2hex(hash, work->hash, sizeof(work->hash));
 	bin2hex(data, work->data, sizeof(work->data));
@@ -963,8 +1225,12 @@ static void sharelog(const char*disposition, const struct work*work)
 	}
 
 	mutex_lock(&sharelog_lock);
-	ret = fwrite(s, rv, 1, sharelog_file);
-	fflush(sharelog_file);
+	if (bfg_logq_file(sharelog_file, &sharelog_lock, s, rv))
+		ret = 1;
+	else {
+		ret = fwrite(s, rv, 1, sharelog_file);
+		fflush(sharelog_file);
+	}
 	mutex_unlock(&sharelog_lock);
 
 	if (ret != 1)
@@ -1043,8 +1309,10 @@ struct pool *add_pool(void)
 	pool->sock = INVSOCK;
 	pool->lp_socket = CURL_SOCKET_BAD;
 
+	mutex_lock(&pools_lock);
 	pools = realloc(pools, sizeof(struct pool *) * (total_pools + 2));
 	pools[total_pools++] = pool;
+	mutex_unlock(&pools_lock);
 
 	return pool;
 }
@@ -1108,6 +1376,14 @@ static char *set_int_1_to_65535(const char *arg, int *i)
 	return set_int_range(arg, i, 1, 65535);
 }
 
+#ifdef USE_LIBEVENT
+// Limited to 3 bytes of extranonce1, which is all most pools leave room for anyway
+static char *set_stratumsrv_clients(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 1, 0xffffff);
+}
+#endif
+
 static char *set_int_0_to_10(const char *arg, int *i)
 {
 	return set_int_range(arg, i, 0, 10);
@@ -1884,6 +2160,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--balance",
 		     set_balance, &pool_strategy,
 		     "Change multipool strategy from failover to even share balance"),
+	OPT_WITHOUT_ARG("--bench-suite",
+			opt_set_bool, &opt_bench_suite,
+			"Benchmark work generation, verification and submission steps, then exit"),
 	OPT_WITHOUT_ARG("--benchmark",
 			opt_set_bool, &opt_benchmark,
 			"Run BFGMiner in benchmark mode - produces no shares"),
@@ -1955,7 +2234,10 @@ static struct opt_table opt_config_table[] = {
 #ifdef USE_LIBMICROHTTPD
 	OPT_WITH_ARG("--http-port",
 	             opt_set_intval, opt_show_intval, &httpsrv_port,
-	             "Port number to listen on for HTTP getwork miners (-1 means disabled)"),
+	             "Port number to listen on for HTTP getwork miners and /metrics (-1 means disabled)"),
+	OPT_WITH_ARG("--http-threads",
+	             set_int_0_to_9999, opt_show_intval, &opt_httpsrv_threads,
+	             "Number of threads serving HTTP requests (0 means one per CPU core)"),
 #endif
 #if defined(WANT_CPUMINE) && (defined(HAVE_OPENCL) || defined(USE_FPGA))
 	OPT_WITHOUT_ARG("--enable-cpu|-C",
@@ -2072,6 +2354,12 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--log-microseconds",
 	                opt_set_bool, &opt_log_microseconds,
 	                "Include microseconds in log output"),
+	OPT_WITH_ARG("--log-queue",
+	             set_int_0_to_9999, opt_show_intval, &opt_log_queue,
+	             "Queue up to this many log, nonce log and share log records for a background writer (0 means write synchronously)"),
+	OPT_WITHOUT_ARG("--log-queue-drop",
+	                opt_set_bool, &opt_log_queue_drop,
+	                "Drop log records when the log queue is full, instead of waiting"),
 #if defined(unix) || defined(__APPLE__)
 	OPT_WITH_ARG("--monitor|-m",
 		     opt_set_charp, NULL, &opt_stderr_cmd,
@@ -2094,6 +2382,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--no-getwork",
 			opt_set_invbool, &want_getwork,
 			"Disable getwork support"),
+#ifdef USE_LIBMICROHTTPD
+	OPT_WITHOUT_ARG("--no-http-prefetch",
+			opt_set_invbool, &opt_httpsrv_prefetch,
+			"Don't keep work ready for each HTTP getwork miner"),
+#endif
 	OPT_WITHOUT_ARG("--no-longpoll",
 			opt_set_invbool, &want_longpoll,
 			"Disable X-Long-Polling support"),
@@ -2133,6 +2426,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--noncelog",
 		     set_noncelog, NULL, NULL,
 		     "Create log of all nonces found"),
+	OPT_WITHOUT_ARG("--noncelog-binary",
+			opt_set_bool, &opt_noncelog_binary,
+			"Write the nonce log in compact binary format (see bfgminer-logconv)"),
 	OPT_WITH_ARG("--pass|-p",
 		     set_pass, NULL, NULL,
 		     "Password for bitcoin JSON-RPC server"),
@@ -2223,6 +2519,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--sharelog",
 		     set_sharelog, NULL, NULL,
 		     "Append share log to file"),
+	OPT_WITHOUT_ARG("--sharelog-binary",
+			opt_set_bool, &opt_sharelog_binary,
+			"Write the share log in compact binary format (see bfgminer-logconv)"),
 	OPT_WITH_ARG("--shares",
 		     opt_set_intval, NULL, &opt_shares,
 		     "Quit after mining N shares (default: unlimited)"),
@@ -2238,10 +2537,27 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--socks-proxy",
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks proxy (host:port)"),
+#ifndef WIN32
+	OPT_WITH_ARG("--stats-file",
+	             opt_set_charp, NULL, &opt_stats_file,
+	             "Maintain a memory-mapped stats file for bfgminer-stats and other local monitors"),
+#endif
 #ifdef USE_LIBEVENT
+	OPT_WITH_ARG("--stratum-clients",
+	             set_stratumsrv_clients, opt_show_intval, &opt_stratumsrv_clients,
+	             "Maximum number of stratum miners connected at once, which sets the extranonce1 size given to each"),
 	OPT_WITH_ARG("--stratum-port",
 	             opt_set_intval, opt_show_intval, &stratumsrv_port,
 	             "Port number to listen on for stratum miners (-1 means disabled)"),
+	OPT_WITH_ARG("--stratum-threads",
+	             set_int_0_to_9999, opt_show_intval, &opt_stratumsrv_threads,
+	             "Number of threads serving stratum miners (0 means one per CPU core)"),
+	OPT_WITH_ARG("--stratum-vardiff",
+	             set_int_0_to_9999, opt_show_intval, &opt_stratumsrv_vardiff,
+	             "Target shares per minute from each stratum miner, adjusting their difficulty (0 means fixed difficulty 1)"),
+	OPT_WITH_ARG("--stratum-xnonce2-size",
+	             set_int_1_to_10, opt_show_intval, &opt_stratumsrv_xnonce2sz,
+	             "Bytes of extranonce2 given to each stratum miner to roll"),
 #endif
 	OPT_WITHOUT_ARG("--submit-stale",
 			opt_set_bool, &opt_submit_stale,
@@ -2300,6 +2616,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--verbose",
 			opt_set_bool, &opt_log_output,
 			"Log verbose output to stderr as well as status output"),
+	OPT_WITH_ARG("--verify-threads",
+	             set_int_0_to_9999, opt_show_intval, &opt_verify_threads,
+	             "Number of threads to verify device nonces on, instead of the device threads (default: 0, disabled)"),
 	OPT_WITHOUT_ARG("--weighed-stats",
 	                opt_set_bool, &opt_weighed_stats,
 	                "Display statistics weighed to difficulty 1"),
@@ -2538,7 +2857,7 @@ static bool jobj_binary(const json_t *obj, const char *key,
 	return true;
 }
 
-static void calc_midstate(struct work *work)
+void calc_midstate(struct work *work)
 {
 	union {
 		unsigned char c[64];
@@ -2769,10 +3088,12 @@ static bool work_decode(struct pool *pool, struct work *work, json_t *val)
 		return false;
 	}
 
-	if (!jobj_binary(res_val, "midstate", work->midstate, sizeof(work->midstate), false)) {
-		// Calculate it ourselves
-		applog(LOG_DEBUG, "Calculating midstate locally");
-		calc_midstate(work);
+	// Always calculated locally, since nonces are verified from the midstate (see hashtest2) and a bad one from the pool would hide errors in the header
+	calc_midstate(work);
+	{
+		unsigned char pool_midstate[sizeof(work->midstate)];
+		if (jobj_binary(res_val, "midstate", pool_midstate, sizeof(pool_midstate), false) && memcmp(pool_midstate, work->midstate, sizeof(pool_midstate)))
+			applog(LOG_WARNING, "Pool %u sent a midstate not matching its data, ignoring it", pool->pool_no);
 	}
 
 	if (unlikely(!jobj_binary(res_val, "target", work->target, sizeof(work->target), true))) {
@@ -2835,7 +3156,7 @@ static int __total_staged(void)
 	return HASH_COUNT(staged_work);
 }
 
-static int total_staged(void)
+int total_staged(void)
 {
 	int ret;
 
@@ -4065,6 +4386,8 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		total_diff_accepted += work->work_difficulty;
 		pool->diff_accepted += work->work_difficulty;
 		mutex_unlock(&stats_lock);
+		statshm_update_proc(cgpu);
+		statshm_update_pool(pool);
 
 		pool->seq_rejects = 0;
 		cgpu->last_share_pool = pool->pool_no;
@@ -4118,6 +4441,8 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 		pool->diff_rejected += work->work_difficulty;
 		pool->seq_rejects++;
 		mutex_unlock(&stats_lock);
+		statshm_update_proc(cgpu);
+		statshm_update_pool(pool);
 
 		applog(LOG_DEBUG, "PROOF OF WORK RESULT: false (booooo)");
 		if (!QUIET) {
@@ -4227,6 +4552,27 @@ static char *submit_upstream_work_request(struct work *work)
 	return s;
 }
 
+// Upper bounds of the submit latency histogram buckets, in seconds
+const double submit_latency_bucket_secs[SUBMIT_LATENCY_BUCKETS] = {
+	0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+
+static void pool_submit_latency(struct pool * const pool, const struct timeval * const tv_submit, const struct timeval * const tv_reply)
+{
+	struct cgminer_pool_stats * const stats = &pool->cgminer_pool_stats;
+	const double secs = tdiff((struct timeval *)tv_reply, (struct timeval *)tv_submit);
+	int i;
+
+	// Replies for the same pool can arrive on different threads
+	bfg_atomic_add_u64(&stats->submit_latency_count, 1);
+	bfg_atomic_add_u64(&stats->submit_latency_us, (uint64_t)(secs * 1000000));
+	for (i = 0; i < SUBMIT_LATENCY_BUCKETS; ++i)
+		if (secs <= submit_latency_bucket_secs[i]) {
+			bfg_atomic_add_u64(&stats->submit_latency_bucket[i], 1);
+			break;
+		}
+}
+
 static bool submit_upstream_work_completed(struct work *work, bool resubmit, struct timeval *ptv_submit, json_t *val) {
 	json_t *res, *err;
 	bool rc = false;
@@ -4250,6 +4596,8 @@ static bool submit_upstream_work_completed(struct work *work, bool resubmit, str
 	} else if (pool_tclear(pool, &pool->submit_fail))
 		applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 
+	pool_submit_latency(pool, ptv_submit, &tv_submit_reply);
+
 	res = json_object_get(val, "result");
 	err = json_object_get(val, "error");
 
@@ -4506,6 +4854,8 @@ static void get_benchmark_work(struct work *work)
 	size_t min_size = (work_size < bench_size ? work_size : bench_size);
 	memset(work, 0, sizeof(*work));
 	memcpy(work, &bench_block, min_size);
+	// The block's own midstate doesn't line up with struct work, and hashtest2 verifies nonces from work->midstate
+	calc_midstate(work);
 	work->mandatory = true;
 	work->pool = pools[0];
 	cgtime(&work->tv_getwork);
@@ -4759,6 +5109,8 @@ static void disable_curses(void)
 }
 #endif
 
+static void stop_nonce_verifiers(void);
+
 static void __kill_work(void)
 {
 	struct cgpu_info *cgpu;
@@ -4823,6 +5175,9 @@ static void __kill_work(void)
 		cgpu->status = LIFE_DEAD2;
 	}
 
+	applog(LOG_DEBUG, "Stopping nonce verify threads");
+	stop_nonce_verifiers();
+
 	/* Stop the others */
 	applog(LOG_DEBUG, "Killing off API thread");
 	thr = &control_thr[api_thr_id];
@@ -5317,6 +5672,11 @@ static void submit_discard_share(struct work *work)
 	submit_discard_share2("discard", work);
 }
 
+/* A pool's ready stratum shares are sent in one write, but only up to this
+ * much per select round, so the write fits in the free socket buffer select
+ * reported, and a slow pool can't hold up the submissions to the others */
+#define STRATUM_SUBMIT_BATCH_BYTES  0x1000
+
 struct submit_work_state {
 	struct work *work;
 	bool resubmit;
@@ -5324,6 +5684,7 @@ struct submit_work_state {
 	int failures;
 	struct timeval tv_staleexpire;
 	char *s;
+	int sshare_id;
 	struct timeval tv_submit;
 	struct submit_work_state *next;
 };
@@ -5452,6 +5813,21 @@ static void free_sws(struct submit_work_state *sws)
 	free(sws);
 }
 
+static void stratum_submit_format(char *s, size_t sz, const struct pool *pool, struct work *work, int id)
+{
+	uint32_t nonce;
+	char nonce2hex[(bytes_len(&work->nonce2) * 2) + 1];
+	char noncehex[9];
+	char ntimehex[9];
+
+	bin2hex(nonce2hex, bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
+	nonce = *((uint32_t *)(work->data + 76));
+	bin2hex(noncehex, (const unsigned char *)&nonce, 4);
+	bin2hex(ntimehex, (void *)&work->data[68], 4);
+	snprintf(s, sz, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+		pool->rpc_user, work->job_id, nonce2hex, ntimehex, noncehex, id);
+}
+
 static void *submit_work_thread(__maybe_unused void *userdata)
 {
 	int wip = 0;
@@ -5460,6 +5836,7 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 	struct timeval curlm_timer;
 	struct submit_work_state *sws, **swsp;
 	struct submit_work_state *write_sws = NULL;
+	struct submit_work_state *batch_sws = NULL, **batch_tailp;
 	unsigned tsreduce = 0;
 
 	pthread_detach(pthread_self());
@@ -5547,7 +5924,8 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 			continue;
 		}
 		
-		// Handle any stratum ready-to-write results
+		// Format every ready stratum share, moving it to batch_sws
+		batch_tailp = &batch_sws;
 		for (swsp = &write_sws; (sws = *swsp); ) {
 			struct work *work = sws->work;
 			struct pool *pool = work->pool;
@@ -5555,7 +5933,6 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 			bool sessionid_match;
 			
 			if (fd == INVSOCK || (!pool->stratum_init) || (!pool->stratum_notify) || !FD_ISSET(fd, &wfds)) {
-next_write_sws:
 				// TODO: Check if stale, possibly discard etc
 				swsp = &sws->next;
 				continue;
@@ -5571,9 +5948,6 @@ next_write_sws:
 				applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
 				submit_discard_share2("disconnect", work);
 				++tsreduce;
-next_write_sws_del:
-				// Clear the fd from wfds, to avoid potentially blocking on other submissions to the same socket
-				FD_CLR(fd, &wfds);
 				// Delete sws for this submission, since we're done with it
 				*swsp = sws->next;
 				free_sws(sws);
@@ -5583,56 +5957,101 @@ next_write_sws_del:
 			
 			char *s = sws->s;
 			struct stratum_share *sshare = calloc(sizeof(struct stratum_share), 1);
-			int sshare_id;
-			uint32_t nonce;
-			char nonce2hex[(bytes_len(&work->nonce2) * 2) + 1];
-			char noncehex[9];
-			char ntimehex[9];
 			
 			sshare->work = copy_work(work);
-			bin2hex(nonce2hex, bytes_buf(&work->nonce2), bytes_len(&work->nonce2));
-			nonce = *((uint32_t *)(work->data + 76));
-			bin2hex(noncehex, (const unsigned char *)&nonce, 4);
-			bin2hex(ntimehex, (void *)&work->data[68], 4);
+			cgtime(&sshare->tv_submit);
 			
 			mutex_lock(&sshare_lock);
 			/* Give the stratum share a unique id */
-			sshare_id =
+			sws->sshare_id =
 			sshare->id = swork_id++;
 			HASH_ADD_INT(stratum_shares, id, sshare);
-			snprintf(s, 1024, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-				pool->rpc_user, work->job_id, nonce2hex, ntimehex, noncehex, sshare->id);
 			mutex_unlock(&sshare_lock);
 			
+			stratum_submit_format(s, 1024, pool, work, sws->sshare_id);
+			
 			applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->stratum_url, s);
-
-			if (likely(stratum_send(pool, s, strlen(s)))) {
+			
+			*swsp = sws->next;
+			sws->next = NULL;
+			*batch_tailp = sws;
+			batch_tailp = &sws->next;
+			
+			pool->stratum_batch_len += strlen(s) + 1;
+			if (pool->stratum_batch_len >= STRATUM_SUBMIT_BATCH_BYTES)
+				// Leave the rest for the next round, when the socket has room again
+				FD_CLR(fd, &wfds);
+		}
+		
+		// Send all the formatted shares for each pool in a single write
+		while (batch_sws) {
+			struct pool *pool = batch_sws->work->pool;
+			size_t batch_len = pool->stratum_batch_len, len;
+			int batch_count = 0;
+			bool sent, retry;
+			char *batch, *p;
+			
+			pool->stratum_batch_len = 0;
+			// Room for the newline separators, plus the one stratum_send appends
+			batch = p = malloc(batch_len + 1);
+			for (sws = batch_sws; sws; sws = sws->next)
+			{
+				if (sws->work->pool != pool)
+					continue;
+				if (p != batch)
+					*(p++) = '\n';
+				len = strlen(sws->s);
+				memcpy(p, sws->s, len);
+				p += len;
+				++batch_count;
+			}
+			*p = '\0';
+			
+			if (batch_count > 1)
+				applog(LOG_DEBUG, "Sending %d shares to pool %d in one write", batch_count, pool->pool_no);
+			sent = stratum_send(pool, batch, p - batch);
+			free(batch);
+			// If the pool was already failing, the shares stay in the stratum_shares db for the disconnect resubmitter
+			retry = (!sent) && !pool_tset(pool, &pool->submit_fail);
+			if (likely(sent)) {
 				if (pool_tclear(pool, &pool->submit_fail))
 					applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 				applog(LOG_DEBUG, "Successfully submitted, adding to stratum_shares db");
-				goto next_write_sws_del;
-			} else if (!pool_tset(pool, &pool->submit_fail)) {
-				// Undo stuff
-				mutex_lock(&sshare_lock);
-				// NOTE: Need to find it again in case something else has consumed it already (like the stratum-disconnect resubmitter...)
-				HASH_FIND_INT(stratum_shares, &sshare_id, sshare);
-				if (sshare)
-					HASH_DEL(stratum_shares, sshare);
-				mutex_unlock(&sshare_lock);
-				if (sshare)
-				{
-					free_work(sshare->work);
-					free(sshare);
-				}
-				
+			} else if (retry)
 				applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
-				total_ro++;
-				pool->remotefail_occasions++;
-				
-				if (!sshare)
-					goto next_write_sws_del;
-				
-				goto next_write_sws;
+			
+			for (swsp = &batch_sws; (sws = *swsp); ) {
+				if (sws->work->pool != pool) {
+					swsp = &sws->next;
+					continue;
+				}
+				*swsp = sws->next;
+				if (retry) {
+					struct stratum_share *sshare;
+					int sshare_id = sws->sshare_id;
+					
+					// Undo stuff
+					mutex_lock(&sshare_lock);
+					// NOTE: Need to find it again in case something else has consumed it already (like the stratum-disconnect resubmitter...)
+					HASH_FIND_INT(stratum_shares, &sshare_id, sshare);
+					if (sshare)
+						HASH_DEL(stratum_shares, sshare);
+					mutex_unlock(&sshare_lock);
+					total_ro++;
+					pool->remotefail_occasions++;
+					if (sshare)
+					{
+						free_work(sshare->work);
+						free(sshare);
+						// Keep sws to try again later
+						sws->next = write_sws;
+						write_sws = sws;
+						continue;
+					}
+				}
+				// Delete sws for this submission, since we're done with it
+				free_sws(sws);
+				--wip;
 			}
 		}
 		
@@ -6209,8 +6628,8 @@ static void stage_work(struct work *work)
 	applog(LOG_DEBUG, "Pushing work %d from pool %d to hash queue",
 	       work->id, work->pool->pool_no);
 	work->work_restart_id = work->pool->work_restart_id;
-	work->pool->last_work_time = time(NULL);
-	cgtime(&work->pool->tv_last_work_time);
+	work->pool->last_work_time = time_coarse();
+	cgtime_coarse(&work->pool->tv_last_work_time);
 	test_work_current(work);
 	work->pool->works++;
 	hash_push(work);
@@ -6285,6 +6704,8 @@ void remove_pool(struct pool *pool)
 	int i, last_pool = total_pools - 1;
 	struct pool *other;
 
+	mutex_lock(&pools_lock);
+
 	/* Boost priority of any lower prio than this one */
 	for (i = 0; i < total_pools; i++) {
 		other = pools[i];
@@ -6302,6 +6723,8 @@ void remove_pool(struct pool *pool)
 	pool->removed = true;
 	pool->has_stratum = false;
 	total_pools--;
+
+	mutex_unlock(&pools_lock);
 }
 
 /* add a mutex if this needs to be thread safe in the future */
@@ -6600,6 +7023,8 @@ void write_config(FILE *fcfg)
 		fprintf(fcfg, ",\n\"stop-time\" : \"%d:%d\"", schedstop.tm.tm_hour, schedstop.tm.tm_min);
 	if (opt_socks_proxy && *opt_socks_proxy)
 		fprintf(fcfg, ",\n\"socks-proxy\" : \"%s\"", json_escape(opt_socks_proxy));
+	if (opt_stats_file && *opt_stats_file)
+		fprintf(fcfg, ",\n\"stats-file\" : \"%s\"", json_escape(opt_stats_file));
 	
 	_write_config_string_elist(fcfg, "scan", scan_devices);
 #ifdef USE_LIBMICROHTTPD
@@ -6609,6 +7034,8 @@ void write_config(FILE *fcfg)
 #ifdef USE_LIBEVENT
 	if (stratumsrv_port != -1)
 		fprintf(fcfg, ",\n\"stratum-port\" : %d", stratumsrv_port);
+	if (opt_stratumsrv_clients != 255)
+		fprintf(fcfg, ",\n\"stratum-clients\" : \"%d\"", opt_stratumsrv_clients);
 #endif
 	_write_config_string_elist(fcfg, "device", opt_devices_enabled_list);
 	_write_config_string_elist(fcfg, "set-device", opt_set_device_list);
@@ -6662,10 +7089,10 @@ void zero_stats(void)
 	miner_started = total_tv_start;
 	total_rolling = 0;
 	total_mhashes_done = 0;
+	bfg_atomic_xchg_u64(&hashmeter_pending_hashes, 0);
 	total_getworks = 0;
 	total_accepted = 0;
 	total_rejected = 0;
-	hw_errors = 0;
 	total_stale = 0;
 	total_discarded = 0;
 	total_bytes_rcvd = total_bytes_sent = 0;
@@ -6674,8 +7101,6 @@ void zero_stats(void)
 	total_go = 0;
 	total_ro = 0;
 	total_secs = 1.0;
-	total_diff1 = 0;
-	total_bad_nonces = 0;
 	found_blocks = 0;
 	total_diff_accepted = 0;
 	total_diff_rejected = 0;
@@ -6722,6 +7147,10 @@ void zero_stats(void)
 		pool->cgminer_pool_stats.times_received = 0;
 		pool->cgminer_pool_stats.bytes_received = 0;
 		pool->cgminer_pool_stats.net_bytes_received = 0;
+		bfg_atomic_xchg_u64(&pool->cgminer_pool_stats.submit_latency_count, 0);
+		bfg_atomic_xchg_u64(&pool->cgminer_pool_stats.submit_latency_us, 0);
+		for (int j = 0; j < SUBMIT_LATENCY_BUCKETS; ++j)
+			bfg_atomic_xchg_u64(&pool->cgminer_pool_stats.submit_latency_bucket[j], 0);
 	}
 
 	zero_bestshare();
@@ -6729,8 +7158,10 @@ void zero_stats(void)
 	for (i = 0; i < total_devices; ++i) {
 		struct cgpu_info *cgpu = get_devices(i);
 
-		mutex_lock(&hash_lock);
+		mutex_lock(&cgpu->hashmeter_lock);
 		cgpu->total_mhashes = 0;
+		mutex_unlock(&cgpu->hashmeter_lock);
+		mutex_lock(&hash_lock);
 		cgpu->accepted = 0;
 		cgpu->rejected = 0;
 		cgpu->stale = 0;
@@ -7565,6 +7996,15 @@ void thread_reportout(struct thr_info *thr)
 	thr->getwork = time(NULL);
 }
 
+// Folds hashes not yet counted into total_mhashes_done; call with hash_lock held
+void hashmeter_flush_pending(void)
+{
+	const double mhashes = (double)bfg_atomic_xchg_u64(&hashmeter_pending_hashes, 0) / 1000000.0;
+	
+	total_mhashes_done += mhashes;
+	hashmeter_local_mhashes_done += mhashes;
+}
+
 static void hashmeter(int thr_id, struct timeval *diff,
 		      uint64_t hashes_done)
 {
@@ -7572,7 +8012,6 @@ static void hashmeter(int thr_id, struct timeval *diff,
 	struct timeval temp_tv_end, total_diff;
 	double secs;
 	double local_secs;
-	static double local_mhashes_done = 0;
 	double local_mhashes = (double)hashes_done / 1000000.0;
 	bool showlog = false;
 	char cHr[h2bs_fmt_size[H2B_NOUNIT]], aHr[h2bs_fmt_size[H2B_NOUNIT]], uHr[h2bs_fmt_size[H2B_SPACED]];
@@ -7604,10 +8043,11 @@ static void hashmeter(int thr_id, struct timeval *diff,
 		for (i = 0; i < threadobj; i++)
 			thread_rolling += cgpu->thr[i]->rolling;
 
-		mutex_lock(&hash_lock);
+		mutex_lock(&cgpu->hashmeter_lock);
 		decay_time(&cgpu->rolling, thread_rolling, secs);
 		cgpu->total_mhashes += local_mhashes;
-		mutex_unlock(&hash_lock);
+		mutex_unlock(&cgpu->hashmeter_lock);
+		statshm_update_proc(cgpu);
 
 		// If needed, output detailed, per-device stats
 		if (want_per_device_stats) {
@@ -7633,21 +8073,30 @@ static void hashmeter(int thr_id, struct timeval *diff,
 		}
 	}
 
-	/* Totals are updated by all threads so can race without locking */
-	mutex_lock(&hash_lock);
+	/* Hashes are accumulated without locking, and only folded into the
+	 * totals (under hash_lock) once every opt_log_interval, or when the
+	 * totals are read (see hashmeter_flush_pending) */
+	if (hashes_done)
+		bfg_atomic_add_u64(&hashmeter_pending_hashes, hashes_done);
 	cgtime(&temp_tv_end);
 	timersub(&temp_tv_end, &total_tv_end, &total_diff);
-
-	total_mhashes_done += local_mhashes;
-	local_mhashes_done += local_mhashes;
+	if (thr_id >= 0 && total_diff.tv_sec < opt_log_interval)
+		return;
+	
+	mutex_lock(&hash_lock);
+	timersub(&temp_tv_end, &total_tv_end, &total_diff);
+	hashmeter_flush_pending();
 	/* Only update with opt_log_interval */
 	if (total_diff.tv_sec < opt_log_interval)
 		goto out_unlock;
 	showlog = true;
+	
+	int total_diff1, hw_errors, total_bad_nonces;
+	get_share_totals(&total_diff1, &hw_errors, &total_bad_nonces);
 	cgtime(&total_tv_end);
 
 	local_secs = (double)total_diff.tv_sec + ((double)total_diff.tv_usec / 1000000.0);
-	decay_time(&total_rolling, local_mhashes_done / local_secs, local_secs);
+	decay_time(&total_rolling, hashmeter_local_mhashes_done / local_secs, local_secs);
 	global_hashrate = ((unsigned long long)lround(total_rolling)) * 1000000;
 
 	timersub(&total_tv_end, &total_tv_start, &total_diff);
@@ -7765,12 +8214,16 @@ static void hashmeter(int thr_id, struct timeval *diff,
 		hw_errors,
 		bnbuf
 	);
+	
+	statshm_update_global(total_diff1, hw_errors);
 
-
-	local_mhashes_done = 0;
+	hashmeter_local_mhashes_done = 0;
 out_unlock:
 	mutex_unlock(&hash_lock);
 
+	if (showlog && opt_api_listen)
+		api_stats_publish();
+
 	if (showlog) {
 		if (!curses_active) {
 			printf("%s          \r", logstatusline);
@@ -7801,7 +8254,10 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 				 struct stratum_share *sshare)
 {
 	struct work *work = sshare->work;
+	struct timeval tv_reply;
 
+	cgtime(&tv_reply);
+	pool_submit_latency(work->pool, &sshare->tv_submit, &tv_reply);
 	share_result(val, res_val, err_val, work, false, "");
 }
 
@@ -8559,8 +9015,8 @@ retry:
 	/* Signal hash_pop again in case there are mutliple hash_pop waiters */
 	pthread_cond_signal(&getq->cond);
 	mutex_unlock(stgd_lock);
-	work->pool->last_work_time = time(NULL);
-	cgtime(&work->pool->tv_last_work_time);
+	work->pool->last_work_time = time_coarse();
+	cgtime_coarse(&work->pool->tv_last_work_time);
 
 	return work;
 }
@@ -8695,7 +9151,7 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	work->work_restart_id = work->pool->work_restart_id;
 	gen_stratum_work2(work, &pool->swork, pool->nonce1);
 	
-	cgtime(&work->tv_staged);
+	cgtime_coarse(&work->tv_staged);
 }
 
 void gen_stratum_work2(struct work *work, struct stratum_work *swork, const char *nonce1)
@@ -8768,6 +9224,278 @@ void gen_stratum_work2(struct work *work, struct stratum_work *swork, const char
 	calc_diff(work, 0);
 }
 
+/* --bench-suite times each step of turning a stratum job into work, checking
+ * nonces and submitting shares, printing tab separated results so they can be
+ * compared between builds */
+#define BENCH_SUITE_US  1000000
+#define BENCH_SUITE_MERKLES  12
+#define BENCH_SUITE_SPI_CHIPS  16
+
+#ifdef BFG_BENCH_ALLOCS
+// From bench-allocs.c, which is only linked into bfgminer-bench
+extern volatile bool bench_count_allocs;
+extern unsigned long bench_allocs;
+#endif
+
+struct bench_suite {
+	struct pool *pool;
+	struct work *work;
+	char notify[0x800];
+	char hex[161];
+	char submit[1024];
+#ifdef USE_X6500
+	struct jtag_port_a jtag_a;
+	struct jtag_port jtag;
+#endif
+#ifdef USE_BITFURY
+	struct spi_port *spi;
+	uint32_t spi_payload[BENCH_SUITE_SPI_CHIPS][19];
+	size_t spi_off[BENCH_SUITE_SPI_CHIPS];
+#endif
+};
+
+static void bench_parse_notify(struct bench_suite *bs, unsigned long n)
+{
+	while (n--)
+		if (unlikely(!parse_method(bs->pool, bs->notify)))
+			quit(1, "%s: Failed to parse notify", __func__);
+}
+
+static void bench_gen_stratum_work(struct bench_suite *bs, unsigned long n)
+{
+	while (n--)
+		gen_stratum_work(bs->pool, bs->work);
+}
+
+static void bench_calc_midstate(struct bench_suite *bs, unsigned long n)
+{
+	while (n--)
+		calc_midstate(bs->work);
+}
+
+static void bench_hashtest2(struct bench_suite *bs, unsigned long n)
+{
+	uint32_t * const work_nonce = (uint32_t *)&bs->work->data[76];
+
+	while (n--)
+	{
+		++*work_nonce;
+		hashtest2(bs->work, true);
+	}
+}
+
+static void bench_bin2hex(struct bench_suite *bs, unsigned long n)
+{
+	while (n--)
+		bin2hex(bs->hex, bs->work->data, 80);
+}
+
+static void bench_hex2bin(struct bench_suite *bs, unsigned long n)
+{
+	unsigned char data[80];
+
+	while (n--)
+		hex2bin(data, bs->hex, 80);
+}
+
+static void bench_stage_pop(struct bench_suite *bs, unsigned long n)
+{
+	while (n--)
+	{
+		stage_work(bs->work);
+		if (unlikely(hash_pop() != bs->work))
+			quit(1, "%s: Popped the wrong work", __func__);
+	}
+}
+
+static void bench_copy_work(struct bench_suite *bs, unsigned long n)
+{
+	while (n--)
+		free_work(copy_work(bs->work));
+}
+
+static void bench_submit_format(struct bench_suite *bs, unsigned long n)
+{
+	while (n--)
+		stratum_submit_format(bs->submit, sizeof(bs->submit), bs->pool, bs->work, n);
+}
+
+#ifdef USE_X6500
+// A 32-bit data register read, as the X6500 driver does for nonces, against a simulated ft232r
+static void bench_jtag_read(struct bench_suite *bs, unsigned long n)
+{
+	uint8_t buf[4];
+
+	while (n--)
+		if (unlikely(!jtag_read(&bs->jtag, JTAG_REG_DR, buf, 32)))
+			quit(1, "%s: Simulated JTAG read failed", __func__);
+}
+
+// A 1024-bit write in async mode, as used for bitstream upload
+static void bench_jtag_write_async(struct bench_suite *bs, unsigned long n)
+{
+	uint8_t buf[0x80];
+
+	memset(buf, 0xa5, sizeof(buf));
+	bs->jtag_a.async = true;
+	while (n--)
+		if (unlikely(!jtag_write(&bs->jtag, JTAG_REG_DR, buf, sizeof(buf) * 8)))
+			quit(1, "%s: Simulated JTAG write failed", __func__);
+	ft232r_flush(bs->jtag_a.ftdi);
+	bs->jtag_a.async = false;
+}
+#endif
+
+#ifdef USE_BITFURY
+// Mock spidev: the chips echo what they are sent
+static bool bench_spi_txrx(struct spi_port *port)
+{
+	memcpy(port->spibuf_rx, port->spibuf, port->spibufsz);
+	return true;
+}
+
+// Building a bitfury chain's whole SPI transaction, as done when its layout changes
+static void bench_spi_build(struct bench_suite *bs, unsigned long n)
+{
+	struct spi_port * const spi = bs->spi;
+	unsigned char *rx;
+	int i;
+
+	while (n--)
+	{
+		spi_clear_buf(spi);
+		spi_emit_break(spi);
+		for (i = 0; i < BENCH_SUITE_SPI_CHIPS; ++i)
+		{
+			spi_emit_fasync(spi, i ? 1 : 0);
+			rx = spi_emit_data(spi, 0x3000, bs->spi_payload[i], sizeof(bs->spi_payload[i]));
+			bs->spi_off[i] = rx - (unsigned char *)spi_getrxbuf(spi);
+		}
+		spi_txrx(spi);
+	}
+}
+
+// Patching one word per chip into the existing transaction, as done on most polls
+static void bench_spi_patch(struct bench_suite *bs, unsigned long n)
+{
+	struct spi_port * const spi = bs->spi;
+	uint32_t old[19];
+	int i;
+
+	while (n--)
+	{
+		for (i = 0; i < BENCH_SUITE_SPI_CHIPS; ++i)
+		{
+			memcpy(old, bs->spi_payload[i], sizeof(old));
+			++bs->spi_payload[i][16];
+			spi_patch_data(spi, bs->spi_off[i], bs->spi_payload[i], old, sizeof(old));
+		}
+		spi_txrx(spi);
+	}
+}
+#endif
+
+static void bench_suite_run(struct bench_suite *bs, const char *name, void (*func)(struct bench_suite *, unsigned long))
+{
+	const unsigned long batch = 0x100;
+	struct timeval tv_start, tv_now;
+	unsigned long ops = 0;
+	long us;
+
+#ifdef BFG_BENCH_ALLOCS
+	bench_allocs = 0;
+	bench_count_allocs = true;
+#endif
+	timer_set_now(&tv_start);
+	do {
+		func(bs, batch);
+		ops += batch;
+		timer_set_now(&tv_now);
+		us = timer_elapsed_us(&tv_start, &tv_now);
+	} while (us < BENCH_SUITE_US);
+#ifdef BFG_BENCH_ALLOCS
+	bench_count_allocs = false;
+	printf("%s\t%lu\t%.0f\t%.2f\n", name, ops, ops * 1e6 / us, (double)bench_allocs / ops);
+#else
+	printf("%s\t%lu\t%.0f\t-\n", name, ops, ops * 1e6 / us);
+#endif
+	fflush(stdout);
+}
+
+static void bench_suite(void)
+{
+	struct bench_suite bs;
+	struct pool *pool;
+	int i;
+
+	// The staged work queue is normally created later in main
+	getq = tq_new();
+	if (!getq)
+		quit(1, "Failed to create getq");
+	stgd_lock = &getq->mutex;
+
+	bs.pool = pool = add_pool();
+	pool->rpc_user = "bench";
+	pool->nonce1 = strdup("08000002");
+	pool->n1_len = 4;
+	pool->n2size = pool->nonce2sz = 4;
+	pool->swork.diff = 1;
+
+	// Example job from the stratum protocol documentation, with more branches
+	snprintf(bs.notify, sizeof(bs.notify), "{\"params\": [\"bf\", "
+	         "\"4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000\", "
+	         "\"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008\", "
+	         "\"072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000\", [");
+	for (i = 0; i < BENCH_SUITE_MERKLES; ++i)
+		tailsprintf(bs.notify, sizeof(bs.notify), "%s\"%064x\"", i ? ", " : "", i + 1);
+	tailsprintf(bs.notify, sizeof(bs.notify), "], \"00000002\", \"1c2ac4af\", \"504e86b9\", false], \"id\": null, \"method\": \"mining.notify\"}");
+
+	bench_parse_notify(&bs, 1);
+	bs.work = make_work();
+	gen_stratum_work(pool, bs.work);
+	bin2hex(bs.hex, bs.work->data, 80);
+
+	printf("# test\tops\tops_per_sec\tallocs_per_op\n");
+	bench_suite_run(&bs, "parse_notify", bench_parse_notify);
+	bench_suite_run(&bs, "gen_stratum_work", bench_gen_stratum_work);
+	bench_suite_run(&bs, "calc_midstate", bench_calc_midstate);
+	bench_suite_run(&bs, "hashtest2", bench_hashtest2);
+	bench_suite_run(&bs, "bin2hex", bench_bin2hex);
+	bench_suite_run(&bs, "hex2bin", bench_hex2bin);
+	bench_suite_run(&bs, "stage_work+hash_pop", bench_stage_pop);
+	bench_suite_run(&bs, "copy_work+free_work", bench_copy_work);
+	bench_suite_run(&bs, "submit_format", bench_submit_format);
+#ifdef USE_X6500
+	bs.jtag_a = (struct jtag_port_a){
+		.ftdi = ft232r_open_sim(),
+	};
+	bs.jtag = (struct jtag_port){
+		.a = &bs.jtag_a,
+		.tck = 8,
+		.tms = 4,
+		.tdi = 2,
+		.tdo = 1,
+		.ignored = ~0xf,
+	};
+	bench_suite_run(&bs, "jtag_read", bench_jtag_read);
+	bench_suite_run(&bs, "jtag_write_async", bench_jtag_write_async);
+	ft232r_close(bs.jtag_a.ftdi);
+#endif
+#ifdef USE_BITFURY
+	// Do not allocate spi_port on the stack, it is too large
+	bs.spi = calloc(1, sizeof(*bs.spi));
+	bs.spi->txrx = bench_spi_txrx;
+	bs.spi->repr = "bench";
+	for (i = 0; i < BENCH_SUITE_SPI_CHIPS; ++i)
+		memcpy(bs.spi_payload[i], bs.work->data, sizeof(bs.spi_payload[i]));
+	bench_suite_run(&bs, "spi_build_chain", bench_spi_build);
+	bench_suite_run(&bs, "spi_patch_chain", bench_spi_patch);
+	free(bs.spi);
+#endif
+
+	free_work(bs.work);
+}
+
 void request_work(struct thr_info *thr)
 {
 	struct cgpu_info *cgpu = thr->cgpu;
@@ -8826,6 +9554,8 @@ struct work *get_work(struct thr_info *thr)
 	work->blk.nonce = 0;
 
 	cgtime(&tv_get);
+	// Proxy processors get work from several server threads at once
+	mutex_lock(&stats_lock);
 	timersub(&tv_get, &dev_stats->_get_start, &tv_get);
 
 	timeradd(&tv_get, &dev_stats->getwork_wait, &dev_stats->getwork_wait);
@@ -8842,6 +9572,7 @@ struct work *get_work(struct thr_info *thr)
 	if (timercmp(&tv_get, &pool_stats->getwork_wait_min, <))
 		pool_stats->getwork_wait_min = tv_get;
 	++pool_stats->getwork_calls;
+	mutex_unlock(&stats_lock);
 
 	return work;
 }
@@ -8868,7 +9599,10 @@ static void submit_work_async2(struct work *work, struct timeval *tv_work_found)
 	_submit_work_async(work);
 }
 
-void inc_hw_errors2(struct thr_info *thr, const struct work *work, const uint32_t *bad_nonce_p)
+/* Drivers' hw_error callbacks expect to run on their own thread, so HW errors
+ * found by the verifier threads leave them to run_deferred_hw_errors */
+static
+void _inc_hw_errors2(struct thr_info * const thr, const struct work * const work, const uint32_t * const bad_nonce_p, const bool defer_callback)
 {
 	struct cgpu_info * const cgpu = thr->cgpu;
 	
@@ -8882,17 +9616,32 @@ void inc_hw_errors2(struct thr_info *thr, const struct work *work, const uint32_
 			       cgpu->proc_repr, (unsigned long)be32toh(*bad_nonce_p));
 	}
 	
-	mutex_lock(&stats_lock);
-	hw_errors++;
-	++cgpu->hw_errors;
+	// Totals are summed from the processors when needed, see get_share_totals
+	__sync_add_and_fetch(&cgpu->hw_errors, 1);
 	if (bad_nonce_p)
+		__sync_add_and_fetch(&cgpu->bad_nonces, 1);
+	statshm_update_proc(cgpu);
+	
+	if (thr->cgpu->drv->hw_error)
 	{
-		++total_bad_nonces;
-		++cgpu->bad_nonces;
+		if (defer_callback)
+			__sync_add_and_fetch(&thr->hw_errors_deferred, 1);
+		else
+			thr->cgpu->drv->hw_error(thr);
 	}
-	mutex_unlock(&stats_lock);
+}
 
-	if (thr->cgpu->drv->hw_error)
+void inc_hw_errors2(struct thr_info *thr, const struct work *work, const uint32_t *bad_nonce_p)
+{
+	_inc_hw_errors2(thr, work, bad_nonce_p, false);
+}
+
+// Runs the hw_error callbacks deferred by the verifier threads; only call from thr's own thread
+void run_deferred_hw_errors(struct thr_info * const thr)
+{
+	int n = __sync_fetch_and_and(&thr->hw_errors_deferred, 0);
+	
+	while (n--)
 		thr->cgpu->drv->hw_error(thr);
 }
 
@@ -8901,11 +9650,31 @@ void inc_hw_errors(struct thr_info *thr, const struct work *work, const uint32_t
 	inc_hw_errors2(thr, work, work ? &bad_nonce : NULL);
 }
 
-enum test_nonce2_result hashtest2(struct work *work, bool checktarget)
+void get_share_totals(int * const out_diff1, int * const out_hw_errors, int * const out_bad_nonces)
 {
-	uint32_t *hash2_32 = (uint32_t *)&work->hash[0];
+	struct cgpu_info *proc;
+	int diff1 = 0, hwe = 0, bad_nonces = 0;
+	
+	for (int i = 0; i < total_devices; ++i)
+	{
+		proc = get_devices(i);
+		diff1 += proc->diff1;
+		hwe += proc->hw_errors;
+		bad_nonces += proc->bad_nonces;
+	}
+	
+	if (out_diff1)
+		*out_diff1 = diff1;
+	if (out_hw_errors)
+		*out_hw_errors = hwe;
+	if (out_bad_nonces)
+		*out_bad_nonces = bad_nonces;
+}
 
-	hash_data(work->hash, work->data);
+static
+enum test_nonce2_result hashtest2_result(const struct work * const work, const unsigned char * const hash, const bool checktarget)
+{
+	const uint32_t *hash2_32 = (const uint32_t *)hash;
 
 	if (hash2_32[7] != 0)
 		return TNR_BAD;
@@ -8913,12 +9682,31 @@ enum test_nonce2_result hashtest2(struct work *work, bool checktarget)
 	if (!checktarget)
 		return TNR_GOOD;
 
-	if (!hash_target_check_v(work->hash, work->target))
+	if (!hash_target_check_v(hash, work->target))
 		return TNR_HIGH;
 
 	return TNR_GOOD;
 }
 
+enum test_nonce2_result hashtest2(struct work *work, bool checktarget)
+{
+	// The first block of the header is already hashed in the midstate
+	// Every work source calculates it locally (including getwork, which ignores the pool's), so it always matches work->data
+	hash_data_midstate(work->hash, work->midstate, work->data);
+
+	return hashtest2_result(work, work->hash, checktarget);
+}
+
+/* Tests count SHA256d nonces for the same work at once
+ * hashes must have room for count * 32 bytes, and receives each nonce's hash (so callers can share it without rehashing)
+ * Like hashtest2, this trusts work->midstate; neither work->data nor work->hash is modified */
+void hashtest2_batch(const struct work * const work, const uint32_t * const nonces, const unsigned count, unsigned char * const hashes, enum test_nonce2_result * const results, const bool checktarget)
+{
+	hash_data_midstate_nonces(hashes, work->midstate, work->data, nonces, count);
+	for (unsigned i = 0; i < count; ++i)
+		results[i] = hashtest2_result(work, &hashes[i * 32], checktarget);
+}
+
 enum test_nonce2_result _test_nonce2(struct work *work, uint32_t nonce, bool checktarget)
 {
 	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
@@ -8939,47 +9727,41 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 	return submit_noffset_nonce(thr, work, nonce, 0);
 }
 
-/* Allows drivers to submit work items where the driver has changed the ntime
- * value by noffset. Must be only used with a work protocol that does not ntime
- * roll itself intrinsically to generate work (eg stratum). We do not touch
- * the original work struct, but the copy of it only. */
-bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t nonce,
-			  int noffset)
+static
+struct work *prepare_noffset_nonce(struct thr_info * const thr, struct work * const work_in, const uint32_t nonce, const int noffset)
 {
 	struct work *work = make_work();
 	_copy_work(work, work_in, noffset);
 	
 	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
-	struct timeval tv_work_found;
-	enum test_nonce2_result res;
-	bool ret = true;
-
-	thread_reportout(thr);
-
-	cgtime(&tv_work_found);
 	*work_nonce = htole32(nonce);
 	work->thr_id = thr->id;
+	
+	return work;
+}
 
-	/* Do one last check before attempting to submit the work */
-	/* Side effect: sets work->data for us */
-	res = test_nonce2(work, nonce);
+/* Records the statistics for a tested nonce, and submits it if it is a share; takes work
+ * from_verifier must be set when not called from thr's own thread */
+static
+bool submit_tested_nonce(struct thr_info * const thr, struct work *work, const enum test_nonce2_result res, struct timeval * const tv_work_found, const bool from_verifier)
+{
+	const uint32_t nonce = le32toh(*(uint32_t *)(work->data + 64 + 12));
+	bool ret = true;
 	
 	if (unlikely(res == TNR_BAD))
 		{
-			inc_hw_errors(thr, work, nonce);
+			_inc_hw_errors2(thr, work, &nonce, from_verifier);
 			ret = false;
 			goto out;
 		}
 	
-	mutex_lock(&stats_lock);
-	total_diff1++;
-	thr->cgpu->diff1++;
-	work->pool->diff1++;
-	thr->cgpu->last_device_valid_work = time(NULL);
-	mutex_unlock(&stats_lock);
+	// Totals are summed from the processors when needed, see get_share_totals
+	__sync_add_and_fetch(&thr->cgpu->diff1, 1);
+	__sync_add_and_fetch(&work->pool->diff1, 1);
+	thr->cgpu->last_device_valid_work = time_coarse();
 	
 	if (noncelog_file)
-		noncelog(work);
+		noncelog(work, res);
 	
 	if (res == TNR_HIGH)
 	{
@@ -8990,16 +9772,339 @@ bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t n
 			goto out;
 	}
 	
-	submit_work_async2(work, &tv_work_found);
+	submit_work_async2(work, tv_work_found);
 	work = NULL;  // Taken by submit_work_async2
 out:
 	if (work)
 		free_work(work);
+	
+	return ret;
+}
+
+/* Like submit_nonce, but only counts and submits the share if its hash also
+ * meets (bitcoin) difficulty min_diff, for drivers serving clients that mine
+ * at a higher difficulty. Returns the difficulty of the hash, or 0 if it was
+ * not a valid nonce at all. */
+double submit_nonce_min_diff(struct thr_info * const thr, struct work * const work_in, const uint32_t nonce, const double min_diff)
+{
+	struct timeval tv_work_found;
+	enum test_nonce2_result res;
+	double diff = 0;
+
+	thread_reportout(thr);
+
+	cgtime(&tv_work_found);
+	struct work * const work = prepare_noffset_nonce(thr, work_in, nonce, 0);
+	res = test_nonce2(work, nonce);
+	if (res != TNR_BAD)
+	{
+#ifdef USE_SCRYPT
+		// scrypt_test does not leave the hash in the work
+		if (opt_scrypt)
+			scrypt_regenhash(work);
+#endif
+		diff = target_diff(work->hash) * 65535. / 65536.;
+		if (diff < min_diff)
+		{
+			free_work(work);
+			goto out;
+		}
+	}
+
+	submit_tested_nonce(thr, work, res, &tv_work_found, false);
+out:
+	thread_reportin(thr);
+
+	return diff;
+}
+
+/* Allows drivers to submit work items where the driver has changed the ntime
+ * value by noffset. Must be only used with a work protocol that does not ntime
+ * roll itself intrinsically to generate work (eg stratum). We do not touch
+ * the original work struct, but the copy of it only. */
+bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t nonce,
+			  int noffset)
+{
+	struct timeval tv_work_found;
+	enum test_nonce2_result res;
+	bool ret;
+
+	thread_reportout(thr);
+
+	cgtime(&tv_work_found);
+	struct work * const work = prepare_noffset_nonce(thr, work_in, nonce, noffset);
+
+	/* Do one last check before attempting to submit the work */
+	/* Side effect: sets work->data for us */
+	res = test_nonce2(work, nonce);
+	
+	ret = submit_tested_nonce(thr, work, res, &tv_work_found, false);
 	thread_reportin(thr);
 
 	return ret;
 }
 
+/* Nonce verification offload (--verify-threads)
+ * Device threads push their nonces onto a bounded lock-free queue (after
+ * Dmitry Vyukov's MPMC design), and the verifier threads pull them off in
+ * batches, testing nonces for the same header together. */
+#define NONCE_VERIFY_QUEUE_SIZE  0x1000  // must be a power of 2
+#define NONCE_VERIFY_BATCH_SIZE  0x10
+
+struct nonce_verify_item {
+	struct thr_info *thr;
+	struct work *work;
+	struct timeval tv_work_found;
+};
+
+struct nonce_verify_slot {
+	volatile unsigned long seq;
+	struct nonce_verify_item item;
+};
+
+static struct nonce_verify_slot nonce_verify_queue[NONCE_VERIFY_QUEUE_SIZE];
+static volatile unsigned long nonce_verify_head, nonce_verify_tail;
+static volatile int nonce_verify_idle;
+static volatile bool nonce_verify_stopping;
+static pthread_t *nonce_verify_pth;
+static notifier_t nonce_verify_notifier;
+static volatile uint64_t nonce_verify_done, nonce_verify_overflows;
+
+static
+bool nonce_verify_push(const struct nonce_verify_item * const item)
+{
+	struct nonce_verify_slot *slot;
+	unsigned long pos = nonce_verify_tail;
+	long diff;
+	
+	while (true)
+	{
+		slot = &nonce_verify_queue[pos % NONCE_VERIFY_QUEUE_SIZE];
+		diff = (long)(slot->seq - pos);
+		if (!diff)
+		{
+			if (__sync_bool_compare_and_swap(&nonce_verify_tail, pos, pos + 1))
+				break;
+		}
+		else
+		if (diff < 0)
+			// Full
+			return false;
+		pos = nonce_verify_tail;
+	}
+	
+	slot->item = *item;
+	__sync_synchronize();
+	slot->seq = pos + 1;
+	
+	// Pairs with the barrier in nonce_verify_thread, so a verifier going idle either sees this item or gets woken
+	__sync_synchronize();
+	if (nonce_verify_idle)
+		notifier_wake(nonce_verify_notifier);
+	
+	return true;
+}
+
+static
+bool nonce_verify_pop(struct nonce_verify_item * const out)
+{
+	struct nonce_verify_slot *slot;
+	unsigned long pos = nonce_verify_head;
+	long diff;
+	
+	while (true)
+	{
+		slot = &nonce_verify_queue[pos % NONCE_VERIFY_QUEUE_SIZE];
+		diff = (long)(slot->seq - (pos + 1));
+		if (!diff)
+		{
+			if (__sync_bool_compare_and_swap(&nonce_verify_head, pos, pos + 1))
+				break;
+		}
+		else
+		if (diff < 0)
+			// Empty
+			return false;
+		pos = nonce_verify_head;
+	}
+	
+	*out = slot->item;
+	__sync_synchronize();
+	slot->seq = pos + NONCE_VERIFY_QUEUE_SIZE;
+	
+	return true;
+}
+
+static
+bool nonce_verify_same_header(const struct work * const a, const struct work * const b)
+{
+	return !(memcmp(a->data, b->data, 76) || memcmp(a->target, b->target, sizeof(a->target)));
+}
+
+static
+void nonce_verify_items(struct nonce_verify_item * const items, const int count)
+{
+	uint32_t nonces[NONCE_VERIFY_BATCH_SIZE];
+	unsigned char hashes[NONCE_VERIFY_BATCH_SIZE * 32];
+	enum test_nonce2_result results[NONCE_VERIFY_BATCH_SIZE];
+	struct nonce_verify_item *group[NONCE_VERIFY_BATCH_SIZE];
+	bool done[NONCE_VERIFY_BATCH_SIZE] = {false};
+	struct work *work;
+	int n;
+	
+	for (int i = 0; i < count; ++i)
+	{
+		if (done[i])
+			continue;
+		work = items[i].work;
+#ifdef USE_SCRYPT
+		if (opt_scrypt)
+		{
+			const uint32_t nonce = le32toh(*(uint32_t *)(work->data + 64 + 12));
+			submit_tested_nonce(items[i].thr, work, test_nonce2(work, nonce), &items[i].tv_work_found, true);
+			continue;
+		}
+#endif
+		
+		// Collect the rest of the batch sharing this header, so the setup is only done once
+		n = 0;
+		for (int j = i; j < count; ++j)
+		{
+			if (done[j] || (j != i && !nonce_verify_same_header(work, items[j].work)))
+				continue;
+			done[j] = true;
+			group[n] = &items[j];
+			nonces[n++] = le32toh(*(uint32_t *)(items[j].work->data + 64 + 12));
+		}
+		
+		hashtest2_batch(work, nonces, n, hashes, results, true);
+		for (int j = 0; j < n; ++j)
+		{
+			memcpy(group[j]->work->hash, &hashes[j * 32], 32);
+			submit_tested_nonce(group[j]->thr, group[j]->work, results[j], &group[j]->tv_work_found, true);
+		}
+	}
+	bfg_atomic_add_u64(&nonce_verify_done, count);
+}
+
+static
+void *nonce_verify_thread(__maybe_unused void *userdata)
+{
+	struct nonce_verify_item items[NONCE_VERIFY_BATCH_SIZE];
+	int n;
+	
+	RenameThread("verify");
+	
+	while (!nonce_verify_stopping)
+	{
+		for (n = 0; n < NONCE_VERIFY_BATCH_SIZE && nonce_verify_pop(&items[n]); ++n)
+		{}
+		if (n)
+		{
+			nonce_verify_items(items, n);
+			continue;
+		}
+		
+		__sync_add_and_fetch(&nonce_verify_idle, 1);
+		if (!nonce_verify_pop(&items[0]))
+			notifier_read(nonce_verify_notifier);
+		else
+			n = 1;
+		__sync_sub_and_fetch(&nonce_verify_idle, 1);
+		if (n)
+			nonce_verify_items(items, n);
+	}
+	
+	return NULL;
+}
+
+static
+void start_nonce_verifiers(void)
+{
+	if (!opt_verify_threads)
+		return;
+	
+	for (int i = 0; i < NONCE_VERIFY_QUEUE_SIZE; ++i)
+		nonce_verify_queue[i].seq = i;
+	notifier_init(nonce_verify_notifier);
+	
+	nonce_verify_pth = malloc(sizeof(*nonce_verify_pth) * opt_verify_threads);
+	if (unlikely(!nonce_verify_pth))
+		quit(1, "Failed to malloc nonce verify threads");
+	for (int i = 0; i < opt_verify_threads; ++i)
+		if (unlikely(pthread_create(&nonce_verify_pth[i], NULL, nonce_verify_thread, NULL)))
+			quit(1, "nonce verify thread create failed");
+	applog(LOG_DEBUG, "Started %d nonce verify threads", opt_verify_threads);
+}
+
+/* Called once the mining threads are gone; shares can no longer be submitted
+ * by then, so whatever is still queued is just freed */
+static
+void stop_nonce_verifiers(void)
+{
+	struct nonce_verify_item item;
+	int dropped = 0;
+	
+	if (!nonce_verify_pth)
+		return;
+	
+	nonce_verify_stopping = true;
+	for (int i = 0; i < opt_verify_threads; ++i)
+		notifier_wake(nonce_verify_notifier);
+	for (int i = 0; i < opt_verify_threads; ++i)
+		pthread_join(nonce_verify_pth[i], NULL);
+	free(nonce_verify_pth);
+	nonce_verify_pth = NULL;
+	
+	while (nonce_verify_pop(&item))
+	{
+		free_work(item.work);
+		++dropped;
+	}
+	if (dropped)
+		applog(LOG_DEBUG, "Dropped %d nonces still queued for verification", dropped);
+}
+
+/* Like submit_noffset_nonce, but hands the nonce off to the verifier threads
+ * when --verify-threads is in use. Since the outcome is not known by the time
+ * this returns, drivers needing it should stick to submit_noffset_nonce. */
+void submit_noffset_nonce_async(struct thr_info * const thr, struct work * const work_in, const uint32_t nonce, const int noffset)
+{
+	struct nonce_verify_item item = {
+		.thr = thr,
+	};
+
+	if (unlikely(thr->hw_errors_deferred))
+		run_deferred_hw_errors(thr);
+	
+	if (!opt_verify_threads)
+	{
+		submit_noffset_nonce(thr, work_in, nonce, noffset);
+		return;
+	}
+	
+	cgtime(&item.tv_work_found);
+	item.work = prepare_noffset_nonce(thr, work_in, nonce, noffset);
+	if (likely(nonce_verify_push(&item)))
+		return;
+	
+	// Queue is full, so the device thread has to verify it itself
+	bfg_atomic_add_u64(&nonce_verify_overflows, 1);
+	thread_reportout(thr);
+	submit_tested_nonce(thr, item.work, test_nonce2(item.work, nonce), &item.tv_work_found, false);
+	thread_reportin(thr);
+}
+
+bool get_nonce_verify_stats(unsigned * const out_depth, uint64_t * const out_done, uint64_t * const out_overflows)
+{
+	if (!opt_verify_threads)
+		return false;
+	*out_depth = nonce_verify_tail - nonce_verify_head;
+	*out_done = bfg_atomic_load_u64(&nonce_verify_done);
+	*out_overflows = bfg_atomic_load_u64(&nonce_verify_overflows);
+	return true;
+}
+
 bool abandon_work(struct work *work, struct timeval *wdiff, uint64_t hashes)
 {
 	if (wdiff->tv_sec > opt_scantime ||
@@ -10042,6 +11147,8 @@ void print_summary(void)
 	);
 	applog(LOG_WARNING, "Accepted difficulty shares: %1.f", total_diff_accepted);
 	applog(LOG_WARNING, "Rejected difficulty shares: %1.f", total_diff_rejected);
+	int hw_errors;
+	get_share_totals(NULL, &hw_errors, NULL);
 	applog(LOG_WARNING, "Hardware errors: %d", hw_errors);
 	applog(LOG_WARNING, "Network transfer: %s  (%s)",
 	       multi_format_unit2(xfer, sizeof(xfer), true, "B", H2B_SPACED, " / ", 2,
@@ -10130,6 +11237,12 @@ void _bfg_clean_up(bool restarting)
 #ifdef WIN32
 	timeEndPeriod(1);
 #endif
+	// Anything logged from here on is written synchronously
+	logging_flush();
+	if (opt_noncelog_binary)
+		binlog_flush(noncelog_file, &noncelog_lock);
+	if (opt_sharelog_binary)
+		binlog_flush(sharelog_file, &sharelog_lock);
 	if (!restarting) {
 		/* Attempting to disable curses or print a summary during a
 		 * restart can lead to a deadlock. */
@@ -11270,6 +12383,11 @@ int main(int argc, char *argv[])
 	}
 #endif
 
+	if (opt_bench_suite) {
+		bench_suite();
+		exit(0);
+	}
+
 	bfg_devapi_init();
 	drv_detect_all();
 	total_devices = total_devices_new;
@@ -11372,6 +12490,9 @@ int main(int argc, char *argv[])
 			fork_monitor();
 	#endif // defined(unix)
 
+	bfg_coarse_time_start();
+	logging_start_async();
+
 	mining_thr = calloc(mining_threads, sizeof(thr));
 	if (!mining_thr)
 		quit(1, "Failed to calloc mining_thr");
@@ -11471,6 +12592,8 @@ begin_bench:
 		localtime_r(&miner_start_ts, &schedstop .tm);
 	get_datestamp(datestamp, sizeof(datestamp), miner_start_ts);
 
+	start_nonce_verifiers();
+
 	// Initialise processors and threads
 	k = 0;
 	for (i = 0; i < total_devices; ++i) {
@@ -11530,6 +12653,8 @@ begin_bench:
 		quit(1, "reinit_gpu thread create failed");
 #endif	
 
+	statshm_init();
+
 	/* Create API socket thread */
 	api_thr_id = 4;
 	thr = &control_thr[api_thr_id];
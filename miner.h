@@ -414,6 +414,9 @@ struct cgminer_stats {
 	struct timeval _get_start;
 };
 
+#define SUBMIT_LATENCY_BUCKETS 8
+extern const double submit_latency_bucket_secs[SUBMIT_LATENCY_BUCKETS];
+
 // Just the actual network getworks to the pool
 struct cgminer_pool_stats {
 	uint32_t getwork_calls;
@@ -437,6 +440,11 @@ struct cgminer_pool_stats {
 	uint64_t times_received;
 	uint64_t bytes_received;
 	uint64_t net_bytes_received;
+
+	// Time from sending a share to the pool's reply, as a histogram
+	volatile uint64_t submit_latency_count;
+	volatile uint64_t submit_latency_us;
+	volatile uint64_t submit_latency_bucket[SUBMIT_LATENCY_BUCKETS];
 };
 
 #define PRIprepr "-6s"
@@ -501,6 +509,8 @@ struct cgpu_info {
 	int stale;
 	int bad_nonces;
 	int hw_errors;
+	// rolling and total_mhashes are updated under hashmeter_lock
+	pthread_mutex_t hashmeter_lock;
 	double rolling;
 	double total_mhashes;
 	double utility;
@@ -657,6 +667,9 @@ struct thr_info {
 	struct work *work_list;
 	bool queue_full;
 
+	// hw_error callbacks for this thread left by the verifier threads, see run_deferred_hw_errors
+	volatile int hw_errors_deferred;
+
 	bool	work_restart;
 	notifier_t work_restart_notifier;
 };
@@ -944,7 +957,13 @@ extern bool use_curses;
 extern bool have_libusb;
 #endif
 extern int httpsrv_port;
+extern int opt_httpsrv_threads;
+extern bool opt_httpsrv_prefetch;
 extern int stratumsrv_port;
+extern int opt_stratumsrv_vardiff;
+extern int opt_stratumsrv_clients;
+extern int opt_stratumsrv_xnonce2sz;
+extern int opt_stratumsrv_threads;
 extern char *opt_api_allow;
 extern bool opt_api_mcast;
 extern char *opt_api_mcast_addr;
@@ -999,6 +1018,7 @@ extern int opt_expiry;
 extern cglock_t control_lock;
 extern pthread_mutex_t stats_lock;
 extern pthread_mutex_t hash_lock;
+extern pthread_mutex_t pools_lock;
 extern pthread_mutex_t console_lock;
 extern cglock_t ch_lock;
 extern pthread_rwlock_t mining_thr_lock;
@@ -1052,6 +1072,7 @@ extern int set_memoryclock(int gpu, int iMemoryClock);
 #endif
 
 extern void api(int thr_id);
+extern void api_stats_publish(void);
 
 extern struct pool *current_pool(void);
 extern int enabled_pools;
@@ -1092,7 +1113,6 @@ extern bool opt_force_dev_init;
 extern int nDevs;
 extern int opt_n_threads;
 extern int num_processors;
-extern int hw_errors;
 extern bool use_syslog;
 extern bool opt_quiet;
 extern struct thr_info *control_thr;
@@ -1119,10 +1139,10 @@ extern enum pool_strategy pool_strategy;
 extern int opt_rotate_period;
 extern double total_rolling;
 extern double total_mhashes_done;
+extern void hashmeter_flush_pending(void);
 extern unsigned int new_blocks;
 extern unsigned int found_blocks;
-extern int total_accepted, total_rejected, total_diff1;;
-extern int total_bad_nonces;
+extern int total_accepted, total_rejected;
 extern int total_getworks, total_stale, total_discarded;
 extern uint64_t total_bytes_rcvd, total_bytes_sent;
 #define total_bytes_xfer (total_bytes_rcvd + total_bytes_sent)
@@ -1319,6 +1339,8 @@ struct pool {
 	bool stratum_init;
 	bool stratum_notify;
 	struct stratum_work swork;
+	/* Bytes of shares formatted for this round's write; submit thread only */
+	size_t stratum_batch_len;
 	pthread_t stratum_thread;
 	pthread_mutex_t stratum_lock;
 	char *admin_msg;
@@ -1407,18 +1429,32 @@ extern void gen_stratum_work2(struct work *, struct stratum_work *, const char *
 extern void inc_hw_errors2(struct thr_info *thr, const struct work *work, const uint32_t *bad_nonce_p);
 #define UNKNOWN_NONCE ((uint32_t*)inc_hw_errors2)
 extern void inc_hw_errors(struct thr_info *, const struct work *, const uint32_t bad_nonce);
+extern void run_deferred_hw_errors(struct thr_info *);
 #define inc_hw_errors_only(thr)  inc_hw_errors(thr, NULL, 0)
+extern void get_share_totals(int *out_diff1, int *out_hw_errors, int *out_bad_nonces);
+extern int total_staged(void);
+extern char *opt_stats_file;
+extern void statshm_init(void);
+extern void statshm_update_proc(struct cgpu_info *);
+extern void statshm_update_pool(struct pool *);
+extern void statshm_update_global(int diff1, int hw_errors);
 enum test_nonce2_result {
 	TNR_GOOD = 1,
 	TNR_HIGH = 0,
 	TNR_BAD = -1,
 };
+extern enum test_nonce2_result hashtest2(struct work *, bool checktarget);
+extern void hashtest2_batch(const struct work *, const uint32_t *nonces, unsigned count, unsigned char *hashes, enum test_nonce2_result *results, bool checktarget);
 extern enum test_nonce2_result _test_nonce2(struct work *, uint32_t nonce, bool checktarget);
 #define test_nonce(work, nonce, checktarget)  (_test_nonce2(work, nonce, checktarget) == TNR_GOOD)
 #define test_nonce2(work, nonce)  (_test_nonce2(work, nonce, true))
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
 extern bool submit_noffset_nonce(struct thr_info *thr, struct work *work, uint32_t nonce,
 			  int noffset);
+extern void submit_noffset_nonce_async(struct thr_info *, struct work *, uint32_t nonce, int noffset);
+extern double submit_nonce_min_diff(struct thr_info *, struct work *, uint32_t nonce, double min_diff);
+#define submit_nonce_async(thr, work, nonce)  submit_noffset_nonce_async(thr, work, nonce, 0)
+extern bool get_nonce_verify_stats(unsigned *out_depth, uint64_t *out_done, uint64_t *out_overflows);
 extern void __add_queued(struct cgpu_info *cgpu, struct work *work);
 extern struct work *get_queued(struct cgpu_info *cgpu);
 extern void add_queued(struct cgpu_info *cgpu, struct work *work);
@@ -1465,6 +1501,7 @@ extern void adl(void);
 extern void clean_work(struct work *work);
 extern void free_work(struct work *work);
 extern void __copy_work(struct work *work, const struct work *base_work);
+extern void calc_midstate(struct work *);
 extern struct work *copy_work(const struct work *base_work);
 extern char *devpath_to_devid(const char *);
 extern struct thr_info *get_thread(int thr_id);
@@ -1504,6 +1541,8 @@ struct api_data {
 	char *name;
 	void *data;
 	bool data_was_malloc;
+	// Allocated from the API request's arena, and freed along with it
+	bool in_arena;
 	struct api_data *prev;
 	struct api_data *next;
 };
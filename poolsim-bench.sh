@@ -0,0 +1,97 @@
+#!/bin/sh
+# Copyright 2026 agent
+#
+# This program is free software; you can redistribute it and/or modify it
+# under the terms of the GNU General Public License as published by the Free
+# Software Foundation; either version 3 of the License, or (at your option)
+# any later version.  See COPYING for more details.
+
+# Runs bfgminer against bfgminer-poolsim and reports share throughput, submit
+# latency, stale rate and CPU time used by each bfgminer thread.
+#
+# Usage: poolsim-bench.sh [-t <seconds>] [-P <poolsim options>] -- <bfgminer options>
+# For example: poolsim-bench.sh -t 120 -P '-d 0.01 -l 50 -j 20' -- -S cpu:auto
+
+duration=60
+poolsim_opts=
+port=${POOLSIM_PORT:-3334}
+httpport=${POOLSIM_HTTP_PORT:-8334}
+bindir=$(dirname "$0")
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+		-t) duration=$2; shift 2 ;;
+		-P) poolsim_opts=$2; shift 2 ;;
+		--) shift; break ;;
+		*) echo "Usage: $0 [-t <seconds>] [-P <poolsim options>] -- <bfgminer options>" >&2; exit 1 ;;
+	esac
+done
+
+if [ "$duration" -lt 10 ] 2>/dev/null; then
+	echo "Run for at least 10 seconds" >&2
+	exit 1
+fi
+
+tmpdir=$(mktemp -d) || exit 1
+trap 'kill $poolsim_pid $bfgminer_pid 2>/dev/null; rm -rf "$tmpdir"' EXIT INT TERM
+
+# Word splitting of poolsim_opts is intended
+"$bindir/bfgminer-poolsim" -p "$port" -r "$duration" $poolsim_opts >"$tmpdir/poolsim.log" 2>&1 &
+poolsim_pid=$!
+sleep 1
+
+"$bindir/bfgminer" -T -o "stratum+tcp://127.0.0.1:$port" -u bench -p x --http-port "$httpport" "$@" >"$tmpdir/bfgminer.log" 2>&1 &
+bfgminer_pid=$!
+
+# Per thread name: total utime+stime in clock ticks
+cputicks() {
+	for stat in /proc/$bfgminer_pid/task/*/stat; do
+		cat "$stat" 2>/dev/null
+	done | sed 's/^[0-9]* (\(.*\)) /\1\t/' | awk -F'\t' '{
+		split($2, f, " ");
+		# utime and stime are fields 14 and 15 of stat, 12 and 13 after the comm
+		t[$1] += f[12] + f[13];
+	} END { for (n in t) print n "\t" t[n] }'
+}
+
+# Let connections and work queues settle before measuring
+sleep 5
+cputicks >"$tmpdir/cpu0"
+sleep $((duration - 5))
+cputicks >"$tmpdir/cpu1"
+metrics=$(curl -s "http://127.0.0.1:$httpport/metrics" 2>/dev/null || wget -qO- "http://127.0.0.1:$httpport/metrics" 2>/dev/null)
+
+kill $bfgminer_pid 2>/dev/null
+wait $bfgminer_pid 2>/dev/null
+# The simulator prints its summary on exit
+kill $poolsim_pid 2>/dev/null
+wait $poolsim_pid 2>/dev/null
+
+echo "Pool simulator:"
+sed -n '/^Elapsed:/,$p' "$tmpdir/poolsim.log"
+
+echo
+echo "Submit latency (from bfgminer, bounded by histogram buckets):"
+echo "$metrics" | awk '
+	/^bfgminer_pool_submit_latency_seconds_bucket/ {
+		le = $0; sub(/.*le="/, "", le); sub(/".*/, "", le);
+		bucket[n] = le; count[n++] = $NF;
+	}
+	END {
+		total = count[n - 1];
+		if (!total) { print "  no replies"; exit }
+		split("50 90 99", pct, " ");
+		for (p = 1; p <= 3; ++p) {
+			for (i = 0; i < n && count[i] < total * pct[p] / 100; ++i) ;
+			printf "  p%s: <= %s s\n", pct[p], bucket[i];
+		}
+	}'
+echo "$metrics" | awk '/^bfgminer_(accepted|rejected|stale)_total / { sub(/^bfgminer_/, ""); sub(/_total/, ""); printf "  bfgminer %s: %s\n", $1, $2 }'
+
+echo
+echo "CPU time per bfgminer thread over the last $((duration - 5)) seconds:"
+hz=$(getconf CLK_TCK)
+awk -F'\t' -v hz="$hz" -v secs=$((duration - 5)) '
+	NR == FNR { t0[$1] = $2; next }
+	{ d = ($2 - t0[$1]) / hz; printf "  %-16s %8.2f s %6.1f%%\n", $1, d, d * 100 / secs }
+' "$tmpdir/cpu0" "$tmpdir/cpu1" | sort -k2 -rn
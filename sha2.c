@@ -131,6 +131,44 @@ void sha256_transf(sha256_ctx *ctx, const unsigned char *message,
     }
 }
 
+void sha256_transf_words(uint32_t *state, const uint32_t *block)
+{
+    uint32_t w[64];
+    uint32_t wv[8];
+    uint32_t t1, t2;
+    int j;
+
+    for (j = 0; j < 16; j++) {
+        w[j] = block[j];
+    }
+
+    for (j = 16; j < 64; j++) {
+        SHA256_SCR(j);
+    }
+
+    for (j = 0; j < 8; j++) {
+        wv[j] = state[j];
+    }
+
+    for (j = 0; j < 64; j++) {
+        t1 = wv[7] + SHA256_F2(wv[4]) + CH(wv[4], wv[5], wv[6])
+            + sha256_k[j] + w[j];
+        t2 = SHA256_F1(wv[0]) + MAJ(wv[0], wv[1], wv[2]);
+        wv[7] = wv[6];
+        wv[6] = wv[5];
+        wv[5] = wv[4];
+        wv[4] = wv[3] + t1;
+        wv[3] = wv[2];
+        wv[2] = wv[1];
+        wv[1] = wv[0];
+        wv[0] = t1 + t2;
+    }
+
+    for (j = 0; j < 8; j++) {
+        state[j] += wv[j];
+    }
+}
+
 void sha256(const unsigned char *message, unsigned int len, unsigned char *digest)
 {
     sha256_ctx ctx;
@@ -61,9 +61,12 @@ typedef struct {
     uint32_t h[8];
 } sha256_ctx;
 
+extern uint32_t sha256_h0[8];
 extern uint32_t sha256_k[64];
 
 void sha256_init(sha256_ctx * ctx);
+/* Compresses a single block, already packed into 16 big endian words, into state */
+void sha256_transf_words(uint32_t *state, const uint32_t *block);
 void sha256_update(sha256_ctx *ctx, const unsigned char *message,
                    unsigned int len);
 void sha256_final(sha256_ctx *ctx, unsigned char *digest);
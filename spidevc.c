@@ -51,6 +51,7 @@
 #endif
 
 #include "logging.h"
+#include "util.h"
 
 #ifdef HAVE_LINUX_SPI
 bool sys_spi_txrx(struct spi_port *port);
@@ -199,22 +200,43 @@ bool sys_spi_txrx(struct spi_port *port)
 
 #endif
 
+// Reverses the bit order in each byte of a 32-bit word
+static inline
+uint32_t spi_bitrev_bytes32(uint32_t v)
+{
+	v = ((v & 0xaaaaaaaa) >> 1) | ((v & 0x55555555) << 1);
+	v = ((v & 0xcccccccc) >> 2) | ((v & 0x33333333) << 2);
+	v = ((v & 0xf0f0f0f0) >> 4) | ((v & 0x0f0f0f0f) << 4);
+	return v;
+}
+
+static
+void spi_bitrev_copy(void * const dst, const void * const src, const size_t sz)
+{
+	unsigned char *out = dst;
+	const unsigned char *in = src;
+	size_t i;
+	uint32_t w;
+	
+	// Reverse bit order in each byte, a word at a time
+	for (i = 0; i + 4 <= sz; i += 4)
+	{
+		memcpy(&w, &in[i], 4);
+		w = spi_bitrev_bytes32(w);
+		memcpy(&out[i], &w, 4);
+	}
+	for ( ; i < sz; ++i)
+		out[i] = spi_bitrev_bytes32(in[i]);
+}
+
 static
 void *spi_emit_buf_reverse(struct spi_port *port, const void *p, size_t sz)
 {
-	const unsigned char *str = p;
 	void * const rv = &port->spibuf_rx[port->spibufsz];
 	if (port->spibufsz + sz >= SPIMAXSZ)
 		return NULL;
-	for (size_t i = 0; i < sz; ++i)
-	{
-		// Reverse bit order in each byte!
-		unsigned char p = str[i];
-		p = ((p & 0xaa)>>1) | ((p & 0x55) << 1);
-		p = ((p & 0xcc)>>2) | ((p & 0x33) << 2);
-		p = ((p & 0xf0)>>4) | ((p & 0x0f) << 4);
-		port->spibuf[port->spibufsz++] = p;
-	}
+	spi_bitrev_copy(&port->spibuf[port->spibufsz], p, sz);
+	port->spibufsz += sz;
 	return rv;
 }
 
@@ -264,6 +286,41 @@ void *spi_emit_data(struct spi_port *port, uint16_t addr, const void *buf, size_
 	return spi_emit_buf_reverse(port, buf, len*4);
 }
 
+void spi_patch_data(struct spi_port * const port, const size_t txoff, const void * const buf, const void * const oldbuf, const size_t len)
+{
+	const uint32_t *nw = buf, *ow = oldbuf;
+	unsigned char * const tx = (void*)&port->spibuf[txoff];
+	
+	if (txoff + len > port->spibufsz)
+		return;
+	for (size_t i = 0; i < len / 4; ++i)
+		if (nw[i] != ow[i])
+			spi_bitrev_copy(&tx[i * 4], &nw[i], 4);
+}
+
+void spi_stat_update(struct spi_port * const port)
+{
+	struct timeval tv_now;
+	unsigned long txns, bytes;
+	long us;
+	
+	timer_set_now(&tv_now);
+	txns = port->stat_txns;
+	bytes = port->stat_bytes;
+	if (!port->stat_tv.tv_sec)
+		goto reset;
+	us = timer_elapsed_us(&port->stat_tv, &tv_now);
+	if (us < SPI_STAT_WINDOW_MS * 1000L)
+		return;
+	port->stat_txns_sec = (txns - port->stat_prev_txns) * 1e6 / us;
+	port->stat_bytes_sec = (bytes - port->stat_prev_bytes) * 1e6 / us;
+	
+reset:
+	port->stat_tv = tv_now;
+	port->stat_prev_txns = txns;
+	port->stat_prev_bytes = bytes;
+}
+
 #ifdef USE_BFSB
 void spi_bfsb_select_bank(int bank)
 {
@@ -4,8 +4,10 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 #define SPIMAXSZ (256*1024)
+#define SPI_STAT_WINDOW_MS  10000
 
 /* Initialize SPI using this function */
 void spi_init(void);
@@ -28,6 +30,20 @@ struct spi_port {
 	uint16_t delay;
 	uint8_t mode;
 	uint8_t bits;
+	
+	/* Incremented each time the TX buffer is cleared, so callers can tell if a transaction they built is still intact */
+	unsigned long bufgen;
+	
+	/* Statistics, maintained by spi_txrx; these wrap around, so only use differences */
+	unsigned long stat_txns;
+	unsigned long stat_bytes;
+	
+	/* Rates over the last SPI_STAT_WINDOW_MS, maintained by spi_stat_update */
+	struct timeval stat_tv;
+	unsigned long stat_prev_txns;
+	unsigned long stat_prev_bytes;
+	float stat_txns_sec;
+	float stat_bytes_sec;
 };
 
 extern struct spi_port *sys_spi;
@@ -38,6 +54,7 @@ static inline
 void spi_clear_buf(struct spi_port *port)
 {
 	port->spibufsz = 0;
+	++port->bufgen;
 }
 
 static inline
@@ -72,12 +89,22 @@ extern void spi_emit_nop(struct spi_port *port, int n);
    transmission quantum is 32 bits */
 extern void *spi_emit_data(struct spi_port *port, uint16_t addr, const void *buf, size_t len);
 
+/* REWRITE DATA PREVIOUSLY EMITTED BY spi_emit_data */
+/* txoff is the offset of the data in the TX buffer (ie, its RX pointer minus spi_getrxbuf)
+   oldbuf is what was last emitted there; only 32-bit words which differ from buf are rewritten */
+extern void spi_patch_data(struct spi_port *port, size_t txoff, const void *buf, const void *oldbuf, size_t len);
+
 static inline
 bool spi_txrx(struct spi_port *port)
 {
+	__sync_add_and_fetch(&port->stat_txns, 1);
+	__sync_add_and_fetch(&port->stat_bytes, port->spibufsz);
 	return port->txrx(port);
 }
 
+/* Recalculates stat_txns_sec and stat_bytes_sec once SPI_STAT_WINDOW_MS has passed; only call from the thread doing I/O on the port */
+extern void spi_stat_update(struct spi_port *port);
+
 extern bool sys_spi_txrx(struct spi_port *);
 
 void spi_bfsb_select_bank(int bank);
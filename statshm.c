@@ -0,0 +1,252 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#endif
+
+#include "logging.h"
+#include "miner.h"
+#include "statshm.h"
+#include "util.h"
+
+// Room for hotplugged processors and pools added over the API
+#define STATSHM_PROCESSOR_SLACK  64
+#define STATSHM_POOL_SLACK       32
+
+char *opt_stats_file;
+
+static struct bfg_statshm_header *statshm;
+static struct bfg_statshm_processor *statshm_procs;
+static struct bfg_statshm_pool *statshm_pools;
+
+static
+void statshm_write_begin(volatile uint32_t * const seqp)
+{
+	uint32_t seq;
+	
+	// Several threads may update the same record, so take it like a spinlock
+	while (true)
+	{
+		seq = *seqp;
+		if (!(seq & 1) && __sync_bool_compare_and_swap(seqp, seq, seq + 1))
+			break;
+	}
+	__sync_synchronize();
+}
+
+static
+void statshm_write_end(volatile uint32_t * const seqp)
+{
+	__sync_synchronize();
+	__sync_add_and_fetch(seqp, 1);
+}
+
+static
+void statshm_count_grow(volatile uint32_t * const countp, const uint32_t n)
+{
+	uint32_t count;
+	
+	while ((count = *countp) < n)
+		if (__sync_bool_compare_and_swap(countp, count, n))
+			break;
+}
+
+static
+enum bfg_statshm_status statshm_proc_status(const struct cgpu_info * const proc)
+{
+	if (proc->deven != DEV_ENABLED)
+		return BFG_STATSHM_DISABLED;
+	switch (proc->status)
+	{
+		case LIFE_WELL:
+			return BFG_STATSHM_ALIVE;
+		case LIFE_SICK:
+			return BFG_STATSHM_SICK;
+		case LIFE_DEAD:
+		case LIFE_DEAD2:
+			return BFG_STATSHM_DEAD;
+		default:
+			return BFG_STATSHM_OTHER;
+	}
+}
+
+void statshm_update_proc(struct cgpu_info * const proc)
+{
+	struct bfg_statshm_processor *rec;
+	const int i = proc->cgminer_id;
+	
+	if (!statshm)
+		return;
+	if (unlikely(i < 0 || (uint32_t)i >= statshm->processor_capacity))
+		return;
+	rec = &statshm_procs[i];
+	
+	statshm_write_begin(&rec->seq);
+	if (unlikely(!rec->name[0]))
+	{
+		snprintf(rec->name, sizeof(rec->name), "%s", proc->proc_repr_ns);
+		snprintf(rec->driver, sizeof(rec->driver), "%s", proc->drv->name);
+	}
+	rec->status = statshm_proc_status(proc);
+	rec->updated = time(NULL);
+	rec->total_mhashes = proc->total_mhashes;
+	rec->rolling_mhs = proc->rolling;
+	rec->accepted = proc->accepted;
+	rec->rejected = proc->rejected;
+	rec->stale = proc->stale;
+	rec->hw_errors = proc->hw_errors;
+	rec->diff1 = proc->diff1;
+	rec->diff_accepted = proc->diff_accepted;
+	rec->diff_rejected = proc->diff_rejected;
+	rec->diff_stale = proc->diff_stale;
+	rec->temp = proc->temp;
+	statshm_write_end(&rec->seq);
+	
+	statshm_count_grow(&statshm->processor_count, i + 1);
+}
+
+void statshm_update_pool(struct pool * const pool)
+{
+	struct bfg_statshm_pool *rec;
+	const int i = pool->pool_no;
+	
+	if (!statshm)
+		return;
+	if (unlikely(i < 0 || (uint32_t)i >= statshm->pool_capacity))
+		return;
+	rec = &statshm_pools[i];
+	
+	statshm_write_begin(&rec->seq);
+	// Pools get renumbered when one is removed, so always refresh the URL
+	rec->pool_no = i;
+	snprintf(rec->url, sizeof(rec->url), "%s", pool->rpc_url ?: "");
+	rec->alive = (pool->enabled == POOL_ENABLED && !pool->idle);
+	rec->updated = time(NULL);
+	rec->accepted = pool->accepted;
+	rec->rejected = pool->rejected;
+	rec->stale = pool->stale_shares;
+	rec->getworks = pool->getwork_requested;
+	rec->diff1 = pool->diff1;
+	rec->diff_accepted = pool->diff_accepted;
+	rec->diff_rejected = pool->diff_rejected;
+	rec->diff_stale = pool->diff_stale;
+	statshm_write_end(&rec->seq);
+	
+	statshm_count_grow(&statshm->pool_count, i + 1);
+}
+
+// Called from hashmeter with hash_lock held
+void statshm_update_global(const int diff1, const int hw_errors)
+{
+	struct bfg_statshm_global *rec;
+	int i;
+	
+	if (!statshm)
+		return;
+	rec = &statshm->global;
+	
+	statshm_write_begin(&rec->seq);
+	rec->updated = time(NULL);
+	rec->elapsed = total_secs;
+	rec->total_mhashes = total_mhashes_done;
+	rec->rolling_mhs = total_rolling;
+	rec->accepted = total_accepted;
+	rec->rejected = total_rejected;
+	rec->stale = total_stale;
+	rec->hw_errors = hw_errors;
+	rec->diff1 = diff1;
+	rec->diff_accepted = total_diff_accepted;
+	rec->diff_rejected = total_diff_rejected;
+	rec->diff_stale = total_diff_stale;
+	rec->getworks = total_getworks;
+	statshm_write_end(&rec->seq);
+	
+	// Pool status (alive, URL) changes without any share accounting
+	for (i = 0; i < total_pools; ++i)
+		statshm_update_pool(pools[i]);
+}
+
+void statshm_init(void)
+{
+	if (!(opt_stats_file && opt_stats_file[0]))
+		return;
+
+#ifdef WIN32
+	applog(LOG_ERR, "Stats file is not supported on this platform");
+#else
+	const uint32_t proc_capacity = total_devices + STATSHM_PROCESSOR_SLACK;
+	const uint32_t pool_capacity = total_pools + STATSHM_POOL_SLACK;
+	const size_t proc_offset = (sizeof(*statshm) + 63) & ~(size_t)63;
+	const size_t pool_offset = proc_offset + proc_capacity * sizeof(*statshm_procs);
+	const size_t len = pool_offset + pool_capacity * sizeof(*statshm_pools);
+	struct bfg_statshm_header *hdr;
+	int fd, i;
+	
+	// Replace rather than truncate, so readers still mapping an old file don't fault
+	unlink(opt_stats_file);
+	fd = open(opt_stats_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		applog(LOG_ERR, "Failed to open stats file %s: %s", opt_stats_file, bfg_strerror(errno, BST_ERRNO));
+		return;
+	}
+	if (ftruncate(fd, len))
+	{
+		applog(LOG_ERR, "Failed to size stats file %s: %s", opt_stats_file, bfg_strerror(errno, BST_ERRNO));
+		close(fd);
+		return;
+	}
+	hdr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+	{
+		applog(LOG_ERR, "Failed to map stats file %s: %s", opt_stats_file, bfg_strerror(errno, BST_ERRNO));
+		return;
+	}
+	
+	// ftruncate leaves everything zeroed, so only the header needs filling in
+	hdr->version = BFG_STATSHM_VERSION;
+	hdr->header_size = sizeof(*hdr);
+	hdr->processor_record_size = sizeof(*statshm_procs);
+	hdr->pool_record_size = sizeof(*statshm_pools);
+	hdr->processor_capacity = proc_capacity;
+	hdr->pool_capacity = pool_capacity;
+	hdr->processor_offset = proc_offset;
+	hdr->pool_offset = pool_offset;
+	hdr->started = time(NULL);
+	hdr->pid = getpid();
+	statshm_procs = (void*)&((uint8_t*)hdr)[proc_offset];
+	statshm_pools = (void*)&((uint8_t*)hdr)[pool_offset];
+	// Readers only trust the header once the magic appears
+	__sync_synchronize();
+	hdr->magic = BFG_STATSHM_MAGIC;
+	statshm = hdr;
+	
+	for (i = 0; i < total_devices; ++i)
+		statshm_update_proc(get_devices(i));
+	for (i = 0; i < total_pools; ++i)
+		statshm_update_pool(pools[i]);
+	
+	applog(LOG_DEBUG, "Stats file %s mapped (%lu bytes)", opt_stats_file, (unsigned long)len);
+#endif
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright 2026 agent
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/*
+ * Layout of the --stats-file shared memory region. The file starts with a
+ * bfg_statshm_header, followed by processor_capacity processor records and
+ * pool_capacity pool records at the offsets given in the header. Readers
+ * must check the magic and version, and use the record sizes and offsets
+ * from the header rather than sizeof, so fields can be added at the end of
+ * the records without breaking them.
+ *
+ * Each record (and the global totals in the header) is protected by a
+ * seqlock: seq is odd while the miner is updating it, and changes with every
+ * update. Use bfg_statshm_read to get a consistent copy.
+ *
+ * All values are in the miner's native byte order.
+ */
+
+#ifndef BFG_STATSHM_H
+#define BFG_STATSHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BFG_STATSHM_MAGIC    0x53474642  /* "BFGS" in little endian */
+#define BFG_STATSHM_VERSION  1
+
+struct bfg_statshm_global {
+	uint32_t seq;
+	uint32_t _pad;
+	int64_t updated;  // seconds since the epoch
+	double elapsed;   // seconds since mining started
+	double total_mhashes;
+	double rolling_mhs;
+	int64_t accepted;
+	int64_t rejected;
+	int64_t stale;
+	int64_t hw_errors;
+	int64_t diff1;
+	double diff_accepted;
+	double diff_rejected;
+	double diff_stale;
+	int64_t getworks;
+};
+
+struct bfg_statshm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t processor_record_size;
+	uint32_t pool_record_size;
+	uint32_t processor_capacity;
+	uint32_t pool_capacity;
+	// Records in use; only ever grow while the miner runs
+	uint32_t processor_count;
+	uint32_t pool_count;
+	uint32_t processor_offset;
+	uint32_t pool_offset;
+	uint32_t _pad;
+	int64_t started;  // seconds since the epoch
+	int32_t pid;
+	uint32_t _pad2;
+	struct bfg_statshm_global global;
+};
+
+enum bfg_statshm_status {
+	BFG_STATSHM_DISABLED,
+	BFG_STATSHM_ALIVE,
+	BFG_STATSHM_SICK,
+	BFG_STATSHM_DEAD,
+	BFG_STATSHM_OTHER,
+};
+
+struct bfg_statshm_processor {
+	uint32_t seq;
+	int32_t status;  // enum bfg_statshm_status
+	char name[16];   // e.g. "BFL 0a", as shown by the miner
+	char driver[8];
+	int64_t updated;
+	double total_mhashes;
+	double rolling_mhs;
+	int64_t accepted;
+	int64_t rejected;
+	int64_t stale;
+	int64_t hw_errors;
+	int64_t diff1;
+	double diff_accepted;
+	double diff_rejected;
+	double diff_stale;
+	float temp;  // 0 if unknown
+	uint32_t _pad;
+};
+
+struct bfg_statshm_pool {
+	uint32_t seq;
+	int32_t pool_no;
+	char url[128];
+	int32_t alive;  // enabled and not idle
+	uint32_t _pad;
+	int64_t updated;
+	int64_t accepted;
+	int64_t rejected;
+	int64_t stale;
+	int64_t getworks;
+	int64_t diff1;
+	double diff_accepted;
+	double diff_rejected;
+	double diff_stale;
+};
+
+// Copies a record of len bytes out of the region consistently; returns false if the miner kept it busy
+static inline
+bool bfg_statshm_read(void * const out, const volatile void * const rec, const size_t len)
+{
+	const volatile uint32_t * const seqp = rec;
+	uint32_t seq;
+	int tries;
+	
+	for (tries = 0; tries < 1000; ++tries)
+	{
+		seq = *seqp;
+		if (seq & 1)
+			continue;
+		__sync_synchronize();
+		memcpy(out, (const void *)rec, len);
+		__sync_synchronize();
+		if (*seqp == seq)
+			return true;
+	}
+	return false;
+}
+
+#endif
@@ -57,6 +57,7 @@
 #endif
 #include "miner.h"
 #include "compat.h"
+#include "sha2.h"
 #include "util.h"
 
 #define DEFAULT_SOCKWAIT 60
@@ -769,6 +770,62 @@ void hash_data(unsigned char *out_hash, const unsigned char *data)
 	gen_hash(blkheader, out_hash, 80);
 }
 
+static
+void hash_data_midstate_prepare(uint32_t * const state, uint32_t * const block, const unsigned char * const midstate, const unsigned char * const data)
+{
+	// midstate is the state after the first 64 bytes; data is byteswapped per 32-bit word, so little endian loads give the big endian SHA256 words
+	for (int i = 0; i < 8; ++i)
+		state[i] = le32toh(((const uint32_t *)midstate)[i]);
+	for (int i = 0; i < 4; ++i)
+		block[i] = le32toh(((const uint32_t *)data)[16 + i]);
+	block[4] = 0x80000000;
+	memset(&block[5], 0, 10 * 4);
+	block[15] = 80 * 8;
+}
+
+static
+void hash_data_midstate_finish(unsigned char * const out_hash, const uint32_t * const midstate, const uint32_t * const block1)
+{
+	uint32_t state[8], block[16];
+	
+	memcpy(state, midstate, sizeof(state));
+	sha256_transf_words(state, block1);
+	
+	// Second SHA256 is of the 32-byte first hash
+	memcpy(block, state, 32);
+	block[8] = 0x80000000;
+	memset(&block[9], 0, 6 * 4);
+	block[15] = 32 * 8;
+	memcpy(state, sha256_h0, sizeof(state));
+	sha256_transf_words(state, block);
+	
+	for (int i = 0; i < 8; ++i)
+		state[i] = htobe32(state[i]);
+	memcpy(out_hash, state, 32);
+}
+
+// Same result as hash_data, but skips the first SHA256 block by starting from its midstate
+void hash_data_midstate(unsigned char *out_hash, const unsigned char *midstate, const unsigned char *data)
+{
+	uint32_t state[8], block[16];
+	
+	hash_data_midstate_prepare(state, block, midstate, data);
+	hash_data_midstate_finish(out_hash, state, block);
+}
+
+// Hashes the same header with each of count nonces, sharing the setup
+void hash_data_midstate_nonces(unsigned char *out_hashes, const unsigned char *midstate, const unsigned char *data, const uint32_t *nonces, unsigned count)
+{
+	uint32_t state[8], block[16];
+	
+	hash_data_midstate_prepare(state, block, midstate, data);
+	for (unsigned i = 0; i < count; ++i)
+	{
+		block[3] = nonces[i];
+		hash_data_midstate_finish(&out_hashes[i * 32], state, block);
+	}
+}
+
 // Example output: 0000000000000000000000000000000000000000000000000000ffff00000000 (bdiff 1)
 void real_block_target(unsigned char *target, const unsigned char *data)
 {
@@ -1245,6 +1302,163 @@ void bfg_init_time()
 #endif
 }
 
+/* Coarse time service: a ticker thread caches the timer clock, the wall clock
+ * and the current datestamp every BFG_COARSE_TIME_MS, so hot paths that don't
+ * need better precision can read them instead of making clock calls (and
+ * calling localtime_r). Two copies are kept, and readers retry if the ticker
+ * published a new one while they were reading. */
+
+struct bfg_coarse_time {
+	struct timeval tv_timer;
+	time_t now;
+	char datestamp[24];
+};
+
+static struct bfg_coarse_time coarse_time[2];
+static volatile unsigned coarse_time_seq;
+static bool coarse_time_running;
+static unsigned long coarse_time_calls;
+
+static
+void coarse_time_read(struct bfg_coarse_time * const out, const size_t len)
+{
+	unsigned seq;
+	
+	do {
+		seq = coarse_time_seq;
+		__sync_synchronize();
+		memcpy(out, &coarse_time[seq & 1], len);
+		__sync_synchronize();
+	} while (unlikely(seq != coarse_time_seq));
+	
+	// Only counted for the debug report; races just lose a few counts
+	if (unlikely(opt_debug))
+		++coarse_time_calls;
+}
+
+void cgtime_coarse(struct timeval * const tvp)
+{
+	struct bfg_coarse_time ct;
+	
+	if (unlikely(!coarse_time_running))
+	{
+		cgtime(tvp);
+		return;
+	}
+	coarse_time_read(&ct, offsetof(struct bfg_coarse_time, now));
+	*tvp = ct.tv_timer;
+}
+
+time_t time_coarse(void)
+{
+	struct bfg_coarse_time ct;
+	
+	if (unlikely(!coarse_time_running))
+		return time(NULL);
+	coarse_time_read(&ct, offsetof(struct bfg_coarse_time, datestamp));
+	return ct.now;
+}
+
+bool get_coarse_datestamp(char * const buf, const size_t bufsz)
+{
+	struct bfg_coarse_time ct;
+	
+	if (unlikely(!coarse_time_running))
+		return false;
+	coarse_time_read(&ct, sizeof(ct));
+	snprintf(buf, bufsz, "%s", ct.datestamp);
+	return true;
+}
+
+static
+void coarse_time_update(void)
+{
+	const unsigned seq = coarse_time_seq;
+	const struct bfg_coarse_time * const cur = &coarse_time[seq & 1];
+	struct bfg_coarse_time * const next = &coarse_time[(seq + 1) & 1];
+	
+	cgtime(&next->tv_timer);
+	next->now = time(NULL);
+	if (next->now != cur->now)
+		get_datestamp(next->datestamp, sizeof(next->datestamp), next->now);
+	else
+		memcpy(next->datestamp, cur->datestamp, sizeof(next->datestamp));
+	__sync_synchronize();
+	coarse_time_seq = seq + 1;
+}
+
+static
+void *coarse_time_thread(__maybe_unused void *userdata)
+{
+	struct timeval tv_report;
+	unsigned long calls;
+	
+	pthread_detach(pthread_self());
+	RenameThread("coarsetime");
+	
+	timer_set_delay_from_now(&tv_report, 60000000);
+	while (true)
+	{
+		cgsleep_ms(BFG_COARSE_TIME_MS);
+		coarse_time_update();
+		
+		if (unlikely(opt_debug) && timer_passed(&tv_report, NULL))
+		{
+			calls = coarse_time_calls;
+			coarse_time_calls = 0;
+			applog(LOG_DEBUG, "Coarse time: %lu clock calls/s avoided", calls / 60);
+			timer_set_delay_from_now(&tv_report, 60000000);
+		}
+	}
+	return NULL;
+}
+
+static
+double coarse_time_bench_ns(const int which)
+{
+	const int iterations = 100000;
+	struct timeval tv_start, tv_end, tv;
+	char buf[24];
+	int i;
+	
+	cgtime(&tv_start);
+	for (i = 0; i < iterations; ++i)
+		switch (which)
+		{
+			case 0:  cgtime(&tv);  break;
+			case 1:  cgtime_coarse(&tv);  break;
+			case 2:  get_now_datestamp(buf, sizeof(buf));  break;
+			case 3:  get_coarse_datestamp(buf, sizeof(buf));  break;
+		}
+	cgtime(&tv_end);
+	return timer_elapsed_us(&tv_start, &tv_end) * 1000. / iterations;
+}
+
+void bfg_coarse_time_start(void)
+{
+	pthread_t pth;
+	
+	if (coarse_time_running)
+		return;
+	coarse_time_update();
+	if (unlikely(pthread_create(&pth, NULL, coarse_time_thread, NULL)))
+	{
+		applog(LOG_WARNING, "Failed to create coarse time thread, using the clock directly");
+		return;
+	}
+	coarse_time_running = true;
+	
+	if (opt_debug)
+	{
+		// get_now_datestamp itself uses the cache once it is running
+		coarse_time_running = false;
+		const double clk = coarse_time_bench_ns(0), ds = coarse_time_bench_ns(2);
+		coarse_time_running = true;
+		applog(LOG_DEBUG, "Coarse time: cgtime %.1f ns, cached %.1f ns; datestamp %.1f ns, cached %.1f ns",
+		       clk, coarse_time_bench_ns(1), ds, coarse_time_bench_ns(3));
+	}
+}
+
 void subtime(struct timeval *a, struct timeval *b)
 {
 	timersub(a, b, b);
@@ -2616,6 +2830,52 @@ void RenameThread(const char* name)
 #endif
 }
 
+int bfg_cpu_count(void)
+{
+#if defined(WIN32)
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors ?: 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	const long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? n : 1;
+#else
+	return 1;
+#endif
+}
+
+#ifndef HAVE_ATOMIC_U64
+static pthread_mutex_t bfg_atomic_u64_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t bfg_atomic_add_u64(volatile uint64_t * const p, const uint64_t n)
+{
+	uint64_t rv;
+	mutex_lock(&bfg_atomic_u64_lock);
+	rv = (*p += n);
+	mutex_unlock(&bfg_atomic_u64_lock);
+	return rv;
+}
+
+uint64_t bfg_atomic_xchg_u64(volatile uint64_t * const p, const uint64_t n)
+{
+	uint64_t rv;
+	mutex_lock(&bfg_atomic_u64_lock);
+	rv = *p;
+	*p = n;
+	mutex_unlock(&bfg_atomic_u64_lock);
+	return rv;
+}
+
+uint64_t bfg_atomic_load_u64(const volatile uint64_t * const p)
+{
+	uint64_t rv;
+	mutex_lock(&bfg_atomic_u64_lock);
+	rv = *p;
+	mutex_unlock(&bfg_atomic_u64_lock);
+	return rv;
+}
+#endif
+
 static pthread_key_t key_bfgtls;
 struct bfgtls_data {
 	char *bfg_strerror_result;
@@ -123,6 +123,8 @@ extern char *ucs2_to_utf8_dup(uint16_t *in, size_t sz);
 
 extern void gen_hash(unsigned char *data, unsigned char *hash, int len);
 extern void hash_data(unsigned char *out_hash, const unsigned char *data);
+extern void hash_data_midstate(unsigned char *out_hash, const unsigned char *midstate, const unsigned char *data);
+extern void hash_data_midstate_nonces(unsigned char *out_hashes, const unsigned char *midstate, const unsigned char *data, const uint32_t *nonces, unsigned count);
 extern void real_block_target(unsigned char *target, const unsigned char *data);
 extern bool hash_target_check(const unsigned char *hash, const unsigned char *target);
 extern bool hash_target_check_v(const unsigned char *hash, const unsigned char *target);
@@ -172,6 +174,18 @@ void dev_error(struct cgpu_info *dev, enum dev_reason reason);
 void *realloc_strcat(char *ptr, char *s);
 extern char *sanestr(char *o, char *s);
 void RenameThread(const char* name);
+extern int bfg_cpu_count(void);
+
+/* 64-bit counters, which are not natively atomic on many 32-bit hosts (MIPS, ARM) */
+#ifdef HAVE_ATOMIC_U64
+#define bfg_atomic_add_u64(p, n)  __atomic_add_fetch(p, n, __ATOMIC_RELAXED)
+#define bfg_atomic_xchg_u64(p, n)  __atomic_exchange_n(p, n, __ATOMIC_ACQ_REL)
+#define bfg_atomic_load_u64(p)  __atomic_load_n(p, __ATOMIC_RELAXED)
+#else
+extern uint64_t bfg_atomic_add_u64(volatile uint64_t *, uint64_t);
+extern uint64_t bfg_atomic_xchg_u64(volatile uint64_t *, uint64_t);
+extern uint64_t bfg_atomic_load_u64(const volatile uint64_t *);
+#endif
 
 enum bfg_strerror_type {
 	BST_ERRNO,
@@ -357,6 +371,13 @@ bool timer_isset(const struct timeval *tvp)
 extern void (*timer_set_now)(struct timeval *);
 #define cgtime(tvp)  timer_set_now(tvp)
 
+// Cached clocks for hot paths; at most BFG_COARSE_TIME_MS old once started
+#define BFG_COARSE_TIME_MS  100
+extern void bfg_coarse_time_start(void);
+extern void cgtime_coarse(struct timeval *);
+extern time_t time_coarse(void);
+extern bool get_coarse_datestamp(char *buf, size_t bufsz);
+
 #define TIMEVAL_USECS(usecs)  (  \
 	(struct timeval){  \
 		.tv_sec = (usecs) / 1000000,  \